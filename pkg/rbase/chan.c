@@ -29,6 +29,11 @@
 //#define DEBUG_CHAN_LOCK
 
 
+// WAIT_NONE and WAIT_FOREVER are special deadlines for send and recv functions.
+// Other deadlines are nanotime() values.
+#define WAIT_NONE    0ull
+#define WAIT_FOREVER UINT64_MAX
+
 // LINE_CACHE_SIZE is the size of a cache line of the target CPU.
 // The value 64 covers i386, x86_64, arm32, arm64.
 // Note that Intel TBB uses 128 (max_nfs_size).
@@ -175,13 +180,20 @@ ASSUME_NONNULL_BEGIN
 typedef struct Thr Thr;
 
 // Thr holds thread-specific data and is owned by thread-local storage
+// A Thr which is waiting in ChanSelect is not itself put in wait queues. Instead, each case
+// has a Thr on the stack of ChanSelect with selthr pointing to the selecting thread. Before
+// waking up such a waiter, the waker claims the select by setting selthr->selwin (see
+// wq_dequeue_claim) so that only one case proceeds.
 struct Thr {
   size_t         id;
   bool           init;
   atomic_bool    closed;
   LSema          sema;
+  u32            selseq; // ChanSelect: counter for picking the first case to poll
   Thr*           next ATTR_ALIGNED_LINE_CACHE; // list link
   _Atomic(void*) elemptr;
+  Thr* nullable  selthr;          // select case waiter: the selecting thread
+  _Atomic(Thr*)  nullable selwin; // selecting thread: the case waiter which was woken up
 };
 
 typedef struct WaitQ {
@@ -191,35 +203,37 @@ typedef struct WaitQ {
 
 typedef struct Chan {
   // These fields don't change after ChanOpen
-  uintptr_t memptr;   // memory allocation pointer
   Mem       mem;      // memory allocator this belongs to (immutable)
   size_t    elemsize; // size in bytes of elements sent on the channel
-  u32       qcap;     // size of the circular queue buf (immutable)
+  size_t    seqoffs;  // offset in buf of the slots' sequence numbers (immutable)
+  u32       qcap;     // number of slots in the circular queue buf (immutable)
+  bool      spsc;     // single sender & single receiver (immutable)
 
-  // These fields are frequently accessed and stored to.
-  // There's a perf opportunity here with a different more cache-efficient layout.
-  atomic_u32  qlen;   // number of messages currently queued in buf
   atomic_bool closed; // one way switch (once it becomes true, never becomes false again)
-  CHAN_LOCK_T lock;   // guards the Chan struct
+  CHAN_LOCK_T lock;   // guards sendq & recvq, and all state of unbuffered channels
 
-  // sendq is accessed on every call to chan_recv and only in some cases by chan_send,
-  // when parking a thread when there's no waiting receiver nor queued message.
-  // recvq is accessed on every call to chan_send and like sendq, only when parking a thread
-  // in chan_recv.
+  // Unbuffered channels access sendq on every call to chan_recv and recvq on every call
+  // to chan_send. Buffered channels only access them when parking a thread, and when
+  // waking up a parked thread after a send or receive.
   WaitQ sendq; // list of waiting send callers
   WaitQ recvq; // list of waiting recv callers
 
-  // sendx & recvx are likely to be falsely shared between threads.
-  // - sendx is loaded & stored by both chan_send and chan_recv
-  //   - chan_send for buffered channels when no receiver is waiting
-  //   - chan_recv when there's a waiting sender
-  // - recvx is only used by chan_recv
-  // So we make sure recvx ends up on a separate cache line.
-  atomic_u32 sendx; // send index in buf
-  atomic_u32 recvx ATTR_ALIGNED_LINE_CACHE; // receive index in buf
-
-  // u8 pad[LINE_CACHE_SIZE];
-  u8 buf[]; // queue storage
+  // sendx & recvx are the positions in buf of the next send and the next receive of
+  // buffered channels. They only ever increase; the slot of a position is pos % qcap.
+  // sendx is only stored to by senders and recvx only by receivers, so each gets its
+  // own cache line, together with the SPSC sender's or receiver's cached copy of the other.
+  atomic_size sendx ATTR_ALIGNED_LINE_CACHE;
+  size_t      sendx_recvx; // SPSC: recvx as last seen by the sender
+  atomic_size recvx ATTR_ALIGNED_LINE_CACHE;
+  size_t      recvx_sendx; // SPSC: sendx as last seen by the receiver
+
+  // queue storage: qcap elements, followed by a sequence number for each slot at seqoffs.
+  // A slot's seq tells what it's ready for: a slot at position pos can be sent to when
+  // seq==pos*2 and received from when seq==pos*2+1. A receiver advances seq to
+  // (pos+qcap)*2, for the position the slot has the next time around the queue.
+  // (Counting in steps of two keeps "full at pos" and "free at pos+1" apart when qcap is 1.)
+  // Elements are stored contiguously so that runs of them can be copied with memcpy.
+  u8 buf[] ATTR_ALIGNED_LINE_CACHE;
 } ATTR_ALIGNED_LINE_CACHE Chan;
 
 
@@ -243,6 +257,8 @@ inline static Thr* thr_current() {
 
 
 inline static void thr_signal(Thr* t) {
+  if (t->selthr)
+    t = t->selthr;
   LSemaSignal(&t->sema, 1); // wake
 }
 
@@ -253,6 +269,20 @@ inline static void thr_wait(Thr* t) {
 }
 
 
+// thr_wait_until blocks until t is signalled or deadline has passed.
+// Returns false if deadline passed.
+static bool thr_wait_until(Thr* t, u64 deadline) {
+  if (deadline == WAIT_FOREVER) {
+    thr_wait(t);
+    return true;
+  }
+  u64 now = nanotime();
+  if (now >= deadline)
+    return LSemaTryWait(&t->sema);
+  return LSemaTimedWait(&t->sema, (deadline - now + 999) / 1000);
+}
+
+
 static void wq_enqueue(WaitQ* wq, Thr* t) {
   // note: atomic loads & stores for cache reasons, not thread safety; c->lock is held.
   if (AtomicLoadAcq(&wq->first)) {
@@ -277,31 +307,88 @@ inline static Thr* nullable wq_dequeue(WaitQ* wq) {
 }
 
 
-// chan_bufptr returns the pointer to the i'th slot in the buffer
-inline static void* chan_bufptr(Chan* c, u32 i) {
-  return (void*)&c->buf[(uintptr_t)i * (uintptr_t)c->elemsize];
+// wq_dequeue_claim dequeues the first thread of wq which may be woken up.
+// Waiters of a select which has already been woken up by another channel are dropped.
+// Caller must hold lock on the channel.
+static Thr* nullable wq_dequeue_claim(WaitQ* wq) {
+  Thr* t;
+  while ((t = wq_dequeue(wq))) {
+    if (!t->selthr)
+      return t;
+    Thr* expect = NULL;
+    if (AtomicCASAcqRel(&t->selthr->selwin, &expect, t))
+      return t;
+  }
+  return NULL;
+}
+
+
+// wq_remove removes t from wq, if it's in wq. Caller must hold lock on the channel.
+// Returns false if t is not in wq.
+static bool wq_remove(WaitQ* wq, Thr* t) {
+  Thr* prev = NULL;
+  Thr* t2 = AtomicLoadAcq(&wq->first);
+  while (t2 && t2 != t) {
+    prev = t2;
+    t2 = t2->next;
+  }
+  if (!t2)
+    return false;
+  if (prev) {
+    prev->next = t->next;
+  } else {
+    AtomicStoreRel(&wq->first, t->next);
+  }
+  if (AtomicLoadAcq(&wq->last) == t)
+    AtomicStoreRel(&wq->last, prev);
+  t->next = NULL;
+  return true;
+}
+
+
+// chan_elem returns the address in buf of the element in slot i
+inline static void* chan_elem(Chan* c, u32 i) {
+  return &c->buf[(size_t)i * c->elemsize];
+}
+
+// chan_seq returns the sequence number of the slot for queue position pos
+inline static atomic_size* chan_seq(Chan* c, size_t pos) {
+  return (atomic_size*)&c->buf[c->seqoffs] + (pos % (size_t)c->qcap);
+}
+
+
+// chan_unpark_expired is called when thread t, parked in wq, timed out.
+// Returns true if t was removed from wq. Returns false if t was already dequeued by a thread
+// which is waking it up, in which case the operation completed and the wakeup is consumed.
+static bool chan_unpark_expired(Chan* c, WaitQ* wq, Thr* t) {
+  chan_lock(&c->lock);
+  bool removed = wq_remove(wq, t);
+  chan_unlock(&c->lock);
+  if (!removed)
+    thr_wait(t); // the wakeup is on its way
+  return removed;
 }
 
 
 // chan_park adds elemptr to wait queue wq, unlocks channel c and blocks the calling thread
-static Thr* chan_park(Chan* c, WaitQ* wq, void* elemptr) {
+// until it's woken up or deadline has passed. Returns false if deadline passed.
+static bool chan_park(Chan* c, WaitQ* wq, void* elemptr, u64 deadline) {
   // caller must hold lock on channel that owns wq
   auto t = thr_current();
   AtomicStore(&t->elemptr, elemptr);
+  AtomicStore(&t->closed, false);
   dlog_chan("park: elemptr %p", elemptr);
   wq_enqueue(wq, t);
   chan_unlock(&c->lock);
-  thr_wait(t);
-  return t;
+  if (thr_wait_until(t, deadline))
+    return true;
+  return !chan_unpark_expired(c, wq, t);
 }
 
 
+// chan_full reports whether a send on unbuffered channel c would block
 inline static bool chan_full(Chan* c) {
-  // c.qcap is immutable (never written after the channel is created)
-  // so it is safe to read at any time during channel operation.
-  if (c->qcap == 0)
-    return AtomicLoad(&c->recvq.first) == NULL;
-  return AtomicLoad(&c->qlen) == c->qcap;
+  return AtomicLoad(&c->recvq.first) == NULL;
 }
 
 
@@ -326,8 +413,9 @@ static bool chan_send_direct(Chan* c, void* srcelemptr, Thr* recvt) {
 }
 
 
-inline static bool chan_send(Chan* c, void* srcelemptr, bool* nullable closed) {
-  bool block = closed == NULL;
+// chan_send sends on an unbuffered channel
+inline static bool chan_send(Chan* c, void* srcelemptr, bool* nullable closed, u64 deadline) {
+  bool block = deadline != WAIT_NONE;
   dlog_send("srcelemptr %p", srcelemptr);
 
   // fast path for non-blocking send on full channel
@@ -354,15 +442,13 @@ inline static bool chan_send(Chan* c, void* srcelemptr, bool* nullable closed) {
 
   if (R_UNLIKELY(AtomicLoad(&c->closed))) {
     chan_unlock(&c->lock);
-    if (block) {
+    if (!closed)
       panic("send on closed channel");
-    } else {
-      *closed = true;
-    }
+    *closed = true;
     return false;
   }
 
-  Thr* recvt = wq_dequeue(&c->recvq);
+  Thr* recvt = wq_dequeue_claim(&c->recvq);
   if (recvt) {
     // Found a waiting receiver. recvt is blocked, waiting in chan_recv.
     // We pass the value we want to send directly to the receiver,
@@ -372,21 +458,7 @@ inline static bool chan_send(Chan* c, void* srcelemptr, bool* nullable closed) {
     return chan_send_direct(c, srcelemptr, recvt);
   }
 
-  if (AtomicLoad(&c->qlen) < c->qcap) {
-    // space available in message buffer -- enqueue
-    u32 i = AtomicAdd(&c->sendx, 1);
-    // copy *srcelemptr -> *dstelemptr
-    void* dstelemptr = chan_bufptr(c, i);
-    memcpy(dstelemptr, srcelemptr, c->elemsize);
-    dlog_send("enqueue elemptr %p at buf[%u]", srcelemptr, i);
-    if (i == c->qcap - 1)
-      AtomicStore(&c->sendx, 0);
-    AtomicAdd(&c->qlen, 1);
-    chan_unlock(&c->lock);
-    return true;
-  }
-
-  // buffer is full and there is no waiting receiver
+  // there is no waiting receiver
   if (!block) {
     chan_unlock(&c->lock);
     return false;
@@ -395,27 +467,34 @@ inline static bool chan_send(Chan* c, void* srcelemptr, bool* nullable closed) {
   // park the calling thread. Some recv caller will wake us up.
   // Note that chan_park calls chan_unlock(&c->lock)
   dlog_send("wait... (elemptr %p)", srcelemptr);
-  chan_park(c, &c->sendq, srcelemptr);
+  if (!chan_park(c, &c->sendq, srcelemptr, deadline)) {
+    dlog_send("timeout");
+    return false;
+  }
+  if (AtomicLoad(&thr_current()->closed)) {
+    dlog_send("woke up -- channel closed");
+    if (closed)
+      *closed = true;
+    return false;
+  }
   dlog_send("woke up -- sent elemptr %p", srcelemptr);
   return true;
 }
 
 
-// chan_empty reports whether a read from c would block (that is, the channel is empty).
+// chan_empty reports whether a read from unbuffered channel c would block.
 // It uses a single atomic read of mutable state.
 inline static bool chan_empty(Chan* c) {
-  // Note: qcap is immutable
-  if (c->qcap == 0)
-    return AtomicLoad(&c->sendq.first) == NULL;
-  return AtomicLoad(&c->qlen) == 0;
+  return AtomicLoad(&c->sendq.first) == NULL;
 }
 
 
 static bool chan_recv_direct(Chan* c, void* dstelemptr, Thr* st);
 
 
-inline static bool chan_recv(Chan* c, void* dstelemptr, bool* nullable closed) {
-  bool block = closed == NULL; // TODO: non-blocking path
+// chan_recv receives from an unbuffered channel
+inline static bool chan_recv(Chan* c, void* dstelemptr, bool* nullable closed, u64 deadline) {
+  bool block = deadline != WAIT_NONE;
   dlog_recv("dstelemptr %p", dstelemptr);
 
   // Fast path: check for failed non-blocking operation without acquiring the lock.
@@ -449,8 +528,8 @@ inline static bool chan_recv(Chan* c, void* dstelemptr, bool* nullable closed) {
 
   chan_lock(&c->lock);
 
-  if (AtomicLoad(&c->closed) && AtomicLoad(&c->qlen) == 0) {
-    // channel is closed and the buffer queue is empty
+  if (AtomicLoad(&c->closed)) {
+    // channel is closed
     dlog_recv("channel closed & empty queue");
     chan_unlock(&c->lock);
     memset(dstelemptr, 0, c->elemsize);
@@ -459,38 +538,15 @@ inline static bool chan_recv(Chan* c, void* dstelemptr, bool* nullable closed) {
     return false;
   }
 
-  Thr* t = wq_dequeue(&c->sendq);
+  Thr* t = wq_dequeue_claim(&c->sendq);
   if (t) {
-    // Found a waiting sender.
-    // If buffer is size 0, receive value directly from sender.
-    // Otherwise, receive from head of queue and add sender's value to the tail of the queue
-    // (both map to the same buffer slot because the queue is full).
+    // Found a waiting sender. Receive value directly from sender.
     // Note that chan_recv_direct calls chan_unlock(&c->lock).
     assert(t->init);
     return chan_recv_direct(c, dstelemptr, t);
   }
 
-  if (AtomicLoad(&c->qlen) > 0) {
-    // Receive directly from queue
-    u32 i = AtomicAdd(&c->recvx, 1);
-    if (i == c->qcap - 1)
-      AtomicStore(&c->recvx, 0);
-    AtomicSub(&c->qlen, 1);
-
-    // copy *srcelemptr -> *dstelemptr
-    void* srcelemptr = chan_bufptr(c, i);
-    memcpy(dstelemptr, srcelemptr, c->elemsize);
-    #ifdef DEBUG
-    memset(srcelemptr, 0, c->elemsize); // zero buffer memory
-    #endif
-
-    dlog_recv("dequeue elemptr %p from buf[%u]", srcelemptr, i);
-
-    chan_unlock(&c->lock);
-    return true;
-  }
-
-  // No message available -- nothing queued and no waiting senders
+  // No message available -- no waiting senders
   if (!block) {
     chan_unlock(&c->lock);
     return false;
@@ -505,7 +561,11 @@ inline static bool chan_recv(Chan* c, void* dstelemptr, bool* nullable closed) {
   // Block by parking the thread. Some send caller will wake us up.
   // Note that chan_park calls chan_unlock(&c->lock)
   dlog_recv("wait... (elemptr %p)", dstelemptr);
-  t = chan_park(c, &c->recvq, dstelemptr);
+  if (!chan_park(c, &c->recvq, dstelemptr, deadline)) {
+    dlog_recv("timeout");
+    return false;
+  }
+  t = thr_current();
 
   // woken up by sender or close call
   if (AtomicLoad(&t->closed)) {
@@ -522,86 +582,339 @@ inline static bool chan_recv(Chan* c, void* dstelemptr, bool* nullable closed) {
 ret_closed:
   dlog_recv("channel closed");
   memset(dstelemptr, 0, c->elemsize);
+  if (closed)
+    *closed = true;
   return false;
 }
 
 
-// chan_recv_direct processes a receive operation on a full channel c
+// chan_recv_direct processes a receive operation on unbuffered channel c
 static bool chan_recv_direct(Chan* c, void* dstelemptr, Thr* sendert) {
-  // There are 2 parts:
-  // 1) The value sent by the sender sg is put into the channel and the sender
-  //    is woken up to go on its merry way.
-  // 2) The value received by the receiver (the current G) is written to ep.
-  // For synchronous (unbuffered) channels, both values are the same.
-  // For asynchronous (buffered) channels, the receiver gets its data from
-  // the channel buffer and the sender's data is put in the channel buffer.
-  // Channel c must be full and locked.
-  // sendert must already be dequeued from c.sendq.
-  bool ok = true;
-
-  if (AtomicLoad(&c->qlen) == 0) {
-    // Copy data from sender
-    void* srcelemptr = AtomicLoadx(&sendert->elemptr, memory_order_consume);
-    dlog_recv("direct recv of srcelemptr %p from [%zu] (dstelemptr %p, buffer empty)",
-      srcelemptr, sendert->id, dstelemptr);
-    assertnotnull(srcelemptr);
-    memcpy(dstelemptr, srcelemptr, c->elemsize);
-  } else {
-    // Queue is full. Take the item at the head of the queue.
-    // Make the sender enqueue its item at the tail of the queue.
-    // Since the queue is full, those are both the same slot.
-    dlog_recv("direct recv from [%zu] (dstelemptr %p, buffer full)", sendert->id, dstelemptr);
-    //assert_debug(AtomicLoad(&c->qlen) == c->qcap); // queue is full
-
-    // copy element from queue to receiver
-    u32 i = AtomicAdd(&c->recvx, 1);
-    if (i == c->qcap - 1) {
-      AtomicStore(&c->recvx, 0);
-      AtomicStore(&c->sendx, 0);
-    } else {
-      AtomicStore(&c->sendx, i + 1);
+  // The value sent by the sender is copied to the receiver and the sender is woken up to
+  // go on its merry way.
+  // Channel c must be locked. sendert must already be dequeued from c.sendq.
+  void* srcelemptr = AtomicLoadx(&sendert->elemptr, memory_order_consume);
+  dlog_recv("direct recv of srcelemptr %p from [%zu] (dstelemptr %p)",
+    srcelemptr, sendert->id, dstelemptr);
+  assertnotnull(srcelemptr);
+  memcpy(dstelemptr, srcelemptr, c->elemsize);
+
+  chan_unlock(&c->lock);
+  thr_signal(sendert); // wake up chan_send caller
+  return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// buffered channels
+//
+// Buffered channels are bounded lock-free queues over buf, after Dmitry Vyukov's bounded
+// MPMC queue (1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue).
+// A sender claims the slot at sendx by advancing sendx with CAS when the slot's seq says
+// that it's free, copies its message to the slot and then publishes it by storing seq.
+// Receivers do the same with recvx. c->lock is only taken to park or wake up a thread,
+// which happens when the queue is full (send) or empty (recv).
+//
+// Unlike unbuffered channels, messages are never handed over directly to parked threads.
+// A parked thread is woken up after the queue changed in its favor and then tries again.
+// To not lose wakeups, a parking thread adds itself to its wait queue and then checks the
+// queue again, while a sender or receiver checks the wait queue after updating the queue,
+// both with a full memory barrier in between. At least one of them sees the other's write.
+
+// chan_copyin copies n elements from src to the queue slots starting at position pos
+static void chan_copyin(Chan* c, size_t pos, const u8* src, u32 n) {
+  u32 i = (u32)(pos % c->qcap);
+  u32 n1 = MIN(n, c->qcap - i); // elements until the end of buf
+  memcpy(chan_elem(c, i), src, (size_t)n1 * c->elemsize);
+  if (n1 < n)
+    memcpy(chan_elem(c, 0), src + (size_t)n1 * c->elemsize, (size_t)(n - n1) * c->elemsize);
+}
+
+// chan_copyout copies n elements from the queue slots starting at position pos to dst
+static void chan_copyout(Chan* c, size_t pos, u8* dst, u32 n) {
+  u32 i = (u32)(pos % c->qcap);
+  u32 n1 = MIN(n, c->qcap - i);
+  memcpy(dst, chan_elem(c, i), (size_t)n1 * c->elemsize);
+  if (n1 < n)
+    memcpy(dst + (size_t)n1 * c->elemsize, chan_elem(c, 0), (size_t)(n - n1) * c->elemsize);
+}
+
+// SPSC channels have exactly one sender thread and one receiver thread, so sendx and recvx
+// are each only ever stored to by one thread and slots don't need sequence numbers. The
+// sender keeps a copy of recvx and only loads recvx (the receiver's cache line) when the
+// copy says that the queue doesn't have room for all n elements. The receiver does the
+// same with sendx.
+
+static u32 chan_tryenqueue_spsc(Chan* c, const u8* elems, u32 n) {
+  size_t pos = AtomicLoad(&c->sendx);
+  if (c->qcap - (pos - c->sendx_recvx) < n)
+    c->sendx_recvx = AtomicLoadAcq(&c->recvx);
+  n = MIN(n, c->qcap - (u32)(pos - c->sendx_recvx));
+  if (n == 0)
+    return 0;
+  chan_copyin(c, pos, elems, n);
+  AtomicStoreRel(&c->sendx, pos + n);
+  return n;
+}
+
+static u32 chan_trydequeue_spsc(Chan* c, u8* elems, u32 n) {
+  size_t pos = AtomicLoad(&c->recvx);
+  if (c->recvx_sendx - pos < n)
+    c->recvx_sendx = AtomicLoadAcq(&c->sendx);
+  n = MIN(n, (u32)(c->recvx_sendx - pos));
+  if (n == 0)
+    return 0;
+  chan_copyout(c, pos, elems, n);
+  AtomicStoreRel(&c->recvx, pos + n);
+  return n;
+}
+
+// chan_tryenqueue copies up to n elements to the tail of the queue.
+// Returns the number of elements enqueued, which is 0 if the queue is full.
+static u32 chan_tryenqueue(Chan* c, const u8* elems, u32 n) {
+  if (c->spsc)
+    return chan_tryenqueue_spsc(c, elems, n);
+  size_t pos = AtomicLoad(&c->sendx);
+  for (;;) {
+    ssize_t dif = (ssize_t)AtomicLoadAcq(chan_seq(c, pos)) - (ssize_t)(pos * 2);
+    if (dif < 0) {
+      // slot still holds the message sent qcap positions ago; the queue is full
+      return 0;
     }
+    if (dif > 0) {
+      // another sender claimed the slot
+      pos = AtomicLoad(&c->sendx);
+      continue;
+    }
+    // slot is free; count how many of the following slots are free too and claim them
+    // all at once (on failure, CAS loads the current sendx into pos)
+    u32 k = 1;
+    while (k < n && k < c->qcap && AtomicLoadAcq(chan_seq(c, pos + k)) == (pos + k) * 2)
+      k++;
+    if (AtomicCAS(&c->sendx, &pos, pos + k)) {
+      chan_copyin(c, pos, elems, k);
+      for (u32 i = 0; i < k; i++)
+        AtomicStoreRel(chan_seq(c, pos + i), (pos + i) * 2 + 1);
+      dlog_send("enqueue %u elements at buf[%zu]", k, pos % c->qcap);
+      return k;
+    }
+  }
+}
 
-    // copy c->buf[i] -> *dstelemptr
-    void* bufelemptr = chan_bufptr(c, i);
-    assertnotnull(bufelemptr);
-    memcpy(dstelemptr, bufelemptr, c->elemsize);
-    dlog_recv("dequeue srcelemptr %p from buf[%u]", bufelemptr, i);
+// chan_trydequeue copies up to n elements from the head of the queue to elems.
+// Returns the number of elements dequeued, which is 0 if the queue is empty.
+static u32 chan_trydequeue(Chan* c, u8* elems, u32 n) {
+  if (c->spsc)
+    return chan_trydequeue_spsc(c, elems, n);
+  size_t pos = AtomicLoad(&c->recvx);
+  for (;;) {
+    ssize_t dif = (ssize_t)AtomicLoadAcq(chan_seq(c, pos)) - (ssize_t)(pos * 2 + 1);
+    if (dif < 0) {
+      // slot has not been sent to yet; the queue is empty
+      return 0;
+    }
+    if (dif > 0) {
+      pos = AtomicLoad(&c->recvx);
+      continue;
+    }
+    u32 k = 1;
+    while (k < n && k < c->qcap && AtomicLoadAcq(chan_seq(c, pos + k)) == (pos + k) * 2 + 1)
+      k++;
+    if (AtomicCAS(&c->recvx, &pos, pos + k)) {
+      chan_copyout(c, pos, elems, k);
+      for (u32 i = 0; i < k; i++)
+        AtomicStoreRel(chan_seq(c, pos + i), (pos + i + c->qcap) * 2);
+      dlog_recv("dequeue %u elements from buf[%zu]", k, pos % c->qcap);
+      return k;
+    }
+  }
+}
 
-    // copy *sendert->elemptr -> c->buf[i]
-    void* srcelemptr = AtomicLoadx(&sendert->elemptr, memory_order_consume);
-    assertnotnull(srcelemptr);
-    memcpy(bufelemptr, srcelemptr, c->elemsize);
-    dlog_recv("enqueue srcelemptr %p to buf[%u]", srcelemptr, i);
+// chan_cansend reports whether the queue has a free slot
+static bool chan_cansend(Chan* c) {
+  if (c->spsc)
+    return AtomicLoad(&c->sendx) - AtomicLoadAcq(&c->recvx) < c->qcap;
+  for (;;) {
+    size_t pos = AtomicLoad(&c->sendx);
+    ssize_t dif = (ssize_t)AtomicLoadAcq(chan_seq(c, pos)) - (ssize_t)(pos * 2);
+    if (dif <= 0)
+      return dif == 0;
   }
+}
+
+// chan_canrecv reports whether the queue has a message
+static bool chan_canrecv(Chan* c) {
+  if (c->spsc)
+    return AtomicLoad(&c->recvx) != AtomicLoadAcq(&c->sendx);
+  for (;;) {
+    size_t pos = AtomicLoad(&c->recvx);
+    ssize_t dif = (ssize_t)AtomicLoadAcq(chan_seq(c, pos)) - (ssize_t)(pos * 2 + 1);
+    if (dif <= 0)
+      return dif == 0;
+  }
+}
 
+// chan_wake wakes up to n threads parked in wq.
+// Called after a successful enqueue (wq=recvq) or dequeue (wq=sendq) of n elements.
+inline static void chan_wake(Chan* c, WaitQ* wq, u32 n) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (R_LIKELY(AtomicLoad(&wq->first) == NULL))
+    return;
+
+  // dequeue threads into a list linked by Thr.next and signal them after unlocking
+  Thr* woken = NULL;
+  chan_lock(&c->lock);
+  for (u32 i = 0; i < n; i++) {
+    Thr* t = wq_dequeue_claim(wq);
+    if (!t)
+      break;
+    t->next = woken;
+    woken = t;
+  }
   chan_unlock(&c->lock);
-  thr_signal(sendert); // wake up chan_send caller
-  return ok;
+
+  while (woken) {
+    Thr* t = woken;
+    woken = t->next;
+    t->next = NULL;
+    thr_signal(t);
+  }
 }
 
+// chan_park_buffered parks the calling thread in wq until it's woken up by chan_wake or
+// ChanClose, or until deadline has passed. Returns immediately if the channel is closed or
+// if ready(c) is true after the thread was added to wq. Returns false if deadline passed.
+static bool chan_park_buffered(Chan* c, WaitQ* wq, bool(*ready)(Chan*), u64 deadline) {
+  // give other threads a chance to make ready(c) true before going the slow way
+  thrd_yield();
+  if (ready(c))
+    return true;
+  Thr* t = thr_current();
+  chan_lock(&c->lock);
+  if (AtomicLoad(&c->closed)) {
+    // ChanClose has already woken up all parked threads
+    chan_unlock(&c->lock);
+    return true;
+  }
+  wq_enqueue(wq, t);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (ready(c)) {
+    wq_remove(wq, t);
+    chan_unlock(&c->lock);
+    return true;
+  }
+  chan_unlock(&c->lock);
+  if (thr_wait_until(t, deadline))
+    return true;
+  // Woken up anyway if dequeued by chan_wake or ChanClose, which means that the queue or
+  // channel changed in our favor, so try once more.
+  return !chan_unpark_expired(c, wq, t);
+}
+
+
+// chan_send_buffered sends n elements, waiting for room in the queue until deadline.
+// Returns the number of elements sent, which is less than n if the channel was closed or
+// if the deadline passed.
+static u32 chan_send_buffered(
+  Chan* c, const void* elems, u32 n, bool* nullable closed, u64 deadline)
+{
+  bool block = deadline != WAIT_NONE;
+  bool parked = false;
+  u32 nsent = 0;
+  dlog_send("elems %p n %u", elems, n);
+  for (;;) {
+    if (R_UNLIKELY(AtomicLoad(&c->closed))) {
+      if (closed) {
+        *closed = true;
+      } else if (!parked && nsent == 0) {
+        panic("send on closed channel");
+      }
+      return nsent;
+    }
+    u32 k = chan_tryenqueue(c, (const u8*)elems + (size_t)nsent * c->elemsize, n - nsent);
+    if (k > 0) {
+      chan_wake(c, &c->recvq, k);
+      nsent += k;
+      if (nsent == n)
+        return n;
+      continue;
+    }
+    if (!block)
+      return nsent;
+    dlog_send("wait... (elems %p)", elems);
+    parked = true;
+    if (!chan_park_buffered(c, &c->sendq, chan_cansend, deadline))
+      return nsent;
+  }
+}
 
-Chan* nullable ChanOpen(Mem mem, size_t elemsize, u32 bufcap) {
-  i64 memsize = (i64)sizeof(Chan) + ((i64)bufcap * (i64)elemsize);
 
-  // ensure we have enough space to offset the allocation by line cache (for alignment)
-  memsize = align2(memsize + ((LINE_CACHE_SIZE+1) / 2), LINE_CACHE_SIZE);
+// chan_recv_buffered receives at least one and up to n elements, waiting for messages
+// until deadline. Returns the number of elements received, which is 0 if the channel is
+// closed and empty or if the deadline passed.
+static u32 chan_recv_buffered(Chan* c, void* elems, u32 n, bool* nullable closed, u64 deadline) {
+  bool block = deadline != WAIT_NONE;
+  dlog_recv("elems %p n %u", elems, n);
+  for (;;) {
+    u32 k = chan_trydequeue(c, elems, n);
+    if (k > 0) {
+      chan_wake(c, &c->sendq, k);
+      return k;
+    }
+    if (AtomicLoad(&c->closed)) {
+      // A message may have been sent between the dequeue attempt and the closed check.
+      // Messages sent before ChanClose must be delivered, so try again.
+      if ((k = chan_trydequeue(c, elems, n)) > 0) {
+        chan_wake(c, &c->sendq, k);
+        return k;
+      }
+      dlog_recv("channel closed");
+      memset(elems, 0, c->elemsize);
+      if (closed)
+        *closed = true;
+      return 0;
+    }
+    if (!block)
+      return 0;
+    dlog_recv("wait... (elems %p)", elems);
+    if (!chan_park_buffered(c, &c->recvq, chan_canrecv, deadline))
+      return 0;
+  }
+}
+
+
+// chan_seqoffs returns the offset in buf of the sequence numbers of a buffered channel
+static size_t chan_seqoffs(size_t elemsize, u32 bufcap) {
+  return align2((size_t)bufcap * elemsize, _Alignof(atomic_size));
+}
+
+
+// chan_memsize returns the number of bytes allocated for a channel
+static size_t chan_memsize(size_t elemsize, u32 bufcap) {
+  i64 memsize = (i64)sizeof(Chan) + (i64)chan_seqoffs(elemsize, bufcap)
+              + ((i64)bufcap * (i64)sizeof(atomic_size));
 
   // check for overflow
   if (memsize < (i64)sizeof(Chan))
     panic("buffer size out of range");
 
-  // allocate memory, placing Chan at a line cache address boundary
-  uintptr_t ptr = (uintptr_t)memalloc(mem, memsize);
+  return (size_t)memsize;
+}
 
-  // align c to line cache boundary
-  Chan* c = (Chan*)align2(ptr, LINE_CACHE_SIZE);
 
-  c->memptr = ptr;
+Chan* nullable ChanOpen(Mem mem, size_t elemsize, u32 bufcap) {
+  // allocate memory, placing Chan at a line cache address boundary
+  Chan* c = memalloc_aligned(mem, chan_memsize(elemsize, bufcap), LINE_CACHE_SIZE);
+  if (!c)
+    return NULL;
+
   c->mem = mem;
   c->elemsize = elemsize;
+  c->seqoffs = chan_seqoffs(elemsize, bufcap);
   c->qcap = bufcap;
   chan_lock_init(&c->lock);
+  for (u32 i = 0; i < bufcap; i++)
+    AtomicStore(chan_seq(c, i), (size_t)i * 2);
 
   // make sure that the thread setting up the channel gets a low thread_id
   #ifdef DEBUG_CHAN_LOG
@@ -612,6 +925,15 @@ Chan* nullable ChanOpen(Mem mem, size_t elemsize, u32 bufcap) {
 }
 
 
+Chan* nullable ChanOpenSPSC(Mem mem, size_t elemsize, u32 bufcap) {
+  assertf(bufcap > 0, "SPSC channels must be buffered");
+  Chan* c = ChanOpen(mem, elemsize, bufcap);
+  if (c)
+    c->spsc = true;
+  return c;
+}
+
+
 void ChanClose(Chan* c) {
   dlog_chan("--- close ---");
 
@@ -626,8 +948,12 @@ void ChanClose(Chan* c) {
   while (t) {
     dlog_chan("close: wake recv [%zu]", t->id);
     Thr* next = t->next;
-    AtomicStore(&t->closed, true);
-    thr_signal(t);
+    t->next = NULL;
+    Thr* expect = NULL;
+    if (!t->selthr || AtomicCASAcqRel(&t->selthr->selwin, &expect, t)) {
+      AtomicStore(&t->closed, true);
+      thr_signal(t);
+    }
     t = next;
   }
 
@@ -635,11 +961,19 @@ void ChanClose(Chan* c) {
   while (t) {
     dlog_chan("close: wake send [%zu]", t->id);
     Thr* next = t->next;
-    AtomicStore(&t->closed, true);
-    thr_signal(t);
+    t->next = NULL;
+    Thr* expect = NULL;
+    if (!t->selthr || AtomicCASAcqRel(&t->selthr->selwin, &expect, t)) {
+      AtomicStore(&t->closed, true);
+      thr_signal(t);
+    }
     t = next;
   }
 
+  // all threads have been woken up; make sure chan_wake doesn't signal them again
+  AtomicStoreRel(&c->recvq.first, NULL);
+  AtomicStoreRel(&c->sendq.first, NULL);
+
   chan_unlock(&c->lock);
   dlog_chan("close: done");
 }
@@ -648,15 +982,267 @@ void ChanClose(Chan* c) {
 void ChanFree(Chan* c) {
   assert(AtomicLoadAcq(&c->closed)); // must close channel before freeing its memory
   chan_lock_dispose(&c->lock);
-  memfree(c->mem, (void*)c->memptr);
+  memfree_aligned(c->mem, c, chan_memsize(c->elemsize, c->qcap));
+}
+
+
+// ----------------------------------------------------------------------------
+// select
+//
+// ChanSelect first polls all cases without blocking, starting at a different case each
+// time for fairness. If no case is ready, it locks all channels in address order (so that
+// concurrent selects can't deadlock), adds a waiter for each case to the channel's wait
+// queue, checks once more whether a case became ready and then parks the thread.
+// A buffered channel wakes up a waiter to retry, so ChanSelect polls again after waking up,
+// while an unbuffered channel hands over the message directly, which completes the case.
+
+// SELECT_NSTACK is the number of cases for which ChanSelect doesn't allocate memory
+#define SELECT_NSTACK 8
+
+// select_lock locks the channels of cases in the order of order, which is sorted by address
+static void select_lock(ChanSelectCase* cases, const u32* order, u32 ncases) {
+  for (u32 i = 0; i < ncases; i++) {
+    Chan* c = cases[order[i]].ch;
+    if (i == 0 || c != cases[order[i - 1]].ch) // same channel in several cases
+      chan_lock(&c->lock);
+  }
+}
+
+static void select_unlock(ChanSelectCase* cases, const u32* order, u32 ncases) {
+  for (u32 i = ncases; i > 0; i--) {
+    Chan* c = cases[order[i - 1]].ch;
+    if (i == 1 || c != cases[order[i - 2]].ch)
+      chan_unlock(&c->lock);
+  }
+}
+
+// select_poll tries each case once without blocking.
+// Returns the index of the case which proceeded, or -1 if none is ready.
+static int select_poll(ChanSelectCase* cases, u32 ncases, u32 start) {
+  for (u32 n = 0; n < ncases; n++) {
+    u32 i = (start + n) % ncases;
+    ChanSelectCase* sc = &cases[i];
+    bool closed = false;
+    if (sc->send) {
+      if (ChanTrySend(sc->ch, sc->elemptr, &closed)) {
+        sc->ok = true;
+        return (int)i;
+      }
+      if (closed)
+        panic("send on closed channel");
+    } else {
+      if (ChanTryRecv(sc->ch, sc->elemptr, &closed) || closed) {
+        sc->ok = !closed;
+        return (int)i;
+      }
+    }
+  }
+  return -1;
+}
+
+// select_ready reports whether a case may proceed. Channels must be locked.
+static bool select_ready(ChanSelectCase* sc, Thr* t) {
+  Chan* c = sc->ch;
+  if (AtomicLoad(&c->closed))
+    return true;
+  if (c->qcap > 0)
+    return sc->send ? chan_cansend(c) : chan_canrecv(c);
+  // unbuffered channels are ready when another thread is waiting on the other end
+  for (Thr* t2 = AtomicLoad(&(sc->send ? &c->recvq : &c->sendq)->first); t2; t2 = t2->next) {
+    if (t2->selthr != t)
+      return true;
+  }
+  return false;
 }
 
+static int chan_select(ChanSelectCase* cases, u32 ncases, bool block) {
+  Thr* t = thr_current();
+  for (u32 i = 0; i < ncases; i++)
+    cases[i].ok = false;
+
+  int i = select_poll(cases, ncases, t->selseq++);
+  if (i > -1 || !block || ncases == 0)
+    return i;
+
+  Thr stackwaiters[SELECT_NSTACK];
+  u32 stackorder[SELECT_NSTACK];
+  Thr* waiters = stackwaiters;
+  u32* order = stackorder;
+  if (ncases > SELECT_NSTACK) {
+    waiters = memalloc(MemLibC(), (sizeof(Thr) + sizeof(u32)) * (size_t)ncases);
+    if (!waiters)
+      panic("ChanSelect: out of memory");
+    order = (u32*)&waiters[ncases];
+  }
+
+  // lock order (insertion sort of case indices by channel address)
+  for (u32 j = 0; j < ncases; j++) {
+    u32 k = j;
+    for (; k > 0 && (uintptr_t)cases[order[k - 1]].ch > (uintptr_t)cases[j].ch; k--)
+      order[k] = order[k - 1];
+    order[k] = j;
+  }
+
+  for (;;) {
+    select_lock(cases, order, ncases);
+
+    // enqueue a waiter for each case
+    AtomicStore(&t->selwin, NULL);
+    for (u32 j = 0; j < ncases; j++) {
+      Thr* w = &waiters[j];
+      memset(w, 0, sizeof(*w));
+      w->id = t->id;
+      w->init = true;
+      w->selthr = t;
+      AtomicStore(&w->elemptr, cases[j].elemptr);
+      Chan* c = cases[j].ch;
+      wq_enqueue(cases[j].send ? &c->sendq : &c->recvq, w);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // check if a case became ready while we were polling
+    bool ready = false;
+    for (u32 j = 0; j < ncases && !ready; j++)
+      ready = select_ready(&cases[j], t);
+
+    Thr* expect = NULL;
+    if (ready && AtomicCASAcqRel(&t->selwin, &expect, t)) {
+      // we claimed our own select; no channel can wake us up now
+    } else {
+      // wait until a channel claims our select and wakes us up
+      select_unlock(cases, order, ncases);
+      thr_wait(t);
+      select_lock(cases, order, ncases);
+    }
+
+    // remove the waiters of cases that did not proceed
+    for (u32 j = 0; j < ncases; j++) {
+      Chan* c = cases[j].ch;
+      wq_remove(cases[j].send ? &c->sendq : &c->recvq, &waiters[j]);
+    }
+    select_unlock(cases, order, ncases);
+
+    Thr* w = AtomicLoadAcq(&t->selwin);
+    u32 start = t->selseq++;
+    if (w != t) {
+      i = (int)(w - waiters);
+      ChanSelectCase* sc = &cases[i];
+      if (AtomicLoad(&w->closed) && (sc->send || sc->ch->qcap == 0)) {
+        // woken up by ChanClose. (Receivers of buffered channels poll, to get messages
+        // sent before the channel was closed.)
+        if (!sc->send)
+          memset(sc->elemptr, 0, sc->ch->elemsize);
+        break;
+      }
+      if (sc->ch->qcap == 0) {
+        // message was handed over by a thread on the other end of an unbuffered channel
+        sc->ok = true;
+        break;
+      }
+      // A buffered channel woke us up instead of other threads waiting on it. Poll its case
+      // first so that the message or free slot it woke us up for isn't left behind while
+      // those threads keep waiting. If the case can't proceed, another thread got there
+      // first and there's no wakeup to pass on.
+      start = (u32)i;
+    }
+
+    // a buffered channel changed in our favor; try again
+    if ((i = select_poll(cases, ncases, start)) > -1)
+      break;
+  }
+
+  if (waiters != stackwaiters)
+    memfree(MemLibC(), waiters);
+  return i;
+}
+
+
+u32 ChanCap(const Chan* c) { return c->qcap; }
+
+inline static bool chan_send1(Chan* c, void* elemptr, bool* nullable closed, u64 deadline) {
+  if (c->qcap > 0)
+    return chan_send_buffered(c, elemptr, 1, closed, deadline) == 1;
+  return chan_send(c, elemptr, closed, deadline);
+}
+
+inline static bool chan_recv1(Chan* c, void* elemptr, bool* nullable closed, u64 deadline) {
+  if (c->qcap > 0)
+    return chan_recv_buffered(c, elemptr, 1, closed, deadline) == 1;
+  return chan_recv(c, elemptr, closed, deadline);
+}
 
-u32  ChanCap(const Chan* c) { return c->qcap; }
-bool ChanSend(Chan* c, void* elemptr)                  { return chan_send(c, elemptr, NULL); }
-bool ChanRecv(Chan* c, void* elemptr)                  { return chan_recv(c, elemptr, NULL); }
-bool ChanTrySend(Chan* c, void* elemptr, bool* closed) { return chan_send(c, elemptr, closed); }
-bool ChanTryRecv(Chan* c, void* elemptr, bool* closed) { return chan_recv(c, elemptr, closed); }
+// chan_deadline returns the deadline for a timeout in microseconds
+static u64 chan_deadline(u64 timeout_usecs) {
+  u64 now = nanotime();
+  if (timeout_usecs > (WAIT_FOREVER - now) / 1000)
+    return WAIT_FOREVER - 1;
+  return now + timeout_usecs * 1000;
+}
+
+bool ChanSend(Chan* c, void* elemptr) {
+  return chan_send1(c, elemptr, NULL, WAIT_FOREVER);
+}
+
+bool ChanRecv(Chan* c, void* elemptr) {
+  return chan_recv1(c, elemptr, NULL, WAIT_FOREVER);
+}
+
+bool ChanTrySend(Chan* c, void* elemptr, bool* closed) {
+  return chan_send1(c, elemptr, closed, WAIT_NONE);
+}
+
+bool ChanTryRecv(Chan* c, void* elemptr, bool* closed) {
+  return chan_recv1(c, elemptr, closed, WAIT_NONE);
+}
+
+bool ChanSendTimeout(Chan* c, void* elemptr, u64 timeout_usecs, bool* closed) {
+  return chan_send1(c, elemptr, closed, chan_deadline(timeout_usecs));
+}
+
+bool ChanRecvTimeout(Chan* c, void* elemptr, u64 timeout_usecs, bool* closed) {
+  return chan_recv1(c, elemptr, closed, chan_deadline(timeout_usecs));
+}
+
+bool ChanSendDeadline(Chan* c, void* elemptr, u64 deadline, bool* closed) {
+  return chan_send1(c, elemptr, closed, MAX(deadline, 1));
+}
+
+bool ChanRecvDeadline(Chan* c, void* elemptr, u64 deadline, bool* closed) {
+  return chan_recv1(c, elemptr, closed, MAX(deadline, 1));
+}
+
+u32 ChanSendN(Chan* c, const void* elems, u32 n) {
+  if (c->qcap > 0)
+    return chan_send_buffered(c, elems, n, NULL, WAIT_FOREVER);
+  for (u32 i = 0; i < n; i++) {
+    if (!chan_send(c, (u8*)elems + (size_t)i * c->elemsize, NULL, WAIT_FOREVER))
+      return i;
+  }
+  return n;
+}
+
+u32 ChanRecvN(Chan* c, void* elems, u32 maxn) {
+  if (maxn == 0)
+    return 0;
+  if (c->qcap > 0)
+    return chan_recv_buffered(c, elems, maxn, NULL, WAIT_FOREVER);
+  // wait for one element, then take what senders have ready without blocking
+  if (!chan_recv(c, elems, NULL, WAIT_FOREVER))
+    return 0;
+  u32 n = 1;
+  bool closed = false;
+  while (n < maxn && chan_recv(c, (u8*)elems + (size_t)n * c->elemsize, &closed, WAIT_NONE))
+    n++;
+  return n;
+}
+
+int ChanSelect(ChanSelectCase* cases, u32 ncases) {
+  return chan_select(cases, ncases, true);
+}
+
+int ChanTrySelect(ChanSelectCase* cases, u32 ncases) {
+  return chan_select(cases, ncases, false);
+}
 
 
 ASSUME_NONNULL_END
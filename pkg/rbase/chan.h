@@ -26,6 +26,12 @@ typedef struct Chan Chan; // opaque
 // If bufcap>0 then a buffered channel with the capacity to hold bufcap elements is created.
 Chan* ChanOpen(Mem mem, size_t elemsize, u32 bufcap);
 
+// ChanOpenSPSC creates a buffered channel for exactly one sender thread and one receiver
+// thread, which is cheaper than a channel created with ChanOpen. bufcap must be >0.
+// Sending or receiving on the channel from more than one thread at a time is not allowed,
+// but it's fine to e.g. hand over the sending end to another thread.
+Chan* ChanOpenSPSC(Mem mem, size_t elemsize, u32 bufcap);
+
 // ChanClose cancels any waiting senders and receivers.
 // Messages sent before this call are guaranteed to be delivered, assuming there are
 // active receivers. Once a channel is closed it can not be reopened nor sent to.
@@ -48,6 +54,33 @@ bool ChanSend(Chan*, void* elemptr);
 // Returns true if a message was received, false if the channel is closed.
 bool ChanRecv(Chan*, void* elemptr);
 
+// ChanSendTimeout works like ChanSend but gives up when the message could not be sent
+// within timeout_usecs microseconds. Returns true if the message was sent. Returns false if
+// the timeout expired or the channel is closed, in which case *closed is set to true.
+bool ChanSendTimeout(Chan*, void* elemptr, u64 timeout_usecs, bool* closed);
+
+// ChanRecvTimeout works like ChanRecv but gives up when no message arrived within
+// timeout_usecs microseconds. Returns true if a message was received. Returns false if the
+// timeout expired or the channel is closed, in which case *closed is set to true.
+bool ChanRecvTimeout(Chan*, void* elemptr, u64 timeout_usecs, bool* closed);
+
+// ChanSendDeadline and ChanRecvDeadline work like ChanSendTimeout and ChanRecvTimeout but
+// give up at deadline, a nanotime() value, which is convenient when several operations
+// share a time budget.
+bool ChanSendDeadline(Chan*, void* elemptr, u64 deadline, bool* closed);
+bool ChanRecvDeadline(Chan*, void* elemptr, u64 deadline, bool* closed);
+
+// ChanSendN sends n elements from the array elems, blocking until all of them are sent or
+// the channel is closed. Elements are copied to a buffered channel in runs, as many at a
+// time as there's room for, waking up waiting receivers once per run.
+// Returns the number of elements sent, which is less than n only if the channel closed.
+u32 ChanSendN(Chan*, const void* elems, u32 n);
+
+// ChanRecvN receives up to maxn elements into the array elems. Blocks until at least one
+// element is available or the channel is closed, then receives as many as are available.
+// Returns the number of elements received, or 0 if the channel is closed.
+u32 ChanRecvN(Chan*, void* elems, u32 maxn);
+
 // ChanTrySend attempts to sends a message without blocking.
 // It returns true if the message was sent, false if not.
 // Unlike ChanSend, this function does not return false to indicate that the channel
@@ -60,4 +93,24 @@ bool ChanTrySend(Chan*, void* elemptr, bool* closed);
 // This function does not block/wait.
 bool ChanTryRecv(Chan* ch, void* elemptr, bool* closed);
 
+// ChanSelectCase is a send or receive operation for ChanSelect
+typedef struct ChanSelectCase {
+  Chan* ch;
+  void* elemptr; // element to send, or where to store a received element
+  bool  send;    // send elemptr to ch, instead of receiving from ch
+  bool  ok;      // set by ChanSelect: true if the case was performed, false if ch closed
+} ChanSelectCase;
+
+// ChanSelect blocks until one of ncases cases can proceed, performs it and returns its
+// index, like Go's select statement. If several cases are ready, one is chosen in a fair way.
+// A receive case on a closed channel proceeds with ok=false and a zeroed element.
+// A send case on a channel which is closed while ChanSelect waits proceeds with ok=false.
+// Like ChanSend, ChanSelect panics if a send case's channel is closed when it's called.
+// Returns -1 if ncases is 0.
+int ChanSelect(ChanSelectCase* cases, u32 ncases);
+
+// ChanTrySelect works like ChanSelect but returns -1 instead of blocking when no case is
+// ready.
+int ChanTrySelect(ChanSelectCase* cases, u32 ncases);
+
 ASSUME_NONNULL_END
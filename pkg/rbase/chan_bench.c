@@ -49,7 +49,12 @@ static void st1_onbegin(Benchmark* b) {
   b->N_divisor = (size_t)(st1_bufsize + st1_bufsize);
 }
 
-R_BENCHMARK(st1, st1_onbegin)(Benchmark* b) {
+static Timer st1_sampler(Benchmark* b, bool spsc);
+
+R_BENCHMARK(st1, st1_onbegin)(Benchmark* b)      { return st1_sampler(b, false); }
+R_BENCHMARK(st1_spsc, st1_onbegin)(Benchmark* b) { return st1_sampler(b, true); }
+
+static Timer st1_sampler(Benchmark* b, bool spsc) {
   // single-threaded, buffered, lock-step send, recv, send, recv, ...
   Mem mem = MemLibC();
 
@@ -62,7 +67,8 @@ R_BENCHMARK(st1, st1_onbegin)(Benchmark* b) {
   #endif
     init_test_messages(messages, messages_count);
 
-  Chan* ch = ChanOpen(mem, sizeof(Msg), st1_bufsize);
+  Chan* ch = spsc ? ChanOpenSPSC(mem, sizeof(Msg), st1_bufsize) :
+                   ChanOpen(mem, sizeof(Msg), st1_bufsize);
 
   auto timer = TimerStart();
 
@@ -95,6 +101,33 @@ R_BENCHMARK(st1, st1_onbegin)(Benchmark* b) {
   return timer;
 }
 
+#define ST1_BATCH_BUFSIZE 64
+
+static void st1_batch_onbegin(Benchmark* b) {
+  fprintf(stderr, "buffer size: %u\n", ST1_BATCH_BUFSIZE);
+}
+
+R_BENCHMARK(st1_batch, st1_batch_onbegin)(Benchmark* b) {
+  // single-threaded, buffered, lock-step ChanSendN, ChanRecvN of a full buffer
+  Mem mem = MemLibC();
+  Msg msgv[ST1_BATCH_BUFSIZE];
+  init_test_messages(msgv, countof(msgv));
+  Chan* ch = ChanOpen(mem, sizeof(Msg), ST1_BATCH_BUFSIZE);
+
+  auto timer = TimerStart();
+  for (u32 i = 0; i < b->N; i += ST1_BATCH_BUFSIZE) {
+    UNUSED u32 n = ChanSendN(ch, msgv, countof(msgv));
+    assert(n == countof(msgv));
+    n = ChanRecvN(ch, msgv, countof(msgv));
+    assert(n == countof(msgv));
+  }
+  TimerStop(&timer);
+
+  ChanClose(ch);
+  ChanFree(ch);
+  return timer;
+}
+
 // ————————————————————————————————————————————————————————————————————————————————————————————
 // threads
 
@@ -115,9 +148,30 @@ typedef struct TestThread {
 } TestThread;
 
 
+// MT1_BATCHSIZE is the number of messages sent and received per call with mt1_conf.batch
+#define MT1_BATCHSIZE 16
+
+struct {
+  u32  bufsize;
+  u32  n_send_threads;
+  u32  n_recv_threads;
+  bool spsc;  // use ChanOpenSPSC
+  bool batch; // use ChanSendN & ChanRecvN
+} mt1_conf = {0};
+
+
 static int send_thread(void* tptr) {
   auto t = (TestThread*)tptr;
   auto msgv = t->send_msgv;
+  if (mt1_conf.batch) {
+    t->timer = TimerStart();
+    for (u32 i = 0; i < t->send_msglen; i += MT1_BATCHSIZE) {
+      UNUSED u32 n = ChanSendN(t->ch, &msgv[i], MIN(MT1_BATCHSIZE, t->send_msglen - i));
+      assert(n > 0);
+    }
+    TimerStop(&t->timer);
+    return 0;
+  }
   t->timer = TimerStart();
   for (u32 i = 0; i < t->send_msglen; i++) {
     TimerCycleSampleStart(&t->timer);
@@ -136,9 +190,18 @@ static int recv_thread(void* tptr) {
   //fprintf(stderr, "thread %u start\n", t->id);
   Chan* ch = t->ch;
   u32 recv_msgc = 0;
-  Msg recv_sum = 0;
+  u64 recv_sum = 0;
   t->timer = TimerStart();
-  while (1) {
+  while (mt1_conf.batch) {
+    Msg msgv[MT1_BATCHSIZE];
+    u32 n = ChanRecvN(ch, msgv, countof(msgv));
+    if (n == 0)
+      break; // channel closed
+    for (u32 i = 0; i < n; i++)
+      recv_sum += msgv[i];
+    recv_msgc += n;
+  }
+  while (!mt1_conf.batch) {
     // receive a message
     Msg msg;
     if (!ChanRecv(ch, &msg)) {
@@ -149,21 +212,16 @@ static int recv_thread(void* tptr) {
   }
   TimerStop(&t->timer);
   t->recv_msgc = recv_msgc;
-  t->recv_sum = (u64)recv_sum;
+  t->recv_sum = recv_sum;
   //fprintf(stderr, "thread %u exit\n", t->id);
   return 0;
 }
 
 
-struct {
-  u32 bufsize;
-  u32 n_send_threads;
-  u32 n_recv_threads;
-} mt1_conf = {0};
-
 static void onbegin(Benchmark* b) {
-  fprintf(stderr, "using %u sender threads, %u receiver threads (bufsize %u)\n",
-    mt1_conf.n_send_threads, mt1_conf.n_recv_threads, mt1_conf.bufsize);
+  fprintf(stderr, "using %u sender threads, %u receiver threads (bufsize %u%s%s)\n",
+    mt1_conf.n_send_threads, mt1_conf.n_recv_threads, mt1_conf.bufsize,
+    mt1_conf.spsc ? ", SPSC" : "", mt1_conf.batch ? ", batch" : "");
 }
 
 static Timer mt1_sampler(Benchmark* b);
@@ -171,6 +229,7 @@ static Timer mt1_sampler(Benchmark* b);
 #define DEF_MT1_BENCHMARK(name, init) \
   static void name##_onbegin(Benchmark* b) { \
     UNUSED auto ncpu = os_ncpu();                   \
+    memset(&mt1_conf, 0, sizeof(mt1_conf)); \
     init                                     \
     onbegin(b);                              \
   }                                          \
@@ -208,6 +267,58 @@ DEF_MT1_BENCHMARK(mt1_N2_N2_buffered, {
 })
 
 
+// scaling of buffered channels with the number of senders and receivers
+#define DEF_MT1_SCALING_BENCHMARK(nsend, nrecv) \
+  DEF_MT1_BENCHMARK(mt1_##nsend##_##nrecv##_buffered64, { \
+    mt1_conf.bufsize = 64;                                \
+    mt1_conf.n_send_threads = nsend;                      \
+    mt1_conf.n_recv_threads = nrecv;                      \
+  })
+
+DEF_MT1_SCALING_BENCHMARK(1, 1)
+DEF_MT1_SCALING_BENCHMARK(2, 2)
+DEF_MT1_SCALING_BENCHMARK(4, 4)
+DEF_MT1_SCALING_BENCHMARK(8, 8)
+DEF_MT1_SCALING_BENCHMARK(1, 8)
+DEF_MT1_SCALING_BENCHMARK(8, 1)
+
+DEF_MT1_BENCHMARK(mt1_1_1_spsc, {
+  mt1_conf.bufsize = 4;
+  mt1_conf.n_send_threads = 1;
+  mt1_conf.n_recv_threads = 1;
+  mt1_conf.spsc = true;
+})
+
+DEF_MT1_BENCHMARK(mt1_1_1_spsc64, {
+  mt1_conf.bufsize = 64;
+  mt1_conf.n_send_threads = 1;
+  mt1_conf.n_recv_threads = 1;
+  mt1_conf.spsc = true;
+})
+
+DEF_MT1_BENCHMARK(mt1_1_1_batch64, {
+  mt1_conf.bufsize = 64;
+  mt1_conf.n_send_threads = 1;
+  mt1_conf.n_recv_threads = 1;
+  mt1_conf.batch = true;
+})
+
+DEF_MT1_BENCHMARK(mt1_N_N_batch64, {
+  mt1_conf.bufsize = 64;
+  mt1_conf.n_send_threads = ncpu;
+  mt1_conf.n_recv_threads = ncpu;
+  mt1_conf.batch = true;
+})
+
+DEF_MT1_BENCHMARK(mt1_1_1_spsc64_batch, {
+  mt1_conf.bufsize = 64;
+  mt1_conf.n_send_threads = 1;
+  mt1_conf.n_recv_threads = 1;
+  mt1_conf.spsc = true;
+  mt1_conf.batch = true;
+})
+
+
 static Timer mt1_sampler(Benchmark* b) {
   u32 messages_count = b->N;
   auto conf = mt1_conf;
@@ -218,7 +329,8 @@ static Timer mt1_sampler(Benchmark* b) {
   TestThread* recv_threads = memalloc(mem, conf.n_recv_threads * sizeof(TestThread));
   Msg* messages = memalloc(mem, messages_count * sizeof(Msg));
 
-  Chan* ch = ChanOpen(mem, sizeof(Msg), conf.bufsize);
+  Chan* ch = conf.spsc ? ChanOpenSPSC(mem, sizeof(Msg), conf.bufsize) :
+                        ChanOpen(mem, sizeof(Msg), conf.bufsize);
 
   // init messages (1 2 3 ...)
   u64 send_sum = 0; // sum of all messages
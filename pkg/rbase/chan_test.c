@@ -58,6 +58,103 @@ R_TEST(chan_st) {
 // TODO: test non-blocking ChanTrySend and ChanTryRecv
 
 
+static int spsc_send_thread(void* chptr) {
+  Chan* ch = chptr;
+  for (Msg msg = 1; msg <= 10000; msg++) {
+    UNUSED bool ok = ChanSend(ch, &msg);
+    assert(ok);
+  }
+  ChanClose(ch);
+  return 0;
+}
+
+R_TEST(chan_spsc) {
+  Mem mem = MemLibC();
+  Chan* ch = ChanOpenSPSC(mem, sizeof(Msg), 4);
+  asserteq(ChanCap(ch), 4);
+
+  // non-blocking operations on a full and an empty channel
+  bool closed = false;
+  for (Msg msg = 1; msg <= 4; msg++)
+    assert(ChanTrySend(ch, &msg, &closed));
+  Msg msg = 5;
+  assert(!ChanTrySend(ch, &msg, &closed));
+  for (Msg i = 1; i <= 4; i++) {
+    assert(ChanTryRecv(ch, &msg, &closed));
+    asserteq(msg, i);
+  }
+  assert(!ChanTryRecv(ch, &msg, &closed));
+  assert(!closed);
+
+  // messages from a sender thread arrive in order, then the channel closes
+  thrd_t t;
+  UNUSED int status = thrd_create(&t, spsc_send_thread, ch);
+  asserteq(status, thrd_success);
+  Msg expect = 1;
+  while (ChanRecv(ch, &msg)) {
+    asserteq(msg, expect);
+    expect++;
+  }
+  asserteq(expect, 10001);
+  thrd_join(t, NULL);
+
+  ChanFree(ch);
+}
+
+
+static int batch_send_thread(void* chptr) {
+  Chan* ch = chptr;
+  Msg msgv[7];
+  for (Msg msg = 1; msg <= 7000; msg += countof(msgv)) {
+    for (u32 i = 0; i < countof(msgv); i++)
+      msgv[i] = msg + i;
+    UNUSED u32 n = ChanSendN(ch, msgv, countof(msgv));
+    asserteq(n, countof(msgv));
+  }
+  ChanClose(ch);
+  return 0;
+}
+
+R_TEST(chan_batch) {
+  Mem mem = MemLibC();
+
+  // runs wrap around the end of the buffer
+  Chan* ch = ChanOpen(mem, sizeof(Msg), 4);
+  Msg msgv[8] = { 1, 2, 3, 4, 5, 6 };
+  asserteq(ChanSendN(ch, &msgv[0], 3), 3);
+  asserteq(ChanRecvN(ch, &msgv[0], 2), 2);
+  asserteq(msgv[0], 1);
+  asserteq(msgv[1], 2);
+  asserteq(ChanSendN(ch, &msgv[3], 3), 3);
+  asserteq(ChanRecvN(ch, &msgv[0], countof(msgv)), 4);
+  for (u32 i = 0; i < 4; i++)
+    asserteq(msgv[i], i + 3);
+  ChanClose(ch);
+  asserteq(ChanRecvN(ch, &msgv[0], countof(msgv)), 0);
+  ChanFree(ch);
+
+  // messages sent in runs by a sender thread arrive in order
+  for (u32 mode = 0; mode < 3; mode++) {
+    ch = mode == 0 ? ChanOpen(mem, sizeof(Msg), 4) :
+         mode == 1 ? ChanOpenSPSC(mem, sizeof(Msg), 4) :
+                     ChanOpen(mem, sizeof(Msg), 0);
+    thrd_t t;
+    UNUSED int status = thrd_create(&t, batch_send_thread, ch);
+    asserteq(status, thrd_success);
+    Msg expect = 1;
+    u32 n;
+    while ((n = ChanRecvN(ch, msgv, 5)) > 0) {
+      assert(n <= 5);
+      for (u32 i = 0; i < n; i++)
+        asserteq(msgv[i], expect++);
+    }
+    asserteq(expect, 7001);
+    thrd_join(t, NULL);
+    ChanFree(ch);
+  }
+}
+
+
 typedef struct TestThread {
   thrd_t t;
   u32    id;
@@ -114,6 +211,7 @@ R_TEST(chan_1send_1recv_buffered)   { chan_1send_Nrecv(2,             1,
 R_TEST(chan_1send_Nrecv_buffered)   { chan_1send_Nrecv(2,             1, os_ncpu() + 1, 80); }
 R_TEST(chan_Nsend_1recv_buffered)   { chan_1send_Nrecv(2, os_ncpu() + 1,             1, 80); }
 R_TEST(chan_Nsend_Nrecv_buffered)   { chan_1send_Nrecv(2, os_ncpu() + 1, os_ncpu() + 1, 80); }
+R_TEST(chan_Nsend_Nrecv_buffered1)  { chan_1send_Nrecv(1, os_ncpu() + 1, os_ncpu() + 1, 80); }
 R_TEST(chan_1send_1recv_unbuffered) { chan_1send_Nrecv(0,             1,             1, 80); }
 R_TEST(chan_1send_Nrecv_unbuffered) { chan_1send_Nrecv(0,             1, os_ncpu() + 1, 80); }
 R_TEST(chan_Nsend_1recv_unbuffered) { chan_1send_Nrecv(0, os_ncpu() + 1,             1, 80); }
@@ -226,5 +324,214 @@ static void chan_1send_Nrecv(u32 bufcap, u32 n_send_threads, u32 n_recv_threads,
 }
 
 
+static int select_send_thread(void* chptr) {
+  Chan* ch = chptr;
+  for (Msg msg = 1; msg <= 1000; msg++) {
+    UNUSED bool ok = ChanSend(ch, &msg);
+    assert(ok);
+  }
+  ChanClose(ch);
+  return 0;
+}
+
+static int select_recv_thread(void* chptr) {
+  Chan* ch = chptr;
+  Msg msg;
+  while (ChanRecv(ch, &msg)) {}
+  return 0;
+}
+
+R_TEST(chan_select) {
+  Mem mem = MemLibC();
+  Chan* chv[3] = {
+    ChanOpen(mem, sizeof(Msg), 4),
+    ChanOpen(mem, sizeof(Msg), 0),
+    ChanOpenSPSC(mem, sizeof(Msg), 4),
+  };
+  Msg msgv[3] = {0};
+  ChanSelectCase cases[3];
+  for (u32 i = 0; i < countof(cases); i++)
+    cases[i] = (ChanSelectCase){ .ch = chv[i], .elemptr = &msgv[i] };
+
+  // nothing is ready
+  asserteq(ChanTrySelect(cases, countof(cases)), -1);
+
+  // a message is ready on one channel
+  Msg msg = 123;
+  ChanSend(chv[2], &msg);
+  asserteq(ChanTrySelect(cases, countof(cases)), 2);
+  assert(cases[2].ok);
+  asserteq(msgv[2], 123);
+
+  // receive from all channels until they are closed, in order per channel
+  thrd_t tv[3];
+  for (u32 i = 0; i < countof(tv); i++) {
+    UNUSED int status = thrd_create(&tv[i], select_send_thread, chv[i]);
+    asserteq(status, thrd_success);
+  }
+  Msg expect[3] = { 1, 1, 1 };
+  u32 ncases = countof(cases);
+  while (ncases > 0) {
+    int i = ChanSelect(cases, ncases);
+    assert(i > -1);
+    u32 chi = (u32)((Msg*)cases[i].elemptr - msgv);
+    if (!cases[i].ok) {
+      // closed; remove the case
+      asserteq(expect[chi], 1001);
+      cases[i] = cases[--ncases];
+      continue;
+    }
+    asserteq(msgv[chi], expect[chi]);
+    expect[chi]++;
+  }
+  for (u32 i = 0; i < countof(tv); i++) {
+    thrd_join(tv[i], NULL);
+    ChanFree(chv[i]);
+  }
+
+  // send cases
+  Chan* ch = ChanOpen(mem, sizeof(Msg), 0);
+  thrd_t t;
+  UNUSED int status = thrd_create(&t, select_recv_thread, ch);
+  asserteq(status, thrd_success);
+  for (msg = 1; msg <= 100; msg++) {
+    ChanSelectCase sc = { .ch = ch, .elemptr = &msg, .send = true };
+    asserteq(ChanSelect(&sc, 1), 0);
+    assert(sc.ok);
+  }
+  ChanClose(ch);
+  thrd_join(t, NULL);
+  ChanFree(ch);
+}
+
+static int timeout_send_thread(void* chptr) {
+  Chan* ch = chptr;
+  msleep(10);
+  Msg msg = 123;
+  UNUSED bool ok = ChanSend(ch, &msg);
+  assert(ok);
+  return 0;
+}
+
+static int timeout_recv_thread(void* chptr) {
+  Chan* ch = chptr;
+  Msg msg;
+  UNUSED bool ok = ChanRecv(ch, &msg);
+  assert(ok);
+  asserteq(msg, 456);
+  return 0;
+}
+
+R_TEST(chan_timeout) {
+  Mem mem = MemLibC();
+  for (u32 mode = 0; mode < 3; mode++) {
+    Chan* ch = mode == 0 ? ChanOpen(mem, sizeof(Msg), 1) :
+               mode == 1 ? ChanOpenSPSC(mem, sizeof(Msg), 1) :
+                           ChanOpen(mem, sizeof(Msg), 0);
+    bool closed = false;
+    Msg msg = 1;
+
+    // receive on an empty channel times out
+    u64 start = nanotime();
+    assert(!ChanRecvTimeout(ch, &msg, 2000, &closed));
+    assert(nanotime() - start >= 2000000);
+    assert(!closed);
+
+    // the timed out receiver is no longer waiting: a send has no receiver to hand over to
+    if (mode == 2)
+      assert(!ChanTrySend(ch, &msg, &closed));
+
+    // send on a full channel times out
+    if (mode < 2)
+      assert(ChanTrySend(ch, &msg, &closed));
+    assert(!ChanSendTimeout(ch, &msg, 2000, &closed));
+    assert(!closed);
+    if (mode < 2)
+      assert(ChanTryRecv(ch, &msg, &closed));
+
+    // a message sent before the timeout is received
+    thrd_t t;
+    UNUSED int status = thrd_create(&t, timeout_send_thread, ch);
+    asserteq(status, thrd_success);
+    assert(ChanRecvTimeout(ch, &msg, 10000000, &closed));
+    asserteq(msg, 123);
+    thrd_join(t, NULL);
+
+    // a message is sent before the deadline
+    status = thrd_create(&t, timeout_recv_thread, ch);
+    asserteq(status, thrd_success);
+    msg = 456;
+    assert(ChanSendDeadline(ch, &msg, nanotime() + 10000000000ull, &closed));
+    thrd_join(t, NULL);
+
+    // a deadline in the past
+    assert(!ChanRecvDeadline(ch, &msg, nanotime() - 1, &closed));
+    assert(!closed);
+
+    ChanClose(ch);
+    assert(!ChanRecvTimeout(ch, &msg, 1000, &closed));
+    assert(closed);
+    ChanFree(ch);
+  }
+}
+
+typedef struct SelectWakeThread {
+  Chan* chv[2];
+  Msg   msgv[2];
+  int   i;   // case which select_wake_thread received from
+  bool  ok;  // true if select_wake_recv_thread received a message
+} SelectWakeThread;
+
+static int select_wake_select_thread(void* arg) {
+  SelectWakeThread* st = arg;
+  ChanSelectCase cases[2] = {
+    { .ch = st->chv[0], .elemptr = &st->msgv[0] },
+    { .ch = st->chv[1], .elemptr = &st->msgv[1] },
+  };
+  st->i = ChanSelect(cases, countof(cases));
+  return 0;
+}
+
+static int select_wake_recv_thread(void* arg) {
+  SelectWakeThread* st = arg;
+  Msg msg;
+  bool closed = false;
+  st->ok = ChanRecvTimeout(st->chv[0], &msg, 500000, &closed);
+  return 0;
+}
+
+R_TEST(chan_select_wake) {
+  // A select woken up by a buffered channel must not leave the message it was woken up
+  // for behind while another receiver waits on the same channel.
+  Mem mem = MemLibC();
+  SelectWakeThread st = {
+    .chv = { ChanOpen(mem, sizeof(Msg), 4), ChanOpen(mem, sizeof(Msg), 4) },
+  };
+  thrd_t t1, t2;
+  UNUSED int status = thrd_create(&t1, select_wake_select_thread, &st);
+  asserteq(status, thrd_success);
+  msleep(20); // let the select park first, so that it's first in chv[0]'s recvq
+  status = thrd_create(&t2, select_wake_recv_thread, &st);
+  asserteq(status, thrd_success);
+  msleep(20);
+
+  Msg msg = 1;
+  ChanSend(st.chv[0], &msg);
+  msg = 2;
+  ChanSend(st.chv[1], &msg);
+  thrd_join(t1, NULL);
+  thrd_join(t2, NULL);
+
+  // either the select or the receiver got the message sent on chv[0]
+  bool closed = false;
+  assert(st.i == 0 || st.ok);
+  assert(!ChanTryRecv(st.chv[0], &msg, &closed));
+
+  for (u32 i = 0; i < countof(st.chv); i++) {
+    ChanClose(st.chv[i]);
+    ChanFree(st.chv[i]);
+  }
+}
+
 #endif /*R_TESTING_ENABLED*/
 ASSUME_NONNULL_END
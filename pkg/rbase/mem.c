@@ -4,8 +4,12 @@
 void* memdup2(Mem mem, const void* src, size_t len, size_t extraspace) {
   assertnotnull_debug(mem);
   assertnotnull(src);
-  void* dst = mem->alloc(mem, len + extraspace);
+  // only extraspace needs zeroing since the rest is overwritten
+  u8* dst = memalloc_uninit(mem, len + extraspace);
+  if (!dst)
+    return NULL;
   memcpy(dst, src, len);
+  memset(dst + len, 0, extraspace);
   return dst;
 }
 
@@ -13,11 +17,32 @@ char* memstrdup(Mem mem, const char* pch) {
   assertnotnull_debug(mem);
   assertnotnull(pch);
   size_t z = strlen(pch);
-  char* s = (char*)memdup2(mem, pch, z, 1);
-  s[z] = 0;
+  char* s = memalloc_uninit(mem, z + 1);
+  if (!s)
+    return NULL;
+  memcpy(s, pch, z + 1);
   return s;
 }
 
+// ------------------------------------------------------------------------------------
+// aligned allocation for allocators without alloc_aligned
+
+// The fallback over-allocates and stores the address of the underlying allocation just
+// before the aligned address.
+void* _memalloc_aligned_fallback(Mem m, size_t size, size_t align) {
+  align = MAX(align, sizeof(void*));
+  u8* p = m->alloc(m, size + align + sizeof(void*));
+  if (!p)
+    return NULL;
+  u8* ptr = (u8*)align2((uintptr_t)p + sizeof(void*), align);
+  ((void**)ptr)[-1] = p;
+  return ptr;
+}
+
+void _memfree_aligned_fallback(Mem m, void* ptr) {
+  m->free(m, ((void**)ptr)[-1]);
+}
+
 // ------------------------------------------------------------------------------------
 // MemSyncWrapper
 
@@ -30,7 +55,15 @@ typedef struct MSyncWrapper {
 static void* nullable _mem_syncw_alloc(Mem m, size_t size) {
   MSyncWrapper* w = (MSyncWrapper*)m;
   mtx_lock(&w->mu);
-  void* p = m->alloc(w->m, size);
+  void* p = w->m->alloc(w->m, size);
+  mtx_unlock(&w->mu);
+  return p;
+}
+
+static void* nullable _mem_syncw_alloc_uninit(Mem m, size_t size) {
+  MSyncWrapper* w = (MSyncWrapper*)m;
+  mtx_lock(&w->mu);
+  void* p = w->m->alloc_uninit(w->m, size);
   mtx_unlock(&w->mu);
   return p;
 }
@@ -38,7 +71,7 @@ static void* nullable _mem_syncw_alloc(Mem m, size_t size) {
 static void* nullable _mem_syncw_realloc(Mem m, void* ptr, size_t newsize) {
   MSyncWrapper* w = (MSyncWrapper*)m;
   mtx_lock(&w->mu);
-  void* p = m->realloc(w->m, ptr, newsize);
+  void* p = w->m->realloc(w->m, ptr, newsize);
   mtx_unlock(&w->mu);
   return p;
 }
@@ -46,7 +79,37 @@ static void* nullable _mem_syncw_realloc(Mem m, void* ptr, size_t newsize) {
 static void _mem_syncw_free(Mem m, void* ptr) {
   MSyncWrapper* w = (MSyncWrapper*)m;
   mtx_lock(&w->mu);
-  m->free(w->m, ptr);
+  w->m->free(w->m, ptr);
+  mtx_unlock(&w->mu);
+}
+
+static void* nullable _mem_syncw_alloc_aligned(Mem m, size_t size, size_t align) {
+  MSyncWrapper* w = (MSyncWrapper*)m;
+  mtx_lock(&w->mu);
+  void* p = w->m->alloc_aligned(w->m, size, align);
+  mtx_unlock(&w->mu);
+  return p;
+}
+
+static void _mem_syncw_free_sized(Mem m, void* ptr, size_t size) {
+  MSyncWrapper* w = (MSyncWrapper*)m;
+  mtx_lock(&w->mu);
+  w->m->free_sized(w->m, ptr, size);
+  mtx_unlock(&w->mu);
+}
+
+static size_t _mem_syncw_alloc_batch(Mem m, size_t size, size_t count, void** ptrs) {
+  MSyncWrapper* w = (MSyncWrapper*)m;
+  mtx_lock(&w->mu);
+  size_t n = memalloc_batch(w->m, size, count, ptrs);
+  mtx_unlock(&w->mu);
+  return n;
+}
+
+static void _mem_syncw_free_batch(Mem m, size_t size, size_t count, void** ptrs) {
+  MSyncWrapper* w = (MSyncWrapper*)m;
+  mtx_lock(&w->mu);
+  memfree_batch(w->m, size, count, ptrs);
   mtx_unlock(&w->mu);
 }
 
@@ -55,6 +118,14 @@ Mem MemSyncWrapper(Mem inner) {
   w->ma.alloc   = _mem_syncw_alloc;
   w->ma.realloc = _mem_syncw_realloc;
   w->ma.free    = _mem_syncw_free;
+  // forward optional functions only if inner implements them, so that memalloc_aligned
+  // and memfree_sized can fall back to the functions above otherwise
+  w->ma.alloc_aligned = inner->alloc_aligned ? _mem_syncw_alloc_aligned : NULL;
+  w->ma.free_sized    = inner->free_sized ? _mem_syncw_free_sized : NULL;
+  w->ma.alloc_uninit  = inner->alloc_uninit ? _mem_syncw_alloc_uninit : NULL;
+  // batches always take the lock once, even if inner allocates one object at a time
+  w->ma.alloc_batch   = _mem_syncw_alloc_batch;
+  w->ma.free_batch    = _mem_syncw_free_batch;
   mtx_init(&w->mu, mtx_plain);
   w->m = inner;
   return (Mem)w;
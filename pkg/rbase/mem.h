@@ -30,6 +30,11 @@ static Mem MemInvalid();
 static void* nullable memalloc(Mem m, size_t size)
   R_ATTR_MALLOC R_ATTR_ALLOC_SIZE(2) WARN_UNUSED_RESULT;
 
+// memalloc_uninit allocates memory of at least size, like memalloc, but the contents of the
+// memory is undefined. Use it for memory which is about to be overwritten anyway.
+static void* nullable memalloc_uninit(Mem m, size_t size)
+  R_ATTR_MALLOC R_ATTR_ALLOC_SIZE(2) WARN_UNUSED_RESULT;
+
 // memrealloc resizes memory at ptr. If ptr is null, the behavior matches memalloc.
 static void* nullable memrealloc(Mem m, void* nullable ptr, size_t newsize)
   R_ATTR_ALLOC_SIZE(3) WARN_UNUSED_RESULT;
@@ -37,6 +42,28 @@ static void* nullable memrealloc(Mem m, void* nullable ptr, size_t newsize)
 // memfree frees memory allocated with memalloc
 static void memfree(Mem m, void* ptr);
 
+// memfree_sized is like memfree but also tells the allocator the size of the allocation,
+// which must be the size passed to memalloc or, if resized, to the latest memrealloc.
+// Allocators without headers use it to free memory they otherwise couldn't reclaim.
+static void memfree_sized(Mem m, void* ptr, size_t size);
+
+// memalloc_aligned allocates at least size bytes of zeroed memory at an address which is a
+// multiple of align, which must be a power of two. The memory must be freed with
+// memfree_aligned and can't be resized with memrealloc.
+static void* nullable memalloc_aligned(Mem m, size_t size, size_t align)
+  R_ATTR_MALLOC R_ATTR_ALLOC_SIZE(2) WARN_UNUSED_RESULT;
+
+// memfree_aligned frees memory allocated with memalloc_aligned of the same size
+static void memfree_aligned(Mem m, void* ptr, size_t size);
+
+// memalloc_batch allocates count zeroed objects of size bytes each, storing their addresses
+// in ptrs. Returns the number of objects allocated, which is less than count only when the
+// allocator runs out of memory.
+static size_t memalloc_batch(Mem m, size_t size, size_t count, void** ptrs);
+
+// memfree_batch frees count objects of size bytes each, e.g. allocated with memalloc_batch.
+static void memfree_batch(Mem m, size_t size, size_t count, void** ptrs);
+
 // memalloct is a convenience for: (MyStructType*)memalloc(m, sizeof(MyStructType))
 #define memalloct(mem, TYPE) ((TYPE*)memalloc((mem),sizeof(TYPE)))
 
@@ -44,6 +71,22 @@ static void memfree(Mem m, void* ptr);
 // This function returns a cached value from memory, read from the OS at init.
 size_t mem_pagesize();
 
+// mem_hugepagesize returns the size of a huge page, which is usually 2MB.
+size_t mem_hugepagesize();
+
+// MemPageFlags control the behavior of mem_pagealloc
+typedef enum {
+  MemPageDefault   = 0,
+  MemPageGuardHigh = 1 << 0, // mprotect the last page
+  MemPageGuardLow  = 1 << 1, // mprotect the first page (e.g. for stack memory)
+  // MemPageHugeTLB maps explicit huge pages (MAP_HUGETLB) when the size is a multiple of
+  // mem_hugepagesize, falling back to MemPageHugeHint when no huge pages are available.
+  MemPageHugeTLB   = 1 << 2,
+  // MemPageHugeHint aligns allocations of at least mem_hugepagesize to mem_hugepagesize and
+  // asks the OS to back them with transparent huge pages (MADV_HUGEPAGE).
+  MemPageHugeHint  = 1 << 3,
+} MemPageFlags;
+
 // memdup makes a copy of src
 static void* nullable memdup(Mem m, const void* src, size_t len);
 
@@ -71,27 +114,174 @@ typedef struct MemAllocator {
   // free is called with the address of a previous allocation of the same allocator m.
   // The allocator now owns the memory at ptr and may recycle it or release it to the system.
   void (*free)(Mem m, void* ptr);
+
+  // alloc_aligned is optional. Like alloc, but the address returned must be a multiple of
+  // align, which is a power of two. The memory is freed with free or free_sized.
+  // When NULL, memalloc_aligned over-allocates with alloc and aligns the address itself.
+  void* nullable (*alloc_aligned)(Mem m, size_t size, size_t align);
+
+  // free_sized is optional. Like free, but also passed the size of the allocation.
+  // When NULL, memfree_sized calls free.
+  void (*free_sized)(Mem m, void* ptr, size_t size);
+
+  // alloc_uninit is optional. Like alloc, but the memory need not be zeroed.
+  // When NULL, memalloc_uninit calls alloc.
+  void* nullable (*alloc_uninit)(Mem m, size_t size);
+
+  // alloc_batch is optional. It should allocate up to count objects like alloc and return
+  // the number allocated. When NULL, memalloc_batch calls alloc count times.
+  size_t (*alloc_batch)(Mem m, size_t size, size_t count, void** ptrs);
+
+  // free_batch is optional. When NULL, memfree_batch calls free_sized or free count times.
+  void (*free_batch)(Mem m, size_t size, size_t count, void** ptrs);
 } MemAllocator;
 
 // ---------------------------------
 
 // MemLinearAlloc creates a new linear allocator.
 // This is a good choice when you need to burn through a lot of temporary allocations
-// and then free them all. memfree is a noop except for the most recent allocation which simply
-// rewindws the allocator.
+// and then free them all. Allocations have a small size header. memfree rewinds the allocator
+// when passed the most recent allocation which is still live, so allocations can be freed in
+// LIFO order; it's a noop for any other allocation. memrealloc resizes the most recent
+// allocation in place, shrinks other allocations in place and moves them when they grow.
+// free and realloc are O(1) regardless of the number of blocks.
+// memalloc_aligned is supported natively.
+// Allocations of 1MB or more get a page mapping of their own, which memfree unmaps and
+// memrealloc resizes with mem_pageremap, so that large buffers can grow without copying.
 // npages_init is the number of memory pages to map (but not commit) up front.
 // This allocator is NOT thread safe. Use MemSyncWrapper if MT access is needed.
 Mem nullable MemLinearAlloc(size_t npages_init);
 
+// MemLinearAlloc2 is like MemLinearAlloc but maps memory with pageflags, which can be used
+// to opt into huge pages with MemPageHugeTLB or MemPageHugeHint. With huge pages, blocks are
+// a multiple of mem_hugepagesize, including the first one.
+Mem nullable MemLinearAlloc2(size_t npages_init, MemPageFlags pageflags);
+
 // MemLinearReset resets m, which must have been created with MemLinearAlloc, as if
 // nothing is allocated. Useful for resuing already-allocated memory.
+// Blocks are retained for reuse up to about 1.5x the high-water mark of memory used between
+// recent resets. The high-water mark slowly decays. Retained blocks which went unused since
+// the previous reset have their pages released to the OS with madvise but stay mapped.
+// The first reset after a call to mem_trim retains no blocks.
 void MemLinearReset(Mem m);
 
+// MemLinearStats holds counters of a linear allocator
+typedef struct MemLinearStats {
+  size_t nmap;      // number of blocks mapped
+  size_t nunmap;    // number of blocks unmapped
+  size_t nreuse;    // number of times a retained block was used instead of mapping a new one
+  size_t nrelease;  // number of times pages of a retained block were released to the OS
+  size_t retained;  // bytes currently held in retained blocks
+  size_t highwater; // high-water mark of bytes used between resets
+} MemLinearStats;
+
+// MemLinearGetStats copies the counters of m into st
+void MemLinearGetStats(Mem m, MemLinearStats* st);
+
+// MemLinearMarker is a savepoint in a linear allocator, created by MemLinearMark.
+typedef struct MemLinearMarker {
+  void*  block;  // current block at the time of marking
+  size_t len;    // number of bytes in use in block
+  size_t nlarge; // number of large allocations made before the mark
+} MemLinearMarker;
+
+// MemLinearMark returns a savepoint of the current state of m, which must have been created
+// with MemLinearAlloc. Pass it to MemLinearRewind to free everything allocated since.
+MemLinearMarker MemLinearMark(Mem m);
+
+// MemLinearRewind frees all allocations made in m since mark was created.
+// Large allocations made since the mark are unmapped.
+// Blocks mapped after the mark are kept by the allocator and reused for later allocations.
+// Rewinding to a marker that is older than a previous rewind is fine, but rewinding to a
+// marker created after the allocator was reset or rewound to an earlier point is not.
+void MemLinearRewind(Mem m, MemLinearMarker mark);
+
+// MemLinearScope(m) { ... } rewinds m to its state before the block when leaving the block.
+// Scopes can be nested. Leaving the block with break, goto or return skips the rewind.
+#define MemLinearScope(m) \
+  for (MemLinearMarker _mla_mark = MemLinearMark(m); \
+       _mla_mark.block; \
+       MemLinearRewind((m), _mla_mark), _mla_mark.block = NULL)
+
 // MemLinearFree frees all memory allocated in m, including m itself.
 void MemLinearFree(Mem m);
 
 // ---------------------------------
 
+// MemLinearFileOpen opens a linear allocator whose memory lives in the file at path, which is
+// created if it doesn't exist. The file is mapped at the same address as when it was created,
+// so data structures built in it can be used by a later process as-is, pointers and all.
+// Store a pointer to the data with MemLinearFileSetRoot, and get it with MemLinearFileRoot.
+// maxsize is the amount of address space reserved, which limits the size of the file.
+// Returns NULL and sets errno on error. errno is EEXIST if the address of the file is in use,
+// EINVAL if the file is not a MemLinearFile file and EWOULDBLOCK if another process has
+// the file open. Allocators work like MemLinearAlloc, with a single block, and are not
+// thread safe.
+Mem nullable MemLinearFileOpen(const char* path, size_t maxsize);
+
+// MemLinearFileRoot returns the root object of m, or NULL if it has none
+void* nullable MemLinearFileRoot(Mem m);
+
+// MemLinearFileSetRoot sets the root object of m, which must be allocated in m
+void MemLinearFileSetRoot(Mem m, void* nullable root);
+
+// MemLinearFileSync writes the contents of m to its file and waits for the write to complete.
+// Returns false and sets errno on error.
+bool MemLinearFileSync(Mem m);
+
+// MemLinearFileClose unmaps and closes m. Changes are kept even without MemLinearFileSync,
+// but may be lost if the system crashes. Changes made since an active snapshot are discarded.
+void MemLinearFileClose(Mem m);
+
+// MemLinearFileAnon creates an allocator like MemLinearFileOpen, but backed by anonymous
+// shared memory (memfd) rather than a file. Mostly useful with snapshots.
+// Returns NULL and sets errno on error; ENOSYS on systems without memfd.
+Mem nullable MemLinearFileAnon(size_t maxsize);
+
+// MemLinearSnapshot takes a snapshot of m, which must have been created with
+// MemLinearFileOpen or MemLinearFileAnon. Memory is shared with the snapshot and copied when
+// written to, so taking a snapshot costs one mmap regardless of the size of m. Changes made
+// to m after the snapshot, including allocations, are either discarded or kept by
+// MemLinearSnapshotDiscard or MemLinearSnapshotKeep. There can be one snapshot at a time.
+// Returns false and sets errno on error; EBUSY if there is a snapshot already.
+bool MemLinearSnapshot(Mem m);
+
+// MemLinearSnapshotDiscard returns m to its state when the snapshot was taken.
+// Pointers to allocations made since then are invalid afterwards.
+bool MemLinearSnapshotDiscard(Mem m);
+
+// MemLinearSnapshotKeep keeps the changes made since the snapshot, which costs writing the
+// pages which were changed to the backing file.
+bool MemLinearSnapshotKeep(Mem m);
+
+// ---------------------------------
+
+// MemScratch is a scope of temporary memory, created by MemScratchBegin
+typedef struct MemScratch {
+  Mem             mem; // allocator for the scope's temporary memory
+  MemLinearMarker mark;
+} MemScratch;
+
+// MemScratchBegin starts a scope of temporary memory in one of the calling thread's scratch
+// arenas, which are linear allocators that need no locking. Everything allocated in s.mem
+// is freed by MemScratchEnd(s). Scopes can be nested and must be ended in reverse order.
+// conflict is an arena which must not be used, usually the scratch arena of the caller which
+// the result of the current function is allocated in. Pass NULL if there is none.
+MemScratch MemScratchBegin(Mem nullable conflict);
+
+// MemScratchEnd ends a scope started by MemScratchBegin, freeing its allocations
+void MemScratchEnd(MemScratch s);
+
+// MemScratchScope(s, conflict) { ... } runs the block in scratch scope s.
+// Leaving the block with break, goto or return skips MemScratchEnd.
+#define MemScratchScope(s, conflict) \
+  for (MemScratch s = MemScratchBegin(conflict); s.mem; MemScratchEnd(s), s.mem = NULL)
+
+// MEM_SCRATCH_NARENAS is the number of scratch arenas per thread
+#define MEM_SCRATCH_NARENAS 2
+
+// ---------------------------------
+
 // MemSyncWrapper creates an allocator which wraps another allocator and
 // uses a mtx_t to ensure mutually exclusive access to the alloc, realloc
 // and free functions of the provided allocator m.
@@ -100,6 +290,63 @@ Mem MemSyncWrapperFree(Mem m); // returns the "unwrapped" inner allocator
 
 // ---------------------------------
 
+// MemStatsWrapper creates an allocator which wraps another allocator and counts allocations,
+// bytes and reallocs. Counters are sharded per thread, making the overhead small enough to
+// leave it on in production. Each allocation is prefixed by a 16-byte header.
+// The wrapper is thread safe if inner is.
+Mem nullable MemStatsWrapper(Mem inner);
+Mem MemStatsWrapperFree(Mem m); // returns the "unwrapped" inner allocator
+
+// MEM_STATS_NSIZECLASSES is the number of size classes in MemStats.sizehist
+#define MEM_STATS_NSIZECLASSES 16
+
+// MemStats is a snapshot of the counters of a MemStatsWrapper
+typedef struct MemStats {
+  u64 nalloc;      // number of allocations
+  u64 nfree;       // number of frees
+  u64 nlive;       // number of allocations not yet freed
+  u64 nrealloc;    // number of reallocs
+  u64 nmove;       // number of reallocs which moved the allocation
+  u64 bytes_alloc; // total number of bytes allocated, including growth by realloc
+  u64 bytes_live;  // number of bytes currently allocated
+  u64 bytes_peak;  // highest bytes_live seen (precise to 16kB per thread)
+  // Number of allocations by size: sizehist[0] counts sizes <= 16, sizehist[1] <= 32 and
+  // so on, doubling. The last class counts everything larger than the one before it.
+  u64 sizehist[MEM_STATS_NSIZECLASSES];
+} MemStats;
+
+// MemStatsWrapperSnapshot copies the counters of m, a MemStatsWrapper, to st.
+// It can be called at any time from any thread.
+void MemStatsWrapperSnapshot(Mem m, MemStats* st);
+
+// MemStatsReport writes a human-readable report of st to fp
+void MemStatsReport(FILE* fp, const MemStats* st);
+
+// ---------------------------------
+
+// MemProfWrapper creates an allocator which wraps another allocator and samples allocations,
+// recording the call stack of about one allocation every sampleinterval bytes. Samples are
+// aggregated by call site. Allocations which are not sampled only cost a per-thread counter
+// update. Each allocation is prefixed by a 16-byte header.
+// If sampleinterval is 0, MEM_PROF_DEFAULT_INTERVAL is used.
+// The wrapper is thread safe if inner is.
+Mem nullable MemProfWrapper(Mem inner, size_t sampleinterval);
+Mem MemProfWrapperFree(Mem m); // returns the "unwrapped" inner allocator
+
+// MEM_PROF_DEFAULT_INTERVAL is the default mean number of bytes between samples
+#define MEM_PROF_DEFAULT_INTERVAL (512 * 1024)
+
+// MemProfWriteHeapProfile writes the samples of m, a MemProfWrapper, to fp in the text
+// format of gperftools heap profiles, which pprof understands.
+void MemProfWriteHeapProfile(Mem m, FILE* fp);
+
+// MemProfWriteFolded writes the samples of m, a MemProfWrapper, to fp as folded stacks
+// ("main;f;g 1234") with the estimated number of bytes allocated at each call site,
+// suitable for flame graphs.
+void MemProfWriteFolded(Mem m, FILE* fp);
+
+// ---------------------------------
+
 // MemArenaShim is a memory arena which delegates memory management to an underlying allocator.
 // This is useful when you want to make a lot of allocations and then free them all at once,
 // removing the need for fine-grained memfree calls.
@@ -118,19 +365,183 @@ void MemArenaShimFree(MemArenaShim* a);
 
 // ---------------------------------
 
-// MemPageFlags control the behavior of mem_pagealloc
-typedef enum {
-  MemPageDefault   = 0,
-  MemPageGuardHigh = 1 << 0, // mprotect the last page
-  MemPageGuardLow  = 1 << 1, // mprotect the first page (e.g. for stack memory)
-} MemPageFlags;
+// MemArena is a region allocator which carves allocations out of large chunks of memory
+// allocated with an underlying allocator. Like MemArenaShim, memory is freed all at once with
+// MemArenaFree, but it makes a call to the underlying allocator only once in a while.
+// memfree is a noop except for the most recent allocation, which can also be grown in place.
+// This allocator is NOT thread safe.
+typedef struct MemArena {
+  MemAllocator ma;
+  Mem          underlying;
+  struct MemArenaChunk* nullable chunks; // current chunk first
+  size_t       chunksize; // size of the most recent regular chunk
+} MemArena;
 
-// mem_pagealloc allocates npages from the OS. Returns NULL on error.
+// MemArenaInit initializes a new arena
+Mem MemArenaInit(MemArena* a, Mem underlying);
+
+// MemArenaFree frees all memory allocated in the arena.
+// The arena can be used again after this call.
+void MemArenaFree(MemArena* a);
+
+// ---------------------------------
+
+// MemSlab returns a shared thread-safe allocator which serves small allocations from
+// size-class slabs carved out of mem_pagealloc pages. Every thread keeps a cache of free
+// objects per size class, so the common alloc and free path takes no lock.
+// Allocations larger than MEM_SLAB_MAXSIZE are given their own page mapping.
+// Freed small objects are recycled but never returned to the OS.
+Mem MemSlab();
+#define MEM_SLAB_MAXSIZE 8192
+
+// ---------------------------------
+
+// MemLarge returns a shared thread-safe allocator which gives every allocation a page
+// mapping of its own. memrealloc resizes the mapping with mem_pageremap, which on Linux
+// moves pages instead of copying their contents, so buffers can grow to gigabytes at the
+// cost of a syscall per resize. Meant for allocations of at least a megabyte or so; every
+// allocation occupies at least one page.
+Mem MemLarge();
+
+// ---------------------------------
+
+// MemObjPool creates a thread-safe allocator for objects of objsize bytes, e.g. queue nodes.
+// Objects are carved out of mem_pagealloc slabs and freed objects are recycled through a
+// lock-free Pool, so alloc and free never take a lock except when a new slab is needed.
+// Allocations larger than objsize fail (return NULL) and realloc can't grow objects.
+// Memory is only returned to the OS by MemObjPoolFree.
+Mem nullable MemObjPool(size_t objsize);
+
+// MemObjPoolFree frees all memory of m, including objects which have not been freed.
+void MemObjPoolFree(Mem m);
+
+// ---------------------------------
+
+// MemVM is an allocator which gives every allocation a range of reserved address space of
+// its own and commits memory as the allocation grows. realloc doesn't move an allocation
+// unless it grows beyond the reserved size, so arrays and buffers can grow without copying
+// and pointers into them stay valid. Each allocation occupies at least one page and costs a
+// few syscalls, so MemVM is meant for a few large buffers which grow over time.
+// Str can be backed by MemVM by defining R_STR_MEM (see str.h)
+// This allocator is thread safe.
+typedef struct MemVM {
+  MemAllocator ma;
+  size_t       reserve; // bytes of address space reserved per allocation
+} MemVM;
+
+// MemVMInit initializes a MemVM allocator which reserves at least reserve bytes of address
+// space for each allocation. Reservations don't use any memory, so reserve can be large,
+// e.g. many gigabytes on 64-bit systems.
+Mem MemVMInit(MemVM* a, size_t reserve);
+
+// ---------------------------------
+
+// mem_pagealloc allocates npages of zeroed memory. Returns NULL on error.
+// Pages are taken from the page cache when possible, otherwise mapped from the OS.
 void* nullable mem_pagealloc(size_t npages, MemPageFlags);
 
+// mem_pagealloc_uninit is like mem_pagealloc but pages taken from the page cache are not
+// cleared. Sets *zeroed to true if the memory is known to be zero.
+void* nullable mem_pagealloc_uninit(size_t npages, MemPageFlags, bool* zeroed);
+
+// mem_pagealloc_aligned is like mem_pagealloc but the returned address is aligned to
+// alignment, which must be a power of two. Free with mem_pagefree.
+void* nullable mem_pagealloc_aligned(size_t npages, size_t alignment, MemPageFlags);
+
 // mem_pagefree frees pages allocated with mem_pagealloc. Returns false and sets errno on error.
+// The pages may be kept in the page cache for reuse rather than being returned to the OS.
+// Pages mapped with guard pages or explicit huge pages (MemPageHugeTLB) are never cached.
 bool mem_pagefree(void* ptr, size_t npages);
 
+// mem_pagefree_uncached returns pages to the OS, bypassing the page cache.
+bool mem_pagefree_uncached(void* ptr, size_t npages);
+
+// MemPageCacheStats describes the page cache, a process-wide cache of freed page runs
+typedef struct MemPageCacheStats {
+  u64 nhit;  // mem_pagealloc calls served from the cache
+  u64 nmiss; // mem_pagealloc calls which had to map new pages
+  u64 nput;  // runs added to the cache by mem_pagefree
+  u64 nfull; // runs returned to the OS by mem_pagefree because the cache was full
+  u64 bytes; // bytes currently in the cache
+} MemPageCacheStats;
+
+// mem_pagecache_stats returns counters of the page cache. The hit rate is nhit/(nhit+nmiss).
+void mem_pagecache_stats(MemPageCacheStats* st);
+
+// mem_pagecache_drain returns all pages in the page cache to the OS.
+// Returns the number of bytes returned.
+size_t mem_pagecache_drain();
+
+// mem_trim asks allocators to return memory which they keep around for reuse to the OS,
+// e.g. when a long-running process is under memory pressure. It drains the page cache and
+// calls the handlers registered with mem_trim_register. Linear allocators (including scratch
+// arenas) are not thread safe and release their retained blocks at their next MemLinearReset.
+// Returns the number of bytes released right away.
+size_t mem_trim();
+
+// MemTrimHandler is called by mem_trim, from any thread, and may call mem_trim_register and
+// mem_trim_unregister. It returns the number of bytes it released.
+typedef size_t (*MemTrimHandler)(void* nullable ctx);
+
+// mem_trim_register adds a handler to be called by mem_trim.
+// Returns false if too many handlers are registered.
+bool mem_trim_register(MemTrimHandler f, void* nullable ctx);
+
+// mem_trim_unregister removes a handler added with mem_trim_register. Once it returns, the
+// handler is no longer called, unless mem_trim_unregister is called from a handler.
+void mem_trim_unregister(MemTrimHandler f, void* nullable ctx);
+
+// mem_trim_epoch returns the number of times mem_trim has been called. Allocators which are
+// not thread safe can check it to see if they should release memory.
+u32 mem_trim_epoch();
+
+// mem_pressure_watch starts a thread which calls mem_trim when memory is scarce. Every
+// interval_ms it reads the pressure stall information (PSI) of the process's cgroup, or of the
+// system, and trims when tasks were stalled waiting for memory more than threshold percent
+// of the last 10 seconds ("some avg10"). It trims at most once every 10 seconds.
+// Returns false if PSI is not available, which is the case on systems other than Linux.
+bool mem_pressure_watch(double threshold, u32 interval_ms);
+
+// mem_pressure_unwatch stops the thread started by mem_pressure_watch
+void mem_pressure_unwatch();
+
+// mem_pageremap resizes a run of pages allocated with mem_pagealloc to newnpages, possibly
+// moving it to a different address. Pages added to the run are zero. On Linux the pages are
+// moved with mremap without copying their contents. Returns NULL on error, in which case the
+// run is left untouched. Pages with guard pages or alignment requirements must not be remapped.
+void* nullable mem_pageremap(void* ptr, size_t npages, size_t newnpages);
+
+// mem_pagerelease tells the OS that the contents of npages at ptr are no longer needed,
+// allowing it to reclaim the physical memory while the address range stays mapped.
+// The contents of the pages are undefined afterwards; they may read as zero or as before.
+// Returns false and sets errno on error.
+bool mem_pagerelease(void* ptr, size_t npages);
+
+// MemVMRegion is a range of reserved address space, created with mem_vmreserve
+typedef struct MemVMRegion {
+  void* nullable base; // page-aligned start address, or NULL if reservation failed
+  size_t         size; // size in bytes, a multiple of mem_pagesize()
+} MemVMRegion;
+
+// mem_vmreserve reserves size bytes (rounded up to whole pages) of address space without
+// committing any memory. The memory can't be accessed until it's committed.
+// Returns a region with a NULL base and sets errno on error.
+MemVMRegion mem_vmreserve(size_t size);
+
+// mem_vmcommit makes size bytes at offset of region r accessible. Committed memory which
+// has never been written to reads as zero. offset and size must be multiples of mem_pagesize.
+// Returns false and sets errno on error.
+bool mem_vmcommit(MemVMRegion r, size_t offset, size_t size);
+
+// mem_vmdecommit discards the contents of size bytes at offset of region r and makes the
+// memory inaccessible, returning the physical memory to the OS. The range stays reserved.
+// offset and size must be multiples of mem_pagesize.
+// Returns false and sets errno on error.
+bool mem_vmdecommit(MemVMRegion r, size_t offset, size_t size);
+
+// mem_vmrelease releases the address space of r
+bool mem_vmrelease(MemVMRegion r);
+
 // ---------------------------------
 
 /*
@@ -201,11 +612,22 @@ static void* nullable _mem_libc_realloc(Mem _, void* ptr, size_t newsize) {
 static void _mem_libc_free(Mem _, void* ptr) {
   free(ptr);
 }
+static void* nullable _mem_libc_alloc_uninit(Mem _, size_t size) {
+  return malloc(size);
+}
+static void* nullable _mem_libc_alloc_aligned(Mem _, size_t size, size_t align) {
+  void* p;
+  if (posix_memalign(&p, MAX(align, sizeof(void*)), size) != 0)
+    return NULL;
+  return memset(p, 0, size);
+}
 __attribute__((used))
 static const MemAllocator _mem_libc = {
-  .alloc   = _mem_libc_alloc,
-  .realloc = _mem_libc_realloc,
-  .free    = _mem_libc_free,
+  .alloc         = _mem_libc_alloc,
+  .realloc       = _mem_libc_realloc,
+  .free          = _mem_libc_free,
+  .alloc_aligned = _mem_libc_alloc_aligned,
+  .alloc_uninit  = _mem_libc_alloc_uninit,
 };
 inline static Mem MemLibC() {
   return &_mem_libc;
@@ -221,6 +643,15 @@ inline static void* memalloc(Mem m, size_t size) {
   return p;
 }
 
+inline static void* memalloc_uninit(Mem m, size_t size) {
+  assertnotnull_debug(m);
+  void* p = m->alloc_uninit ? m->alloc_uninit(m, size) : m->alloc(m, size);
+  #ifdef R_MEM_DEBUG_ALLOCATIONS
+  dlog("memalloc_uninit %p-%p (%zu)", p, p + size, size);
+  #endif
+  return p;
+}
+
 inline static void* memrealloc(Mem m, void* nullable ptr, size_t newsize) {
   assertnotnull_debug(m);
   void* p = ptr ? m->realloc(m, ptr, newsize) : m->alloc(m, newsize);
@@ -239,6 +670,63 @@ inline static void memfree(Mem m, void* _Nonnull ptr) {
   m->free(m, ptr);
 }
 
+inline static void memfree_sized(Mem m, void* _Nonnull ptr, size_t size) {
+  assertnotnull_debug(m);
+  assertnotnull_debug(ptr);
+  #ifdef R_MEM_DEBUG_ALLOCATIONS
+  dlog("memfree_sized %p (%zu)", ptr, size);
+  #endif
+  if (m->free_sized) {
+    m->free_sized(m, ptr, size);
+  } else {
+    m->free(m, ptr);
+  }
+}
+
+void* nullable _memalloc_aligned_fallback(Mem m, size_t size, size_t align);
+void _memfree_aligned_fallback(Mem m, void* ptr);
+
+inline static void* memalloc_aligned(Mem m, size_t size, size_t align) {
+  assertnotnull_debug(m);
+  assert_debug(align > 0 && (align & (align - 1)) == 0); // power of two
+  void* p = m->alloc_aligned ?
+    m->alloc_aligned(m, size, align) :
+    _memalloc_aligned_fallback(m, size, align);
+  #ifdef R_MEM_DEBUG_ALLOCATIONS
+  dlog("memalloc_aligned %p-%p (%zu, align %zu)", p, p + size, size, align);
+  #endif
+  return p;
+}
+
+inline static void memfree_aligned(Mem m, void* _Nonnull ptr, size_t size) {
+  if (m->alloc_aligned) {
+    memfree_sized(m, ptr, size);
+  } else {
+    _memfree_aligned_fallback(m, ptr);
+  }
+}
+
+inline static size_t memalloc_batch(Mem m, size_t size, size_t count, void** ptrs) {
+  assertnotnull_debug(m);
+  if (m->alloc_batch)
+    return m->alloc_batch(m, size, count, ptrs);
+  for (size_t i = 0; i < count; i++) {
+    if (!(ptrs[i] = m->alloc(m, size)))
+      return i;
+  }
+  return count;
+}
+
+inline static void memfree_batch(Mem m, size_t size, size_t count, void** ptrs) {
+  assertnotnull_debug(m);
+  if (m->free_batch) {
+    m->free_batch(m, size, count, ptrs);
+  } else {
+    for (size_t i = 0; i < count; i++)
+      memfree_sized(m, ptrs[i], size);
+  }
+}
+
 inline static void* memdup(Mem m, const void* src, size_t len) {
   return memdup2(m, src, len, 0);
 }
@@ -12,8 +12,10 @@ typedef struct MemArenaShimEntry {
 static void* MemArenaShim_alloc(Mem m, size_t size) {
   MemArenaShim* a = (MemArenaShim*)m;
   auto e = (MemArenaShimEntry*)memalloc(a->underlying, sizeof(MemArenaShimEntry) + size);
+  if (!e)
+    return NULL;
   e->next = a->allocations;
-  a->allocations = e->next;
+  a->allocations = e;
   return ENT_TO_PTR(e);
 }
 
@@ -23,28 +25,21 @@ static void* MemArenaShim_realloc(Mem m, void* ptr, size_t newsize) {
   auto olde = PTR_TO_ENT(ptr);
   auto newe = (MemArenaShimEntry*)memrealloc(
     a->underlying, olde, sizeof(MemArenaShimEntry) + newsize);
-  void* ptr2 = ENT_TO_PTR(newe);
-  if (ptr != ptr2) {
-    // allocation moved
-    MemArenaShimEntry* e = a->allocations;
-    MemArenaShimEntry* preve = NULL;
-    while (e) {
-      if (ENT_TO_PTR(e) == ptr) {
-        if (preve) {
-          // middle or tail
-          preve->next = e->next;
-        } else {
-          // head
-          a->allocations = e->next;
-        }
-        memfree(a->underlying, e);
+  if (!newe)
+    return NULL;
+  if (newe != olde) {
+    // allocation moved and olde has been freed by the underlying allocator.
+    // Replace the link to olde with newe. Note that newe->next was copied by memrealloc.
+    MemArenaShimEntry** ep = &a->allocations;
+    while (*ep) {
+      if (*ep == olde) {
+        *ep = newe;
         break;
       }
-      preve = e;
-      e = e->next;
+      ep = &(*ep)->next;
     }
   }
-  return ptr2;
+  return ENT_TO_PTR(newe);
 }
 
 static void MemArenaShim_free(Mem _, void* ptr) {
@@ -54,16 +49,338 @@ static void MemArenaShim_free(Mem _, void* ptr) {
 Mem MemArenaShimInit(MemArenaShim* a, Mem underlying) {
   a->underlying = underlying;
   a->allocations = NULL;
-  a->ma.alloc   = MemArenaShim_alloc;
-  a->ma.realloc = MemArenaShim_realloc;
-  a->ma.free    = MemArenaShim_free;
+  a->ma = (MemAllocator){
+    .alloc   = MemArenaShim_alloc,
+    .realloc = MemArenaShim_realloc,
+    .free    = MemArenaShim_free,
+  };
   return &a->ma;
 }
 
 void MemArenaShimFree(MemArenaShim* a) {
   MemArenaShimEntry* e = a->allocations;
   while (e) {
+    MemArenaShimEntry* next = e->next;
     memfree(a->underlying, e);
-    e = e->next;
+    e = next;
+  }
+  a->allocations = NULL;
+}
+
+// ------------------------------------------------------------------------------------
+// MemArena
+
+// ARENA_CHUNKSIZE_MIN and _MAX bound the size of chunks allocated from the underlying
+// allocator. Each new chunk is twice as large as the previous one.
+#define ARENA_CHUNKSIZE_MIN (8 * 1024)
+#define ARENA_CHUNKSIZE_MAX (1024 * 1024)
+
+// allocations larger than this get a chunk of their own
+#define ARENA_LARGE_ALLOC (ARENA_CHUNKSIZE_MAX / 4)
+
+#define ARENA_ALIGN(size) align2((size), sizeof(void*))
+
+typedef struct MemArenaChunk {
+  struct MemArenaChunk* nullable next;
+  size_t size; // number of bytes in data
+  size_t len;  // number of bytes of data in use
+  u8     data[];
+} MemArenaChunk;
+
+// ArenaHeader precedes every allocation (for realloc support)
+typedef struct ArenaHeader {
+  size_t size; // number of bytes in data
+  u8     data[];
+} ArenaHeader;
+
+#define PTR_TO_AHDR(ptr) ( (ArenaHeader*)(((u8*)(ptr)) - sizeof(ArenaHeader)) )
+
+// arena_istop returns true if ah is the most recent allocation in the current chunk
+inline static bool arena_istop(MemArena* a, ArenaHeader* ah) {
+  MemArenaChunk* c = a->chunks;
+  return c && &ah->data[ah->size] == &c->data[c->len];
+}
+
+static MemArenaChunk* nullable arena_newchunk(MemArena* a, size_t datasize) {
+  auto c = (MemArenaChunk*)memalloc(a->underlying, sizeof(MemArenaChunk) + datasize);
+  if (!c)
+    return NULL;
+  c->size = datasize;
+  c->len = 0;
+  return c;
+}
+
+static void* nullable MemArena_alloc(Mem m, size_t size) {
+  MemArena* a = (MemArena*)m;
+  if (R_UNLIKELY(size > SIZE_MAX - sizeof(ArenaHeader) - sizeof(void*)))
+    return NULL;
+  size_t allocsize = ARENA_ALIGN(sizeof(ArenaHeader) + size);
+  MemArenaChunk* c = a->chunks;
+
+  if (R_UNLIKELY(c == NULL || c->size - c->len < allocsize)) {
+    if (allocsize > ARENA_LARGE_ALLOC) {
+      // Large allocations get a chunk of their own which is placed after the current chunk,
+      // so that the remaining space of the current chunk can still be used.
+      c = arena_newchunk(a, allocsize);
+      if (!c)
+        return NULL;
+      if (a->chunks) {
+        c->next = a->chunks->next;
+        a->chunks->next = c;
+      } else {
+        c->next = NULL;
+        a->chunks = c;
+      }
+    } else {
+      a->chunksize = MIN(MAX(a->chunksize * 2, ARENA_CHUNKSIZE_MIN), ARENA_CHUNKSIZE_MAX);
+      c = arena_newchunk(a, a->chunksize - sizeof(MemArenaChunk));
+      if (!c)
+        return NULL;
+      c->next = a->chunks;
+      a->chunks = c;
+    }
+  }
+
+  auto ah = (ArenaHeader*)&c->data[c->len];
+  ah->size = allocsize - sizeof(ArenaHeader);
+  c->len += allocsize;
+  return &ah->data[0];
+}
+
+// arena_find_ownchunk returns the link to the chunk which holds only ah, or NULL if ah shares
+// its chunk with other allocations. O(n) complexity where n is the number of chunks, which
+// is fine for large allocations, since resizing them copies at least ARENA_LARGE_ALLOC bytes.
+static MemArenaChunk** nullable arena_find_ownchunk(MemArena* a, ArenaHeader* ah) {
+  for (MemArenaChunk** cp = &a->chunks; *cp; cp = &(*cp)->next) {
+    MemArenaChunk* c = *cp;
+    if ((u8*)ah == &c->data[0])
+      return c->len == sizeof(ArenaHeader) + ah->size ? cp : NULL;
+  }
+  return NULL;
+}
+
+// arena_realloc_ownchunk grows the allocation ah, which has the chunk *cp of its own, by
+// resizing the chunk with the underlying allocator
+static void* nullable arena_realloc_ownchunk(
+  MemArena* a, MemArenaChunk** cp, ArenaHeader* ah, size_t newsize)
+{
+  size_t oldsize = ah->size;
+  size_t allocsize = sizeof(ArenaHeader) + newsize;
+  MemArenaChunk* c = memrealloc(a->underlying, *cp, sizeof(MemArenaChunk) + allocsize);
+  if (!c)
+    return NULL;
+  c->size = allocsize;
+  c->len = allocsize;
+  *cp = c;
+  ah = (ArenaHeader*)&c->data[0];
+  ah->size = newsize;
+  // memory handed out by alloc must be zeroed
+  memset(&ah->data[oldsize], 0, newsize - oldsize);
+  return &ah->data[0];
+}
+
+static void* nullable MemArena_realloc(Mem m, void* ptr, size_t newsize) {
+  MemArena* a = (MemArena*)m;
+  ArenaHeader* ah = PTR_TO_AHDR(ptr);
+  if (R_UNLIKELY(newsize > SIZE_MAX - sizeof(ArenaHeader) - sizeof(void*)))
+    return NULL;
+  newsize = ARENA_ALIGN(newsize);
+  if (newsize <= ah->size) {
+    if (arena_istop(a, ah)) {
+      // shrink the top; memory handed out by alloc must be zeroed
+      size_t diff = ah->size - newsize;
+      memset(&ah->data[newsize], 0, diff);
+      a->chunks->len -= diff;
+      ah->size = newsize;
+    }
+    return ptr;
+  }
+  if (arena_istop(a, ah)) {
+    MemArenaChunk* c = a->chunks;
+    if (newsize - ah->size <= c->size - c->len) {
+      // grow the top in place
+      c->len += newsize - ah->size;
+      ah->size = newsize;
+      return ptr;
+    }
+  }
+  if (sizeof(ArenaHeader) + ah->size > ARENA_LARGE_ALLOC) {
+    // a large allocation may have a chunk of its own, which is resized rather than left
+    // behind when the allocation moves
+    MemArenaChunk** cp = arena_find_ownchunk(a, ah);
+    if (cp)
+      return arena_realloc_ownchunk(a, cp, ah, newsize);
+  }
+  void* ptr2 = MemArena_alloc(m, newsize);
+  if (ptr2)
+    memcpy(ptr2, ptr, ah->size);
+  return ptr2;
+}
+
+static void MemArena_free(Mem m, void* ptr) {
+  MemArena* a = (MemArena*)m;
+  ArenaHeader* ah = PTR_TO_AHDR(ptr);
+  if (arena_istop(a, ah)) {
+    size_t allocsize = sizeof(ArenaHeader) + ah->size;
+    a->chunks->len -= allocsize;
+    memset(ah, 0, allocsize);
+  }
+}
+
+Mem MemArenaInit(MemArena* a, Mem underlying) {
+  a->ma = (MemAllocator){
+    .alloc   = MemArena_alloc,
+    .realloc = MemArena_realloc,
+    .free    = MemArena_free,
+  };
+  a->underlying = underlying;
+  a->chunks = NULL;
+  a->chunksize = 0;
+  return &a->ma;
+}
+
+void MemArenaFree(MemArena* a) {
+  MemArenaChunk* c = a->chunks;
+  while (c) {
+    MemArenaChunk* next = c->next;
+    memfree(a->underlying, c);
+    c = next;
+  }
+  a->chunks = NULL;
+  a->chunksize = 0;
+}
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+// CountingMem counts calls to the allocator it wraps
+typedef struct CountingMem {
+  MemAllocator ma;
+  Mem          m;
+  u32          nalloc, nrealloc, nfree;
+} CountingMem;
+
+static void* nullable counting_alloc(Mem m, size_t size) {
+  CountingMem* cm = (CountingMem*)m;
+  cm->nalloc++;
+  return cm->m->alloc(cm->m, size);
+}
+static void* nullable counting_realloc(Mem m, void* ptr, size_t newsize) {
+  CountingMem* cm = (CountingMem*)m;
+  cm->nrealloc++;
+  return cm->m->realloc(cm->m, ptr, newsize);
+}
+static void counting_free(Mem m, void* ptr) {
+  CountingMem* cm = (CountingMem*)m;
+  cm->nfree++;
+  cm->m->free(cm->m, ptr);
+}
+static Mem counting_init(CountingMem* cm, Mem m) {
+  *cm = (CountingMem){ { counting_alloc, counting_realloc, counting_free }, m, 0, 0, 0 };
+  return &cm->ma;
+}
+
+R_TEST(mem_arena_shim) {
+  CountingMem cm;
+  MemArenaShim arena;
+  Mem m = MemArenaShimInit(&arena, counting_init(&cm, MemLibC()));
+  void* ptrs[10];
+  for (u32 i = 0; i < countof(ptrs); i++)
+    ptrs[i] = assertnotnull(memalloc(m, 16));
+  ptrs[3] = assertnotnull(memrealloc(m, ptrs[3], 64 * 1024)); // likely moves
+  MemArenaShimFree(&arena);
+  asserteq(cm.nalloc, countof(ptrs));
+  asserteq(cm.nfree, countof(ptrs)); // every allocation is freed exactly once
+}
+
+R_TEST(mem_arena) {
+  { // allocations are carved out of a few chunks
+    CountingMem cm;
+    MemArena arena;
+    Mem m = MemArenaInit(&arena, counting_init(&cm, MemLibC()));
+    for (u32 i = 0; i < 10000; i++) {
+      u8* p = assertnotnull(memalloc(m, 1 + (i % 100)));
+      for (u32 j = 0; j < 1 + (i % 100); j++)
+        asserteq(p[j], 0);
+      memset(p, 0xff, 1 + (i % 100));
+    }
+    assert(cm.nalloc < 20);
+    u32 nalloc = cm.nalloc;
+    MemArenaFree(&arena);
+    asserteq(cm.nfree, nalloc);
+  }
+
+  { // free, shrink and grow of the top allocation is done in place
+    MemArena arena;
+    Mem m = MemArenaInit(&arena, MemLibC());
+    u8* p1 = memalloc(m, 16);
+    memset(p1, 0xff, 16);
+    memfree(m, p1);
+    u8* p2 = memalloc(m, 16);
+    asserteq(p1, p2);
+    for (u32 i = 0; i < 16; i++)
+      asserteq(p2[i], 0); // memory recycled by free should be zeroed
+    p2 = memrealloc(m, p2, 1024);
+    asserteq(p1, p2);
+    p2 = memrealloc(m, p2, 8);
+    asserteq(p1, p2);
+    u8* p3 = memalloc(m, 8);
+    asserteq(p3, p2 + 8 + sizeof(ArenaHeader));
+    MemArenaFree(&arena);
+  }
+
+  { // realloc of an allocation which is not at the top moves it
+    MemArena arena;
+    Mem m = MemArenaInit(&arena, MemLibC());
+    char* p1 = memalloc(m, 8);
+    memcpy(p1, "hello", 5);
+    UNUSED void* p2 = memalloc(m, 8);
+    char* p3 = memrealloc(m, p1, 32);
+    assertne(p1, p3);
+    asserteq(memcmp(p3, "hello", 5), 0);
+    MemArenaFree(&arena);
+  }
+
+  { // large allocations get their own chunk without wasting the current chunk
+    MemArena arena;
+    Mem m = MemArenaInit(&arena, MemLibC());
+    u8* p1 = memalloc(m, 8);
+    u8* p2 = assertnotnull(memalloc(m, ARENA_LARGE_ALLOC * 2));
+    p2[ARENA_LARGE_ALLOC * 2 - 1] = 1;
+    u8* p3 = memalloc(m, 8);
+    asserteq(p3, p1 + 8 + sizeof(ArenaHeader));
+    MemArenaFree(&arena);
+  }
+
+  { // realloc of a large allocation resizes its chunk instead of leaving it behind
+    CountingMem cm;
+    MemArena arena;
+    Mem m = MemArenaInit(&arena, counting_init(&cm, MemLibC()));
+    UNUSED void* p1 = memalloc(m, 8);
+    u8* p2 = assertnotnull(memalloc(m, ARENA_LARGE_ALLOC * 2));
+    memset(p2, 0xff, ARENA_LARGE_ALLOC * 2);
+    u32 nalloc = cm.nalloc;
+    for (u32 i = 3; i < 8; i++) {
+      p2 = assertnotnull(memrealloc(m, p2, ARENA_LARGE_ALLOC * i));
+      asserteq(p2[ARENA_LARGE_ALLOC * 2 - 1], 0xff);
+      asserteq(p2[ARENA_LARGE_ALLOC * i - 1], 0);
+    }
+    asserteq(cm.nalloc, nalloc);
+    asserteq(cm.nrealloc, 5);
+    MemArenaFree(&arena);
+    asserteq(cm.nfree, nalloc);
+  }
+
+  { // sizes which would overflow fail
+    MemArena arena;
+    Mem m = MemArenaInit(&arena, MemLibC());
+    volatile size_t hugesize = SIZE_MAX;
+    assertnull(memalloc(m, hugesize));
+    assertnull(memalloc(m, hugesize - sizeof(ArenaHeader)));
+    void* p = assertnotnull(memalloc(m, 8));
+    assertnull(memrealloc(m, p, hugesize));
+    MemArenaFree(&arena);
   }
 }
+
+#endif /* R_TESTING_ENABLED */
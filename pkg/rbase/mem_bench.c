@@ -0,0 +1,842 @@
+//
+// Run these benchmarks with:
+//   ckit build -fast mem_bench && ./out/fast/mem_bench
+//
+// Alternatively with incremental compilation:
+//   ckit watch -fast -r mem_bench
+//
+// Usage: mem_bench [<milliseconds>]
+// <milliseconds>  How long to sample each benchmark. Defaults to 1000.
+//
+#include "rbase.h"
+#include "bench_impl.h"
+
+ASSUME_NONNULL_BEGIN
+
+int main(int argc, const char** argv) {
+  return benchmark_main(argc, argv);
+}
+
+// ————————————————————————————————————————————————————————————————————————————————————————————
+// allocators
+
+typedef struct MemImpl {
+  const char* name;
+  Mem  (*open)();
+  void (*close)(Mem);
+} MemImpl;
+
+// MT_FIXEDSIZE is the object size of fixed-size benchmarks
+#define MT_FIXEDSIZE 64
+
+static Mem  libc_open() { return MemLibC(); }
+static void libc_close(Mem m) {}
+
+static Mem  slab_open() { return MemSlab(); }
+static void slab_close(Mem m) {}
+
+static Mem  linear_sync_open() { return MemSyncWrapper(assertnotnull(MemLinearAlloc(16))); }
+static void linear_sync_close(Mem m) { MemLinearFree(MemSyncWrapperFree(m)); }
+
+static Mem  stats_slab_open() { return assertnotnull(MemStatsWrapper(MemSlab())); }
+static void stats_slab_close(Mem m) { MemStatsWrapperFree(m); }
+
+static Mem  objpool_open() { return assertnotnull(MemObjPool(MT_FIXEDSIZE)); }
+static void objpool_close(Mem m) { MemObjPoolFree(m); }
+
+static Mem  prof_slab_open() { return assertnotnull(MemProfWrapper(MemSlab(), 0)); }
+static void prof_slab_close(Mem m) { MemProfWrapperFree(m); }
+
+static Mem  linear_open() { return assertnotnull(MemLinearAlloc(16)); }
+static void linear_close(Mem m) { MemLinearFree(m); }
+
+static MemArenaShim bench_shim;
+
+static Mem  arena_shim_open() { return MemArenaShimInit(&bench_shim, MemLibC()); }
+static void arena_shim_close(Mem m) { MemArenaShimFree(&bench_shim); }
+
+static Mem  arena_shim_sync_open() { return MemSyncWrapper(arena_shim_open()); }
+static void arena_shim_sync_close(Mem m) { arena_shim_close(MemSyncWrapperFree(m)); }
+
+static const MemImpl impl_libc        = { "MemLibC", libc_open, libc_close };
+static const MemImpl impl_slab        = { "MemSlab", slab_open, slab_close };
+static const MemImpl impl_linear_sync = {
+  "MemSyncWrapper(MemLinearAlloc)", linear_sync_open, linear_sync_close };
+static const MemImpl impl_stats_slab  = {
+  "MemStatsWrapper(MemSlab)", stats_slab_open, stats_slab_close };
+static const MemImpl impl_objpool     = { "MemObjPool", objpool_open, objpool_close };
+static const MemImpl impl_prof_slab   = {
+  "MemProfWrapper(MemSlab)", prof_slab_open, prof_slab_close };
+static const MemImpl impl_linear      = { "MemLinearAlloc", linear_open, linear_close };
+static const MemImpl impl_arena_shim  = {
+  "MemArenaShim(MemLibC)", arena_shim_open, arena_shim_close };
+static const MemImpl impl_arena_shim_sync = {
+  "MemSyncWrapper(MemArenaShim(MemLibC))", arena_shim_sync_open, arena_shim_sync_close };
+
+// ————————————————————————————————————————————————————————————————————————————————————————————
+// threads
+
+// MT_NSLOTS is the number of live allocations each thread keeps around
+#define MT_NSLOTS 64
+
+typedef struct TestThread {
+  thrd_t t;
+  u32    id;
+  Mem    mem;
+  u32    nops;  // number of alloc+free operations to perform
+  Timer  timer;
+} TestThread;
+
+// MT_REALLOC_MAXSIZE is the size up to which realloc_thread grows allocations
+#define MT_REALLOC_MAXSIZE (64 * 1024)
+
+// MtPattern is the order in which threads allocate and free memory
+typedef enum MtPattern {
+  MT_FIFO,    // free the oldest allocation
+  MT_LIFO,    // free allocations in reverse order, MT_NSLOTS at a time
+  MT_RANDOM,  // free a random allocation
+  MT_REALLOC, // grow random allocations with memrealloc
+} MtPattern;
+
+struct {
+  const MemImpl* impl;
+  u32            nthreads;
+  size_t         minsize, maxsize; // allocation size range
+  MtPattern      pattern;
+} mt_conf = {0};
+
+
+// mixed_thread allocates objects of random size in [minsize,maxsize], keeping up to
+// MT_NSLOTS allocations alive, freeing the oldest one before each new allocation.
+static int mixed_thread(void* tptr) {
+  auto t = (TestThread*)tptr;
+  Mem mem = t->mem;
+  void* slots[MT_NSLOTS] = {0};
+  u32 rnd = t->id;
+  size_t sizerange = mt_conf.maxsize - mt_conf.minsize + 1;
+  t->timer = TimerStart();
+  for (u32 i = 0; i < t->nops; i++) {
+    u32 slot = i % MT_NSLOTS;
+    if (slots[slot])
+      memfree(mem, slots[slot]);
+    rnd = rnd * 1103515245 + 12345; // LCG
+    size_t size = mt_conf.minsize + ((rnd >> 8) % sizerange);
+    slots[slot] = memalloc(mem, size);
+    *(volatile u8*)slots[slot] = 1; // touch
+  }
+  for (u32 slot = 0; slot < MT_NSLOTS; slot++) {
+    if (slots[slot])
+      memfree(mem, slots[slot]);
+  }
+  TimerStop(&t->timer);
+  return 0;
+}
+
+
+// lifo_thread allocates MT_NSLOTS objects of random size in [minsize,maxsize] and then frees
+// them in reverse order, like a stack.
+static int lifo_thread(void* tptr) {
+  auto t = (TestThread*)tptr;
+  Mem mem = t->mem;
+  void* slots[MT_NSLOTS];
+  u32 rnd = t->id;
+  size_t sizerange = mt_conf.maxsize - mt_conf.minsize + 1;
+  t->timer = TimerStart();
+  for (u32 i = 0; i < t->nops; i += MT_NSLOTS) {
+    for (u32 slot = 0; slot < MT_NSLOTS; slot++) {
+      rnd = rnd * 1103515245 + 12345; // LCG
+      size_t size = mt_conf.minsize + ((rnd >> 8) % sizerange);
+      slots[slot] = memalloc(mem, size);
+      *(volatile u8*)slots[slot] = 1; // touch
+    }
+    for (u32 slot = MT_NSLOTS; slot > 0; slot--)
+      memfree(mem, slots[slot - 1]);
+  }
+  TimerStop(&t->timer);
+  return 0;
+}
+
+// random_thread allocates objects of random size in [minsize,maxsize], keeping up to
+// MT_NSLOTS allocations alive, freeing a random one before each new allocation.
+static int random_thread(void* tptr) {
+  auto t = (TestThread*)tptr;
+  Mem mem = t->mem;
+  void* slots[MT_NSLOTS] = {0};
+  u32 rnd = t->id;
+  size_t sizerange = mt_conf.maxsize - mt_conf.minsize + 1;
+  t->timer = TimerStart();
+  for (u32 i = 0; i < t->nops; i++) {
+    rnd = rnd * 1103515245 + 12345; // LCG
+    u32 slot = (rnd >> 8) % MT_NSLOTS;
+    if (slots[slot])
+      memfree(mem, slots[slot]);
+    rnd = rnd * 1103515245 + 12345;
+    size_t size = mt_conf.minsize + ((rnd >> 8) % sizerange);
+    slots[slot] = memalloc(mem, size);
+    *(volatile u8*)slots[slot] = 1; // touch
+  }
+  for (u32 slot = 0; slot < MT_NSLOTS; slot++) {
+    if (slots[slot])
+      memfree(mem, slots[slot]);
+  }
+  TimerStop(&t->timer);
+  return 0;
+}
+
+// realloc_thread doubles the size of a random one of MT_NSLOTS allocations with memrealloc,
+// starting over with a new allocation of random size in [minsize,maxsize] when it has
+// reached MT_REALLOC_MAXSIZE.
+static int realloc_thread(void* tptr) {
+  auto t = (TestThread*)tptr;
+  Mem mem = t->mem;
+  void* slots[MT_NSLOTS] = {0};
+  size_t sizes[MT_NSLOTS] = {0};
+  u32 rnd = t->id;
+  size_t sizerange = mt_conf.maxsize - mt_conf.minsize + 1;
+  t->timer = TimerStart();
+  for (u32 i = 0; i < t->nops; i++) {
+    rnd = rnd * 1103515245 + 12345; // LCG
+    u32 slot = (rnd >> 8) % MT_NSLOTS;
+    if (slots[slot] && sizes[slot] < MT_REALLOC_MAXSIZE) {
+      sizes[slot] *= 2;
+      slots[slot] = memrealloc(mem, slots[slot], sizes[slot]);
+    } else {
+      if (slots[slot])
+        memfree(mem, slots[slot]);
+      rnd = rnd * 1103515245 + 12345;
+      sizes[slot] = mt_conf.minsize + ((rnd >> 8) % sizerange);
+      slots[slot] = memalloc(mem, sizes[slot]);
+    }
+    ((volatile u8*)slots[slot])[sizes[slot] - 1] = 1; // touch
+  }
+  for (u32 slot = 0; slot < MT_NSLOTS; slot++) {
+    if (slots[slot])
+      memfree(mem, slots[slot]);
+  }
+  TimerStop(&t->timer);
+  return 0;
+}
+
+static const thrd_start_t mt_threadfuns[] = {
+  [MT_FIFO]    = mixed_thread,
+  [MT_LIFO]    = lifo_thread,
+  [MT_RANDOM]  = random_thread,
+  [MT_REALLOC] = realloc_thread,
+};
+
+static void mt_onbegin(Benchmark* b) {
+  const char* patterns[] = {
+    [MT_FIFO] = "FIFO", [MT_LIFO] = "LIFO", [MT_RANDOM] = "random", [MT_REALLOC] = "realloc",
+  };
+  fprintf(stderr, "%s with %u threads, sizes %zu-%zu, %s\n",
+    mt_conf.impl->name, mt_conf.nthreads, mt_conf.minsize, mt_conf.maxsize,
+    patterns[mt_conf.pattern]);
+}
+
+static Timer mt_sampler(Benchmark* b) {
+  auto conf = mt_conf;
+  Mem mem = conf.impl->open();
+  TestThread* threads = memalloc(MemLibC(), conf.nthreads * sizeof(TestThread));
+
+  for (u32 i = 0; i < conf.nthreads; i++) {
+    TestThread* t = &threads[i];
+    t->id = i + 1;
+    t->mem = mem;
+    t->nops = (u32)(b->N / conf.nthreads);
+    UNUSED auto status = thrd_create(&t->t, mt_threadfuns[conf.pattern], t);
+    asserteq(status, thrd_success);
+  }
+
+  u64 time_sum = 0;
+  u64 utime_sum = 0;
+  for (u32 i = 0; i < conf.nthreads; i++) {
+    int retval;
+    thrd_join(threads[i].t, &retval);
+    time_sum += threads[i].timer.time;
+    utime_sum += threads[i].timer.utime;
+  }
+
+  conf.impl->close(mem);
+  memfree(MemLibC(), threads);
+
+  // average of time used by threads
+  Timer timer = {
+    .time  = time_sum / conf.nthreads,
+    .utime = utime_sum / conf.nthreads,
+  };
+  return timer;
+}
+
+
+#define DEF_MT_BENCHMARK(name, implv, nthreadsv) \
+  DEF_MT_BENCHMARK_SIZES(name, implv, nthreadsv, 8, 512)
+
+#define DEF_MT_BENCHMARK_SIZES(name, implv, nthreadsv, minsizev, maxsizev) \
+  DEF_MT_BENCHMARK_PATTERN(name, implv, nthreadsv, minsizev, maxsizev, MT_FIFO)
+
+#define DEF_MT_BENCHMARK_PATTERN(name, implv, nthreadsv, minsizev, maxsizev, patternv) \
+  static void name##_onbegin(Benchmark* b) {     \
+    UNUSED u32 ncpu = MAX(1u, os_ncpu());        \
+    mt_conf.impl = &(implv);                     \
+    mt_conf.nthreads = (nthreadsv);              \
+    mt_conf.minsize = (minsizev);                \
+    mt_conf.maxsize = (maxsizev);                \
+    mt_conf.pattern = (patternv);                \
+    mt_onbegin(b);                               \
+  }                                              \
+  R_BENCHMARK(name, name##_onbegin)(Benchmark* b) { return mt_sampler(b); }
+
+DEF_MT_BENCHMARK(mixed_libc_1,        impl_libc,        1)
+DEF_MT_BENCHMARK(mixed_libc_N2,       impl_libc,        MAX(1u, ncpu / 2))
+DEF_MT_BENCHMARK(mixed_libc_N,        impl_libc,        ncpu)
+DEF_MT_BENCHMARK(mixed_linear_sync_1, impl_linear_sync, 1)
+DEF_MT_BENCHMARK(mixed_linear_sync_N2,impl_linear_sync, MAX(1u, ncpu / 2))
+DEF_MT_BENCHMARK(mixed_linear_sync_N, impl_linear_sync, ncpu)
+DEF_MT_BENCHMARK(mixed_slab_1,        impl_slab,        1)
+DEF_MT_BENCHMARK(mixed_slab_N2,       impl_slab,        MAX(1u, ncpu / 2))
+DEF_MT_BENCHMARK(mixed_slab_N,        impl_slab,        ncpu)
+DEF_MT_BENCHMARK(mixed_stats_slab_1,  impl_stats_slab,  1)
+DEF_MT_BENCHMARK(mixed_stats_slab_N,  impl_stats_slab,  ncpu)
+DEF_MT_BENCHMARK(mixed_prof_slab_1,   impl_prof_slab,   1)
+DEF_MT_BENCHMARK(mixed_prof_slab_N,   impl_prof_slab,   ncpu)
+
+DEF_MT_BENCHMARK_SIZES(fixed_libc_1,    impl_libc,    1,    MT_FIXEDSIZE, MT_FIXEDSIZE)
+DEF_MT_BENCHMARK_SIZES(fixed_libc_N,    impl_libc,    ncpu, MT_FIXEDSIZE, MT_FIXEDSIZE)
+DEF_MT_BENCHMARK_SIZES(fixed_objpool_1, impl_objpool, 1,    MT_FIXEDSIZE, MT_FIXEDSIZE)
+DEF_MT_BENCHMARK_SIZES(fixed_objpool_N, impl_objpool, ncpu, MT_FIXEDSIZE, MT_FIXEDSIZE)
+
+// the allocators of mem.h with each pattern. Allocators which are not thread safe are wrapped
+// in MemSyncWrapper for multiple threads. MemArenaShim is not used with the realloc pattern
+// since its realloc searches all allocations made so far.
+#define DEF_PATTERN_BENCHMARKS(pattern, patternv) \
+  DEF_MT_BENCHMARK_PATTERN(pattern##_libc_1,  impl_libc, 1,    8, 512, patternv) \
+  DEF_MT_BENCHMARK_PATTERN(pattern##_libc_N,  impl_libc, ncpu, 8, 512, patternv) \
+  DEF_MT_BENCHMARK_PATTERN(pattern##_linear_1, impl_linear, 1, 8, 512, patternv) \
+  DEF_MT_BENCHMARK_PATTERN(pattern##_linear_sync_1, impl_linear_sync, 1,    8, 512, patternv) \
+  DEF_MT_BENCHMARK_PATTERN(pattern##_linear_sync_N, impl_linear_sync, ncpu, 8, 512, patternv)
+
+#define DEF_PATTERN_BENCHMARKS_SHIM(pattern, patternv) \
+  DEF_MT_BENCHMARK_PATTERN(pattern##_arena_shim_1, impl_arena_shim, 1, 8, 512, patternv) \
+  DEF_MT_BENCHMARK_PATTERN(pattern##_arena_shim_sync_1, impl_arena_shim_sync, 1,    8, 512, \
+                           patternv) \
+  DEF_MT_BENCHMARK_PATTERN(pattern##_arena_shim_sync_N, impl_arena_shim_sync, ncpu, 8, 512, \
+                           patternv)
+
+DEF_PATTERN_BENCHMARKS(lifo, MT_LIFO)
+DEF_PATTERN_BENCHMARKS_SHIM(lifo, MT_LIFO)
+DEF_PATTERN_BENCHMARKS(random, MT_RANDOM)
+DEF_PATTERN_BENCHMARKS_SHIM(random, MT_RANDOM)
+DEF_PATTERN_BENCHMARKS(realloc, MT_REALLOC)
+
+
+// ————————————————————————————————————————————————————————————————————————————————————————————
+// MemLinearAlloc with many blocks
+
+// LINEAR_NPTRS is the number of allocations made in the root block
+#define LINEAR_NPTRS 64
+
+struct {
+  u32   nblocks; // number of blocks to grow the allocator to
+  bool  realloc; // measure realloc instead of free
+  Mem   mem;
+  void* ptrs[LINEAR_NPTRS];
+} linear_conf = {0};
+
+static void linear_blocks_onbegin(Benchmark* b) {
+  fprintf(stderr, "%s of allocations in the root block of %u blocks\n",
+    linear_conf.realloc ? "realloc" : "free", linear_conf.nblocks);
+  Mem mem = assertnotnull(MemLinearAlloc(1));
+  for (u32 i = 0; i < LINEAR_NPTRS; i++)
+    linear_conf.ptrs[i] = memalloc(mem, 64);
+  // each allocation of 2 pages causes the allocator to map a new block
+  for (u32 i = 1; i < linear_conf.nblocks; i++) {
+    UNUSED void* p = memalloc(mem, mem_pagesize() * 2);
+    assertnotnull(p);
+  }
+  linear_conf.mem = mem;
+}
+
+static void linear_blocks_onend(Benchmark* b) {
+  MemLinearFree(linear_conf.mem);
+}
+
+static Timer linear_blocks_sampler(Benchmark* b) {
+  Mem mem = linear_conf.mem;
+  auto timer = TimerStart();
+  if (linear_conf.realloc) {
+    for (size_t i = 0; i < b->N; i++) {
+      // shrinking an allocation which is not at the top is a noop, so the cost measured
+      // is that of the allocator looking at the allocation.
+      UNUSED void* p = memrealloc(mem, linear_conf.ptrs[i % LINEAR_NPTRS], 32);
+      assert(p == linear_conf.ptrs[i % LINEAR_NPTRS]);
+    }
+  } else {
+    for (size_t i = 0; i < b->N; i++) {
+      // freeing an allocation which is not at the top is a noop, so the cost measured
+      // is that of the allocator looking at the allocation.
+      memfree_sized(mem, linear_conf.ptrs[i % LINEAR_NPTRS], 64);
+    }
+  }
+  TimerStop(&timer);
+  return timer;
+}
+
+#define DEF_LINEAR_BLOCKS_BENCHMARK(name, nblocksv, reallocv) \
+  static void name##_onbegin(Benchmark* b) {         \
+    linear_conf.nblocks = (nblocksv);                \
+    linear_conf.realloc = (reallocv);                \
+    linear_blocks_onbegin(b);                        \
+  }                                                  \
+  R_BENCHMARK(name, name##_onbegin, linear_blocks_onend)(Benchmark* b) { \
+    return linear_blocks_sampler(b);                 \
+  }
+
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_free_blocks_1,    1,    false)
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_free_blocks_10,   10,   false)
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_free_blocks_100,  100,  false)
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_free_blocks_1000, 1000, false)
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_free_blocks_5000, 5000, false)
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_realloc_blocks_1,    1,    true)
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_realloc_blocks_10,   10,   true)
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_realloc_blocks_100,  100,  true)
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_realloc_blocks_1000, 1000, true)
+DEF_LINEAR_BLOCKS_BENCHMARK(linear_realloc_blocks_5000, 5000, true)
+
+
+// ————————————————————————————————————————————————————————————————————————————————————————————
+// MemLinearAlloc used for per-request work, reset (or recreated) after each request
+
+// REQ_SIZE is the number of bytes allocated by each request
+#define REQ_SIZE (4 * 1024 * 1024)
+
+struct {
+  bool  recreate; // free and create the allocator for every request instead of resetting it
+  Mem   mem;
+  u64   nreq;     // number of requests performed
+  u64   nfaults;  // number of page faults during those requests
+  MemLinearStats stats;
+  MemPageCacheStats pcstats; // page cache stats at the start of the benchmark
+} req_conf = {0};
+
+static u64 pagefaults() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (u64)(ru.ru_minflt + ru.ru_majflt);
+}
+
+static void req_onbegin(Benchmark* b) {
+  fprintf(stderr, "requests allocating %u MB each, %s\n",
+    REQ_SIZE / (1024 * 1024), req_conf.recreate ? "new allocator" : "MemLinearReset");
+  req_conf.mem = assertnotnull(MemLinearAlloc(1));
+  req_conf.nreq = 0;
+  req_conf.nfaults = 0;
+  mem_pagecache_stats(&req_conf.pcstats);
+}
+
+static void req_onend(Benchmark* b) {
+  MemLinearGetStats(req_conf.mem, &req_conf.stats);
+  MemLinearFree(req_conf.mem);
+  fprintf(stderr, "  %.2f page faults/request", (double)req_conf.nfaults / (double)req_conf.nreq);
+  if (!req_conf.recreate) {
+    fprintf(stderr, " (blocks: %zu mapped, %zu unmapped, %zu reused, %zu released)",
+      req_conf.stats.nmap, req_conf.stats.nunmap, req_conf.stats.nreuse,
+      req_conf.stats.nrelease);
+  } else {
+    MemPageCacheStats pc;
+    mem_pagecache_stats(&pc);
+    u64 nhit = pc.nhit - req_conf.pcstats.nhit;
+    u64 nmiss = pc.nmiss - req_conf.pcstats.nmiss;
+    fprintf(stderr, " (page cache: %llu hits, %llu misses, %.1f%% hit rate)",
+      nhit, nmiss, 100.0 * (double)nhit / (double)MAX(nhit + nmiss, 1));
+  }
+  fprintf(stderr, "\n");
+}
+
+static Timer req_sampler(Benchmark* b) {
+  const size_t pagesize = mem_pagesize();
+  u64 nfaults = pagefaults();
+  u32 rnd = 1;
+  auto timer = TimerStart();
+  for (size_t i = 0; i < b->N; i++) {
+    Mem mem = req_conf.mem;
+    for (size_t total = 0; total < REQ_SIZE; ) {
+      rnd = rnd * 1103515245 + 12345; // LCG
+      size_t size = 256 + ((rnd >> 8) % (64 * 1024));
+      u8* p = assertnotnull(memalloc(mem, size));
+      for (size_t off = 0; off < size; off += pagesize)
+        p[off] = 1; // touch every page
+      total += size;
+    }
+    if (req_conf.recreate) {
+      MemLinearFree(mem);
+      req_conf.mem = assertnotnull(MemLinearAlloc(1));
+    } else {
+      MemLinearReset(mem);
+    }
+  }
+  TimerStop(&timer);
+  req_conf.nfaults += pagefaults() - nfaults;
+  req_conf.nreq += b->N;
+  return timer;
+}
+
+static void req_reset_onbegin(Benchmark* b) {
+  req_conf.recreate = false;
+  req_onbegin(b);
+}
+static void req_recreate_onbegin(Benchmark* b) {
+  req_conf.recreate = true;
+  req_onbegin(b);
+}
+
+R_BENCHMARK(linear_request_reset, req_reset_onbegin, req_onend)(Benchmark* b) {
+  return req_sampler(b);
+}
+R_BENCHMARK(linear_request_recreate, req_recreate_onbegin, req_onend)(Benchmark* b) {
+  return req_sampler(b);
+}
+
+
+// ————————————————————————————————————————————————————————————————————————————————————————————
+// random access to a large MemLinearAlloc arena, with and without huge pages
+
+// WALK_SIZE is the size of the arena walked
+#define WALK_SIZE ((size_t)256 * 1024 * 1024)
+
+struct {
+  MemPageFlags flags;
+  Mem          mem;
+  u8*          p;
+  volatile u32 sink;
+} walk_conf = {0};
+
+// anon_hugepages returns the amount of memory in kB backed by transparent huge pages
+static size_t anon_hugepages() {
+  size_t kb = 0;
+  #ifdef __linux__
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if (f) {
+      char line[128];
+      while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+          break;
+      }
+      fclose(f);
+    }
+  #endif
+  return kb;
+}
+
+static void walk_onbegin(Benchmark* b) {
+  walk_conf.mem = assertnotnull(MemLinearAlloc2(1, walk_conf.flags));
+  walk_conf.p = assertnotnull(memalloc(walk_conf.mem, WALK_SIZE));
+  for (size_t i = 0; i < WALK_SIZE; i += mem_pagesize())
+    walk_conf.p[i] = (u8)i; // fault in all pages
+  fprintf(stderr, "random reads in a %zu MB arena (%s), AnonHugePages: %zu kB\n",
+    WALK_SIZE / (1024 * 1024),
+    (walk_conf.flags & MemPageHugeTLB) ? "MemPageHugeTLB" :
+    (walk_conf.flags & MemPageHugeHint) ? "MemPageHugeHint" : "MemPageDefault",
+    anon_hugepages());
+}
+
+static void walk_onend(Benchmark* b) {
+  MemLinearFree(walk_conf.mem);
+}
+
+static Timer walk_sampler(Benchmark* b) {
+  const u8* p = walk_conf.p;
+  u32 rnd = 1;
+  auto timer = TimerStart();
+  for (size_t i = 0; i < b->N; i++) {
+    // each address depends on the previous load, so that loads can't be issued ahead of
+    // time, exposing the latency of TLB misses
+    size_t offs = ((size_t)rnd * 64) % WALK_SIZE;
+    rnd = rnd * 1103515245 + 12345 + p[offs]; // LCG
+  }
+  TimerStop(&timer);
+  walk_conf.sink = rnd;
+  return timer;
+}
+
+#define DEF_WALK_BENCHMARK(name, flagsv)            \
+  static void name##_onbegin(Benchmark* b) {        \
+    walk_conf.flags = (flagsv);                     \
+    walk_onbegin(b);                                \
+  }                                                 \
+  R_BENCHMARK(name, name##_onbegin, walk_onend)(Benchmark* b) { \
+    return walk_sampler(b);                         \
+  }
+
+DEF_WALK_BENCHMARK(linear_walk_pages,    MemPageDefault)
+DEF_WALK_BENCHMARK(linear_walk_hugehint, MemPageHugeHint)
+DEF_WALK_BENCHMARK(linear_walk_hugetlb,  MemPageHugeTLB)
+
+
+// ————————————————————————————————————————————————————————————————————————————————————————————
+// growing a large buffer by appending to it
+
+// GROW_MAXSIZE is the size at which a buffer is discarded and a new one started
+#define GROW_MAXSIZE ((size_t)256 * 1024 * 1024)
+
+// GROW_CHUNKSIZE is the number of bytes appended by each operation
+#define GROW_CHUNKSIZE ((size_t)64 * 1024)
+
+static MemVM grow_vm;
+
+static Mem  vm_open() { return MemVMInit(&grow_vm, GROW_MAXSIZE + mem_pagesize()); }
+static void vm_close(Mem m) {}
+
+static Mem  large_open() { return MemLarge(); }
+static void large_close(Mem m) {}
+
+static const MemImpl impl_vm     = { "MemVM", vm_open, vm_close };
+static const MemImpl impl_large  = { "MemLarge", large_open, large_close };
+
+struct {
+  const MemImpl* impl;
+} grow_conf = {0};
+
+static void grow_onbegin(Benchmark* b) {
+  fprintf(stderr, "%s: append %zu kB at a time, doubling capacity, up to %zu MB\n",
+    grow_conf.impl->name, GROW_CHUNKSIZE / 1024, GROW_MAXSIZE / (1024 * 1024));
+}
+
+static Timer grow_sampler(Benchmark* b) {
+  u8 chunk[GROW_CHUNKSIZE];
+  memset(chunk, 1, sizeof(chunk));
+  Mem mem = grow_conf.impl->open();
+  u8* buf = NULL;
+  size_t len = 0, cap = 0;
+  auto timer = TimerStart();
+  for (size_t i = 0; i < b->N; i++) {
+    if (len == GROW_MAXSIZE) {
+      memfree(mem, buf);
+      buf = NULL;
+      len = cap = 0;
+    }
+    if (len + GROW_CHUNKSIZE > cap) {
+      cap = MAX(cap * 2, GROW_CHUNKSIZE);
+      buf = assertnotnull(memrealloc(mem, buf, cap));
+    }
+    memcpy(&buf[len], chunk, GROW_CHUNKSIZE);
+    len += GROW_CHUNKSIZE;
+  }
+  TimerStop(&timer);
+  if (buf)
+    memfree(mem, buf);
+  grow_conf.impl->close(mem);
+  return timer;
+}
+
+#define DEF_GROW_BENCHMARK(name, implv)             \
+  static void name##_onbegin(Benchmark* b) {        \
+    grow_conf.impl = &(implv);                      \
+    grow_onbegin(b);                                \
+  }                                                 \
+  R_BENCHMARK(name, name##_onbegin)(Benchmark* b) { \
+    return grow_sampler(b);                         \
+  }
+
+DEF_GROW_BENCHMARK(grow_libc,   impl_libc)
+DEF_GROW_BENCHMARK(grow_linear, impl_linear)
+DEF_GROW_BENCHMARK(grow_vm,     impl_vm)
+DEF_GROW_BENCHMARK(grow_large,  impl_large)
+
+
+// ——————————————————————————————————————————————————————————————————————————————————————————————
+// doubling the size of a buffer with memrealloc, from 64 kB to 1 GB.
+// Only the first and last byte is written, so the cost is that of realloc (and of copying,
+// for allocators which copy) rather than of page faults.
+
+#define DOUBLE_MINSIZE ((size_t)64 * 1024)
+#define DOUBLE_MAXSIZE ((size_t)1024 * 1024 * 1024)
+
+struct {
+  const MemImpl* impl;
+} double_conf = {0};
+
+static void double_onbegin(Benchmark* b) {
+  fprintf(stderr, "%s: realloc doubling from %zu kB to %zu MB\n",
+    double_conf.impl->name, DOUBLE_MINSIZE / 1024, DOUBLE_MAXSIZE / (1024 * 1024));
+}
+
+static Timer double_sampler(Benchmark* b) {
+  Mem mem = double_conf.impl->open();
+  auto timer = TimerStart();
+  for (size_t i = 0; i < b->N; i++) {
+    u8* buf = assertnotnull(memalloc_uninit(mem, DOUBLE_MINSIZE));
+    buf[0] = 1;
+    for (size_t size = DOUBLE_MINSIZE * 2; size <= DOUBLE_MAXSIZE; size *= 2) {
+      buf = assertnotnull(memrealloc(mem, buf, size));
+      buf[size - 1] = 1;
+    }
+    assert(buf[0] == 1);
+    memfree(mem, buf);
+  }
+  TimerStop(&timer);
+  double_conf.impl->close(mem);
+  return timer;
+}
+
+#define DEF_DOUBLE_BENCHMARK(name, implv)           \
+  static void name##_onbegin(Benchmark* b) {        \
+    double_conf.impl = &(implv);                    \
+    double_onbegin(b);                              \
+  }                                                 \
+  R_BENCHMARK(name, name##_onbegin)(Benchmark* b) { \
+    return double_sampler(b);                       \
+  }
+
+DEF_DOUBLE_BENCHMARK(double_libc,   impl_libc)
+DEF_DOUBLE_BENCHMARK(double_linear, impl_linear)
+DEF_DOUBLE_BENCHMARK(double_large,  impl_large)
+
+
+// ——————————————————————————————————————————————————————————————————————————————————————————————
+// allocating a buffer which is overwritten right away, with memalloc vs memalloc_uninit
+
+// FILL_SIZE is the size of buffers; below glibc's mmap threshold, so calloc must clear memory
+#define FILL_SIZE ((size_t)64 * 1024)
+
+struct {
+  const MemImpl* impl;
+  bool           uninit;
+} fill_conf = {0};
+
+static void fill_onbegin(Benchmark* b) {
+  fprintf(stderr, "%s: %s, overwrite and free %zu kB buffers\n",
+    fill_conf.impl->name, fill_conf.uninit ? "memalloc_uninit" : "memalloc", FILL_SIZE / 1024);
+}
+
+static Timer fill_sampler(Benchmark* b) {
+  u8* src = memalloc(MemLibC(), FILL_SIZE);
+  memset(src, 1, FILL_SIZE);
+  Mem mem = fill_conf.impl->open();
+  auto timer = TimerStart();
+  for (size_t i = 0; i < b->N; i++) {
+    u8* buf = fill_conf.uninit ? memalloc_uninit(mem, FILL_SIZE) : memalloc(mem, FILL_SIZE);
+    memcpy(buf, src, FILL_SIZE);
+    memfree(mem, buf);
+  }
+  TimerStop(&timer);
+  fill_conf.impl->close(mem);
+  memfree(MemLibC(), src);
+  return timer;
+}
+
+#define DEF_FILL_BENCHMARK(name, implv, uninitv)    \
+  static void name##_onbegin(Benchmark* b) {        \
+    fill_conf.impl = &(implv);                      \
+    fill_conf.uninit = (uninitv);                   \
+    fill_onbegin(b);                                \
+  }                                                 \
+  R_BENCHMARK(name, name##_onbegin)(Benchmark* b) { \
+    return fill_sampler(b);                         \
+  }
+
+DEF_FILL_BENCHMARK(fill_libc,          impl_libc,   false)
+DEF_FILL_BENCHMARK(fill_libc_uninit,   impl_libc,   true)
+DEF_FILL_BENCHMARK(fill_linear,        impl_linear, false)
+DEF_FILL_BENCHMARK(fill_linear_uninit, impl_linear, true)
+
+
+
+// ——————————————————————————————————————————————————————————————————————————————————————————————
+// allocating and freeing many same-sized nodes, one at a time vs memalloc_batch
+
+// BULK_NNODES is the number of nodes allocated (and then freed) per operation
+#define BULK_NNODES 1024
+#define BULK_NODESIZE 48
+
+struct {
+  const MemImpl* impl;
+  bool           batch;
+} bulk_conf = {0};
+
+static void bulk_onbegin(Benchmark* b) {
+  fprintf(stderr, "%s: %u nodes of %u bytes, %s\n",
+    bulk_conf.impl->name, BULK_NNODES, BULK_NODESIZE,
+    bulk_conf.batch ? "memalloc_batch + memfree_batch" : "memalloc + memfree_sized");
+}
+
+static Timer bulk_sampler(Benchmark* b) {
+  void* nodes[BULK_NNODES];
+  Mem mem = bulk_conf.impl->open();
+  auto timer = TimerStart();
+  for (size_t i = 0; i < b->N; i++) {
+    if (bulk_conf.batch) {
+      UNUSED size_t n = memalloc_batch(mem, BULK_NODESIZE, BULK_NNODES, nodes);
+      asserteq(n, BULK_NNODES);
+      memfree_batch(mem, BULK_NODESIZE, BULK_NNODES, nodes);
+    } else {
+      for (u32 j = 0; j < BULK_NNODES; j++)
+        nodes[j] = assertnotnull(memalloc(mem, BULK_NODESIZE));
+      for (u32 j = BULK_NNODES; j > 0; j--)
+        memfree_sized(mem, nodes[j - 1], BULK_NODESIZE);
+    }
+  }
+  TimerStop(&timer);
+  bulk_conf.impl->close(mem);
+  return timer;
+}
+
+#define DEF_BULK_BENCHMARK(name, implv, batchv)     \
+  static void name##_onbegin(Benchmark* b) {        \
+    bulk_conf.impl = &(implv);                      \
+    bulk_conf.batch = (batchv);                     \
+    bulk_onbegin(b);                                \
+  }                                                 \
+  R_BENCHMARK(name, name##_onbegin)(Benchmark* b) { \
+    return bulk_sampler(b);                         \
+  }
+
+DEF_BULK_BENCHMARK(bulk_libc,              impl_libc,        false)
+DEF_BULK_BENCHMARK(bulk_libc_batch,        impl_libc,        true)
+DEF_BULK_BENCHMARK(bulk_linear_sync,       impl_linear_sync, false)
+DEF_BULK_BENCHMARK(bulk_linear_sync_batch, impl_linear_sync, true)
+
+
+
+// ——————————————————————————————————————————————————————————————————————————————————————————————
+// temporary memory for a function call, e.g. building a path, malloc+free vs MemScratch
+
+// TEMP_NBUFS is the number of temporary buffers per call, of 64-1088 bytes each
+#define TEMP_NBUFS 4
+
+static Timer temp_sampler(Benchmark* b, bool scratch) {
+  void* bufs[TEMP_NBUFS];
+  u32 rnd = 1;
+  auto timer = TimerStart();
+  for (size_t i = 0; i < b->N; i++) {
+    MemScratch s;
+    Mem mem = MemLibC();
+    if (scratch) {
+      s = MemScratchBegin(NULL);
+      mem = s.mem;
+    }
+    for (u32 j = 0; j < TEMP_NBUFS; j++) {
+      rnd = rnd * 1103515245 + 12345; // LCG
+      size_t size = 64 + ((rnd >> 8) % 1024);
+      bufs[j] = assertnotnull(memalloc_uninit(mem, size));
+      ((u8*)bufs[j])[size - 1] = 1;
+    }
+    if (scratch) {
+      MemScratchEnd(s);
+    } else {
+      for (u32 j = 0; j < TEMP_NBUFS; j++)
+        memfree(mem, bufs[j]);
+    }
+  }
+  TimerStop(&timer);
+  return timer;
+}
+
+R_BENCHMARK(temp_libc)(Benchmark* b) {
+  return temp_sampler(b, false);
+}
+R_BENCHMARK(temp_scratch)(Benchmark* b) {
+  return temp_sampler(b, true);
+}
+
+
+ASSUME_NONNULL_END
@@ -0,0 +1,112 @@
+#include "rbase.h"
+//
+// MemLarge maps every allocation separately, with a header in front of it which records
+// the size of the mapping. Mappings are resized with mem_pageremap.
+//
+
+#define LARGE_HEADERSIZE 16 // sizeof(LargeHeader), rounded up to keep data 16-byte aligned
+
+ASSUME_NONNULL_BEGIN
+
+typedef struct LargeHeader {
+  size_t npages; // size of the mapping (includes the header)
+} LargeHeader;
+
+static_assert(sizeof(LargeHeader) <= LARGE_HEADERSIZE, "");
+
+#define PTR_TO_LHDR(ptr) ( (LargeHeader*)(((u8*)(ptr)) - LARGE_HEADERSIZE) )
+
+// large_npages returns the number of pages needed for an allocation of size bytes,
+// or 0 if size is too large
+inline static size_t large_npages(size_t size) {
+  const size_t pagesize = mem_pagesize();
+  if (R_UNLIKELY(size > SIZE_MAX - LARGE_HEADERSIZE - pagesize))
+    return 0;
+  return align2(LARGE_HEADERSIZE + size, pagesize) / pagesize;
+}
+
+static void* nullable large_alloc(Mem m, size_t size) {
+  size_t npages = large_npages(size);
+  LargeHeader* h = npages ? mem_pagealloc(npages, MemPageDefault) : NULL;
+  if (!h)
+    return NULL;
+  h->npages = npages;
+  return (u8*)h + LARGE_HEADERSIZE;
+}
+
+static void* nullable large_alloc_uninit(Mem m, size_t size) {
+  size_t npages = large_npages(size);
+  bool zeroed;
+  LargeHeader* h = npages ? mem_pagealloc_uninit(npages, MemPageDefault, &zeroed) : NULL;
+  if (!h)
+    return NULL;
+  h->npages = npages;
+  return (u8*)h + LARGE_HEADERSIZE;
+}
+
+static void* nullable large_realloc(Mem m, void* ptr, size_t newsize) {
+  LargeHeader* h = PTR_TO_LHDR(ptr);
+  size_t npages = large_npages(newsize);
+  if (npages == 0)
+    return NULL;
+  if (npages == h->npages)
+    return ptr;
+  h = mem_pageremap(h, h->npages, npages);
+  if (!h)
+    return NULL;
+  h->npages = npages;
+  return (u8*)h + LARGE_HEADERSIZE;
+}
+
+static void large_free(Mem m, void* ptr) {
+  LargeHeader* h = PTR_TO_LHDR(ptr);
+  mem_pagefree(h, h->npages);
+}
+
+static const MemAllocator _mem_large = {
+  .alloc        = large_alloc,
+  .realloc      = large_realloc,
+  .free         = large_free,
+  .alloc_uninit = large_alloc_uninit,
+};
+
+Mem MemLarge() {
+  return &_mem_large;
+}
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+R_TEST(mem_large) {
+  Mem m = MemLarge();
+  const size_t pagesize = mem_pagesize();
+
+  u8* p = assertnotnull(memalloc(m, 100));
+  asserteq((uintptr_t)p % 16, 0);
+  asserteq(PTR_TO_LHDR(p)->npages, 1);
+  memset(p, 0xab, 100);
+
+  // growing keeps the contents and adds zeroed memory
+  size_t size = 4 * 1024 * 1024;
+  p = assertnotnull(memrealloc(m, p, size));
+  asserteq(PTR_TO_LHDR(p)->npages, align2(size + LARGE_HEADERSIZE, pagesize) / pagesize);
+  asserteq(p[0], 0xab);
+  asserteq(p[99], 0xab);
+  asserteq(p[100], 0);
+  asserteq(p[size - 1], 0);
+  p[size - 1] = 1;
+
+  // resizing within the same number of pages doesn't move the allocation
+  UNUSED u8* p2 = assertnotnull(memrealloc(m, p, size - 1));
+  asserteq(p2, p);
+
+  // shrinking
+  p = assertnotnull(memrealloc(m, p, 1000));
+  asserteq(p[99], 0xab);
+  asserteq(PTR_TO_LHDR(p)->npages, 1);
+
+  memfree(m, p);
+}
+
+#endif /* R_TESTING_ENABLED */
+ASSUME_NONNULL_END
@@ -18,75 +18,254 @@
   #define REPORT_ERROR(fmt, ...) do{}while(0)
 #endif
 
-// AllocHeader is the header of an allocation (for realloc support)
+// AllocHeader precedes every allocation (for realloc and free support)
 typedef struct AllocHeader {
-  size_t size; // number of bytes in data (does not include sizeof(AllocHeader))
+  size_t size; // number of bytes in data, or MLA_LARGE for large allocations
   u8     data[];
 } AllocHeader;
 
+#define PTR_TO_AHDR(ptr) ( (AllocHeader*)(((u8*)(ptr)) - sizeof(AllocHeader)) )
+
 // Block is the layout of a memory block header
 typedef struct Block Block;
 typedef struct Block {
   Block* next; // next block in linked list
   size_t size; // number of bytes in total (does NOT include sizeof(Block))
   size_t len;  // number of bytes in use (does NOT include sizeof(Block))
+  size_t dirty; // data[len:dirty] may hold data of freed allocations and must be cleared
   u8     data[];
 } Block;
 
+// MLA_LARGE_MINSIZE is the size from which allocations get a page mapping of their own,
+// which realloc resizes with mem_pageremap, without copying their contents.
+#define MLA_LARGE_MINSIZE (1024 * 1024)
+
+// MLA_LARGE is the AllocHeader size of large allocations.
+// Sizes of other allocations are multiples of sizeof(void*), so it can't be mistaken for one.
+#define MLA_LARGE ((size_t)1)
+
+// Large is the header of a large allocation, placed at the start of its page mapping
+typedef struct Large Large;
+typedef struct Large {
+  Large* nullable next;   // next large allocation, less recent than this one
+  Large* nullable prev;   // previous large allocation, more recent than this one
+  size_t          npages; // size of the mapping (includes the header)
+  size_t          seq;    // value of LinearAllocator.nlarge when allocated
+  size_t          hsize;  // AllocHeader.size; always MLA_LARGE
+  u8              data[];
+} Large;
+
+static_assert(offsetof(Large, data) - offsetof(Large, hsize) == sizeof(AllocHeader),
+  "Large.hsize must be laid out as the AllocHeader of Large.data");
+
+#define PTR_TO_LARGE(ptr) ( (Large*)(((u8*)(ptr)) - sizeof(Large)) )
+
 typedef struct LinearAllocator {
   MemAllocator    a;
   Block*          b;        // allocations block list
+  Block* nullable spare;    // unused blocks kept for reuse by mla_grow
   size_t          pagesize; // cached value of mem_pagesize()
+  MemPageFlags    pageflags; // flags for mem_pagealloc
+  size_t          highwater; // bytes of blocks to retain across MemLinearReset
+  Large* nullable large;    // large allocations, most recent first
+  size_t          nlarge;   // number of large allocations made, ever
+  u32             trimepoch; // value of mem_trim_epoch at the last reset
+  MemLinearStats  stats;
 } LinearAllocator;
 
+// mla_take_spare removes and returns the smallest spare block with at least size bytes
+// of space, or NULL if there's no such block.
+static Block* nullable mla_take_spare(LinearAllocator* a, size_t size) {
+  Block** bestp = NULL;
+  for (Block** bp = &a->spare; *bp; bp = &(*bp)->next) {
+    if ((*bp)->size >= size && (bestp == NULL || (*bp)->size < (*bestp)->size))
+      bestp = bp;
+  }
+  if (bestp == NULL)
+    return NULL;
+  Block* b = *bestp;
+  *bestp = b->next;
+  return b;
+}
+
+// mla_npages returns the number of pages to map for a block of at least npages
+static size_t mla_npages(MemPageFlags pageflags, size_t npages) {
+  if (pageflags & (MemPageHugeTLB | MemPageHugeHint)) {
+    // use whole huge pages
+    size_t hugenpages = mem_hugepagesize() / mem_pagesize();
+    npages = align2(npages, hugenpages);
+  }
+  return npages;
+}
+
 static Block* nullable mla_grow(LinearAllocator* a, size_t size) {
+  if (a->spare) {
+    Block* b = mla_take_spare(a, size);
+    if (b) {
+      a->stats.nreuse++;
+      b->next = a->b;
+      a->b = b;
+      return b;
+    }
+  }
   // account for the space needed by the block header
   size += sizeof(Block);
   // map an extra page, in anticipation of another allocation request
   size += a->pagesize;
-  // round up to nearest page
-  size_t rem = size % a->pagesize;
-  if (rem != 0)
-    size += a->pagesize - rem;
-  Block* b = (Block*)mem_pagealloc(size / a->pagesize, MemPageDefault);
+  // round up to a power-of-two number of pages, so that blocks retained by MemLinearReset
+  // are likely to fit the allocations of later requests
+  size_t npages = mla_npages(a->pageflags, POW2_CEIL((size + a->pagesize - 1) / a->pagesize));
+  size = npages * a->pagesize;
+  // pages reused from the page cache are cleared lazily, as they are handed out
+  bool zeroed;
+  Block* b = (Block*)mem_pagealloc_uninit(npages, a->pageflags, &zeroed);
   if (!b)
     return NULL;
+  a->stats.nmap++;
   b->next = a->b;
   b->size = size - sizeof(Block);
   b->len = 0;
+  b->dirty = zeroed ? 0 : b->size;
   a->b = b;
   return a->b;
 }
 
-static void* mla_alloc(Mem m, size_t size) {
-  LinearAllocator* a = (LinearAllocator*)m;
-  size_t allocsize = ALIGN_ALLOC(size + sizeof(AllocHeader));
-  size_t avail = a->b->size - a->b->len;
-  //dlog("mla_alloc: reqsize %zu, allocsize %zu, avail %zu", size, allocsize, avail);
+// mla_rewind_block sets the length of b to len, remembering that the memory beyond len
+// needs to be cleared before it's handed out again.
+inline static void mla_rewind_block(Block* b, size_t len) {
+  b->dirty = MAX(b->dirty, b->len);
+  b->len = len;
+}
+
+// mla_bump allocates size bytes at the top of the current block, aligned to align.
+// If zero is true, memory of previous allocations which is reused is zeroed. Memory beyond
+// the block's dirty mark has never been used and is already zero.
+inline static void* nullable mla_bump(
+  LinearAllocator* a, size_t size, size_t align, bool zero)
+{
+  if (R_UNLIKELY(size > SIZE_MAX / 2))
+    return NULL;
+  size_t allocsize = ALIGN_ALLOC(size);
   Block* b = a->b;
-  if (R_UNLIKELY(avail < allocsize)) {
-    b = mla_grow(a, allocsize);
+  // offset of the allocation's data, which is preceded by its header
+  size_t offs = align2((uintptr_t)&b->data[b->len + sizeof(AllocHeader)], align) -
+                (uintptr_t)&b->data[0];
+  //dlog("mla_bump: reqsize %zu, allocsize %zu, avail %zu", size, allocsize, b->size - b->len);
+  if (R_UNLIKELY(offs + allocsize > b->size)) {
+    b = mla_grow(a, sizeof(AllocHeader) + allocsize + (align > sizeof(void*) ? align : 0));
     if (b == NULL)
       return NULL;
+    offs = align2((uintptr_t)&b->data[b->len + sizeof(AllocHeader)], align) -
+           (uintptr_t)&b->data[0];
   }
-  AllocHeader* ah = (AllocHeader*)&b->data[b->len];
-  // dlog("alloc: block start - end %p - %p", b, b + b->len);
-  // dlog("alloc: block.data[b->len]     %p", &b->data[0]);
+  u8* ptr = &b->data[offs];
+  if (zero && R_UNLIKELY(offs < b->dirty)) {
+    // memory is being reused (after free, rewind or reset); memalloc returns zeroed memory
+    memset(ptr, 0, MIN(allocsize, b->dirty - offs));
+  }
+  PTR_TO_AHDR(ptr)->size = allocsize;
+  b->len = offs + allocsize;
+  return ptr;
+}
 
-  // assertop(allocsize - sizeof(AllocHeader), <=, 0xFFFFFFFF); // must not overflow u32
-  // ah->size = (u32)(allocsize - sizeof(AllocHeader));
-  ah->size = allocsize - sizeof(AllocHeader);
+static void* nullable mla_alloc_large(LinearAllocator* a, size_t size, bool zero) {
+  if (R_UNLIKELY(size > SIZE_MAX - sizeof(Large) - a->pagesize))
+    return NULL;
+  size_t npages = align2(sizeof(Large) + size, a->pagesize) / a->pagesize;
+  bool zeroed;
+  Large* l = zero ? mem_pagealloc(npages, MemPageDefault)
+                  : mem_pagealloc_uninit(npages, MemPageDefault, &zeroed);
+  if (!l)
+    return NULL;
+  l->next = a->large;
+  l->prev = NULL;
+  if (a->large)
+    a->large->prev = l;
+  l->npages = npages;
+  l->seq = a->nlarge++;
+  l->hsize = MLA_LARGE;
+  a->large = l;
+  return l->data;
+}
 
-  b->len += allocsize;
-  return &ah->data[0];
+// mla_free_large unmaps the large allocation l and removes it from the list
+static void mla_free_large(LinearAllocator* a, Large* l) {
+  if (l->prev) {
+    l->prev->next = l->next;
+  } else {
+    a->large = l->next;
+  }
+  if (l->next)
+    l->next->prev = l->prev;
+  if (!mem_pagefree(l, l->npages))
+    REPORT_ERROR("mem_pagefree failed (errno %d)", errno);
+}
+
+static void* nullable mla_realloc_large(LinearAllocator* a, Large* l, size_t newsize) {
+  if (R_UNLIKELY(newsize > SIZE_MAX - sizeof(Large) - a->pagesize))
+    return NULL;
+  size_t npages = align2(sizeof(Large) + newsize, a->pagesize) / a->pagesize;
+  if (npages == l->npages)
+    return l->data;
+  // The list order is kept, so that MemLinearRewind can stop at the first older allocation
+  l = mem_pageremap(l, l->npages, npages);
+  if (!l)
+    return NULL;
+  l->npages = npages;
+  if (l->prev) {
+    l->prev->next = l;
+  } else {
+    a->large = l;
+  }
+  if (l->next)
+    l->next->prev = l;
+  return l->data;
+}
+
+static void* nullable mla_alloc(Mem m, size_t size) {
+  if (R_UNLIKELY(size >= MLA_LARGE_MINSIZE))
+    return mla_alloc_large((LinearAllocator*)m, size, true);
+  return mla_bump((LinearAllocator*)m, size, sizeof(void*), true);
+}
+
+static void* nullable mla_alloc_uninit(Mem m, size_t size) {
+  if (R_UNLIKELY(size >= MLA_LARGE_MINSIZE))
+    return mla_alloc_large((LinearAllocator*)m, size, false);
+  return mla_bump((LinearAllocator*)m, size, sizeof(void*), false);
+}
+
+static void* nullable mla_alloc_aligned(Mem m, size_t size, size_t align) {
+  return mla_bump((LinearAllocator*)m, size, MAX(align, sizeof(void*)), true);
+}
+
+static size_t mla_alloc_batch(Mem m, size_t size, size_t count, void** ptrs) {
+  // allocate all objects as one, which is placed in a single block, and then give each
+  // object a header of its own
+  LinearAllocator* a = (LinearAllocator*)m;
+  if (count == 0 || size > SIZE_MAX / 2)
+    return 0;
+  size_t objsize = ALIGN_ALLOC(size);
+  size_t stride = sizeof(AllocHeader) + objsize;
+  if (stride * count / count != stride)
+    return 0;
+  u8* p = mla_bump(a, stride * count - sizeof(AllocHeader), sizeof(void*), true);
+  if (!p)
+    return 0;
+  for (size_t i = 0; i < count; i++) {
+    ptrs[i] = p + i * stride;
+    PTR_TO_AHDR(ptrs[i])->size = objsize;
+  }
+  return count;
 }
 
 // find_block looks up the block that ptr belongs to.
 // Returns NULL if ptr does not belong in any block.
-// O(n) complexity where n is the number of blocks in the allocator.
+// O(n) complexity where n is the number of blocks in the allocator, which is why it's only
+// used to verify ownership in debug builds.
+// Not conditional on DEBUG since the tests use it, which are compiled in all builds.
 static Block* nullable find_block(LinearAllocator* a, void* ptr) {
   Block* b = a->b;
-  const uintptr_t addr = ((uintptr_t)ptr) - sizeof(AllocHeader);
+  const uintptr_t addr = (uintptr_t)ptr;
   while (1) {
     const uintptr_t blockStartAddr = (uintptr_t)&b->data[0];
     const uintptr_t blockEndAddr = (uintptr_t)&b->data[b->size];
@@ -100,119 +279,260 @@ static Block* nullable find_block(LinearAllocator* a, void* ptr) {
   }
 }
 
-// is_most_recent_alloc returns true if ah it the most recent allocation made.
-// I.e. if it's at the top of the allocator. b must be the block that ah belongs to.
-inline static bool is_most_recent_alloc(LinearAllocator* a, Block* b, AllocHeader* ah) {
-  if (b == a->b) {
-    uintptr_t endAddr = (uintptr_t)&ah->data[0] + ah->size;
-    uintptr_t blockLastAddr = (uintptr_t)&b->data[b->len];
-    if (endAddr == blockLastAddr) {
-      return true;
-    }
-  }
-  return false;
+#ifdef DEBUG
+  #define DEBUG_CHECK_OWNER(a, ptr) find_block((a), (ptr))
+#else
+  #define DEBUG_CHECK_OWNER(a, ptr) do{}while(0)
+#endif
+
+// mla_istop returns true if ah is the most recent allocation which is still live.
+// I.e. if it's at the top of the allocator's current block.
+// Only the current block can be grown or rewound, so there's no need to look up the block
+// which ah belongs to. This makes free and realloc O(1) regardless of the number of blocks.
+inline static bool mla_istop(LinearAllocator* a, AllocHeader* ah) {
+  Block* b = a->b;
+  return &ah->data[ah->size] == &b->data[b->len] && (u8*)ah >= &b->data[0];
 }
 
 static void mla_free(Mem m, void* ptr) {
   LinearAllocator* a = (LinearAllocator*)m;
-  Block* b = find_block(a, ptr);
-  if (b) {
-    AllocHeader* ah = (AllocHeader*)(ptr - sizeof(AllocHeader));
-    if (is_most_recent_alloc(a, b, ah)) {
-      b->len -= sizeof(AllocHeader) + ah->size;
-      DEBUG_MZERO(ah, sizeof(AllocHeader) + ah->size);
-    }
+  AllocHeader* ah = PTR_TO_AHDR(ptr);
+  if (R_UNLIKELY(ah->size == MLA_LARGE)) {
+    mla_free_large(a, PTR_TO_LARGE(ptr));
+    return;
+  }
+  DEBUG_CHECK_OWNER(a, ptr);
+  if (mla_istop(a, ah)) {
+    // rewind, which frees allocations in LIFO order
+    Block* b = a->b;
+    size_t offs = (size_t)((u8*)ah - &b->data[0]);
+    DEBUG_MZERO(ah, b->len - offs);
+    mla_rewind_block(b, offs);
   }
 }
 
-static void* mla_realloc(Mem m, void* ptr, size_t newsize) {
-  LinearAllocator* a = (LinearAllocator*)m;
+static void mla_free_batch(Mem m, size_t size, size_t count, void** ptrs) {
+  // free in reverse order so that a batch from mla_alloc_batch is rewound entirely
+  for (size_t i = count; i > 0; i--)
+    mla_free(m, ptrs[i - 1]);
+}
 
-  // locate its block
-  Block* b = find_block(a, ptr);
-  if (!b) {
+static void* nullable mla_realloc(Mem m, void* ptr, size_t newsize) {
+  LinearAllocator* a = (LinearAllocator*)m;
+  AllocHeader* ah = PTR_TO_AHDR(ptr);
+  if (R_UNLIKELY(ah->size == MLA_LARGE))
+    return mla_realloc_large(a, PTR_TO_LARGE(ptr), newsize);
+  DEBUG_CHECK_OWNER(a, ptr);
+  if (R_UNLIKELY(newsize > SIZE_MAX / 2))
     return NULL;
-  }
-
-  // access allocation header to get size
-  AllocHeader* ah = (AllocHeader*)(ptr - sizeof(AllocHeader));
-  if (R_UNLIKELY(newsize == ah->size))
-    return ptr;
-
-  // if the allocation is at the top (was the most recent allocation), then we may be able
-  // to simply grow it.
-  if (is_most_recent_alloc(a, b, ah)) {
-    if (newsize < ah->size) {
+  newsize = ALIGN_ALLOC(newsize); // keep the top of the block aligned
+
+  if (mla_istop(a, ah)) {
+    // the most recent allocation is at the top of the current block, where it may be
+    // resized in place
+    Block* b = a->b;
+    size_t offs = (size_t)((u8*)ptr - &b->data[0]);
+    if (newsize <= ah->size) {
       // fast path: shrink the top
-      b->len -= ah->size - newsize;
+      mla_rewind_block(b, offs + newsize);
       ah->size = newsize;
       return ptr;
     }
-    size_t avail = b->size - b->len; // available space in block b
-    if (avail - ah->size >= newsize) {
+    if (newsize <= b->size - offs) {
       // fast path: grow in available space
-      b->len += newsize - ah->size;
+      b->len = offs + newsize;
       ah->size = newsize;
       return ptr;
     }
-  }
-
-  if (R_UNLIKELY(newsize < ah->size)) {
+  } else if (newsize <= ah->size) {
     // shrink an allocation which is not at the top (noop)
     return ptr;
   }
 
-  // create a new allocation and copy the data
-  void* ptr2 = mla_alloc(m, newsize);
-  memcpy(ptr2, ptr, ah->size);
-  DEBUG_MZERO(ah, sizeof(AllocHeader) + ah->size);
+  // create a new allocation and copy the data.
+  // Allocations which grow to MLA_LARGE_MINSIZE become large allocations, which are never
+  // copied again.
+  void* ptr2 = mla_alloc_uninit(m, newsize);
+  if (ptr2)
+    memcpy(ptr2, ptr, MIN(ah->size, newsize));
   return ptr2;
 }
 
 Mem nullable MemLinearAlloc(size_t npages_init) {
+  return MemLinearAlloc2(npages_init, MemPageDefault);
+}
+
+Mem nullable MemLinearAlloc2(size_t npages_init, MemPageFlags pageflags) {
   // allocate a first page to store the allocator in as well as initial memory
   assert(npages_init > 0);
-  Block* b = (Block*)mem_pagealloc(npages_init, MemPageDefault);
+  npages_init = mla_npages(pageflags, npages_init);
+  bool zeroed;
+  Block* b = (Block*)mem_pagealloc_uninit(npages_init, pageflags, &zeroed);
   if (!b)
     return NULL;
   size_t pagesize = mem_pagesize();
   b->next = NULL;
   b->size = (npages_init * pagesize) - sizeof(Block);
   b->len = sizeof(LinearAllocator);
+  b->dirty = zeroed ? 0 : b->size;
   // place the allocator in the first block
   LinearAllocator* a = (LinearAllocator*)&b->data[0];
   a->a.alloc = mla_alloc;
   a->a.realloc = mla_realloc;
   a->a.free = mla_free;
+  a->a.alloc_aligned = mla_alloc_aligned;
+  a->a.free_sized = NULL; // free knows the size from the header
+  a->a.alloc_uninit = mla_alloc_uninit;
+  a->a.alloc_batch = mla_alloc_batch;
+  a->a.free_batch = mla_free_batch;
   a->b = b;
+  a->spare = NULL;
   a->pagesize = pagesize;
+  a->pageflags = pageflags;
+  a->highwater = 0;
+  a->large = NULL;
+  a->nlarge = 0;
+  a->trimepoch = mem_trim_epoch();
+  memset(&a->stats, 0, sizeof(a->stats));
   return (Mem)a;
 }
 
 // returns b->next
 static Block* nullable mla_free_block(LinearAllocator* a, Block* b) {
   Block* next = b->next;
+  a->stats.nunmap++;
   if (!mem_pagefree(b, (b->size + sizeof(Block)) / a->pagesize))
     REPORT_ERROR("mem_pagefree failed (errno %d)", errno);
   return next;
 }
 
+// mla_retain moves blocks of list b to the spare list, as long as the total size of spare
+// blocks stays within the high-water mark plus some slack, and frees the rest.
+// The slack is needed since a request doesn't fit in a spare block which is too small, even
+// though the total size of spare blocks is enough.
+// cold blocks were not used since the last reset and have their pages released to the OS,
+// keeping the address range for later reuse.
+inline static size_t mla_retain_limit(LinearAllocator* a) {
+  return a->highwater + a->highwater / 2;
+}
+
+static void mla_retain(LinearAllocator* a, Block* nullable b, size_t* retained, bool cold) {
+  while (b) {
+    Block* next = b->next;
+    if (*retained + b->size > mla_retain_limit(a)) {
+      mla_free_block(a, b);
+    } else {
+      *retained += b->size;
+      size_t npages = (b->size + sizeof(Block)) / a->pagesize;
+      // explicit huge pages can only be released whole
+      if (cold && npages > 1 && b->dirty > a->pagesize - sizeof(Block) &&
+          (a->pageflags & MemPageHugeTLB) == 0)
+      {
+        // keep the first page which holds the block header
+        if (mem_pagerelease((u8*)b + a->pagesize, npages - 1)) {
+          a->stats.nrelease++;
+        } else {
+          REPORT_ERROR("mem_pagerelease failed (errno %d)", errno);
+        }
+      }
+      b->next = a->spare;
+      a->spare = b;
+    }
+    b = next;
+  }
+}
+
 void MemLinearReset(Mem m) {
   LinearAllocator* a = (LinearAllocator*)m;
+  while (a->large)
+    mla_free_large(a, a->large);
+
   // Keep the root block, which houses the LinearAllocator data.
-  // TODO: consider keeping the largest block and if that is different from the root block,
-  // memcpy the LinearAllocator data.
+  // Other blocks used since the last reset are retained for reuse, which avoids the cost of
+  // mapping and page-faulting them in again, up to a high-water mark of recent usage.
+  Block* warm = NULL;
+  size_t inuse = 0;
   Block* b = a->b;
   while (b->next) {
-    b = mla_free_block(a, b);
+    Block* next = b->next;
+    inuse += b->size;
+    mla_rewind_block(b, 0);
+    b->next = warm;
+    warm = b;
+    b = next;
   }
   a->b = b;
-  b->len = sizeof(LinearAllocator);
+  mla_rewind_block(b, sizeof(LinearAllocator));
+
+  // The high-water mark decays so that memory used by a single spike is eventually released
+  a->highwater = MAX(inuse, a->highwater - a->highwater / 16);
+
+  // Retain nothing when mem_trim was called since the last reset
+  u32 trimepoch = mem_trim_epoch();
+  if (R_UNLIKELY(trimepoch != a->trimepoch)) {
+    a->trimepoch = trimepoch;
+    a->highwater = 0;
+  }
+
+  // Retain recently used blocks first, then blocks that went unused since the last reset
+  Block* cold = a->spare;
+  a->spare = NULL;
+  size_t retained = 0;
+  mla_retain(a, warm, &retained, false);
+  mla_retain(a, cold, &retained, true);
 }
 
-void MemLinearFree(Mem m) {
+MemLinearMarker MemLinearMark(Mem m) {
+  LinearAllocator* a = (LinearAllocator*)m;
+  return (MemLinearMarker){ .block = a->b, .len = a->b->len, .nlarge = a->nlarge };
+}
+
+void MemLinearRewind(Mem m, MemLinearMarker mark) {
   LinearAllocator* a = (LinearAllocator*)m;
+  Block* markb = (Block*)mark.block;
+  // Free large allocations made after the mark
+  while (a->large && a->large->seq >= mark.nlarge)
+    mla_free_large(a, a->large);
+  // Move blocks added after the mark to the spare list
   Block* b = a->b;
+  while (b != markb) {
+    if (R_UNLIKELY(b->next == NULL)) {
+      REPORT_ERROR("MemLinearRewind: invalid marker %p", mark.block);
+      return;
+    }
+    Block* next = b->next;
+    mla_rewind_block(b, 0);
+    b->next = a->spare;
+    a->spare = b;
+    b = next;
+  }
+  a->b = markb;
+  if (R_UNLIKELY(mark.len > markb->len)) {
+    REPORT_ERROR("MemLinearRewind: marker is newer than the allocator state");
+    return;
+  }
+  mla_rewind_block(markb, mark.len);
+}
+
+void MemLinearGetStats(Mem m, MemLinearStats* st) {
+  LinearAllocator* a = (LinearAllocator*)m;
+  *st = a->stats;
+  st->highwater = a->highwater;
+  st->retained = 0;
+  for (Block* b = a->spare; b; b = b->next)
+    st->retained += b->size;
+}
+
+void MemLinearFree(Mem m) {
+  LinearAllocator* a = (LinearAllocator*)m;
+  while (a->large)
+    mla_free_large(a, a->large);
+  // free spare blocks first since the list head lives in the root block
+  Block* b = a->spare;
+  while (b) {
+    b = mla_free_block(a, b);
+  }
+  b = a->b;
   while (b) {
     b = mla_free_block(a, b);
   }
@@ -233,7 +553,7 @@ R_TEST(mem_linear) {
     assertnotnull(p2);
     // check address distance of the two adjacent allocations
     ptrdiff_t p1_to_p2 = (ptrdiff_t)(p2 - p1);
-    asserteq(p1_to_p2, ALIGN_ALLOC(reqsize + sizeof(AllocHeader)));
+    asserteq(p1_to_p2, ALIGN_ALLOC(reqsize) + sizeof(AllocHeader));
     MemLinearFree(m);
   }
 
@@ -293,6 +613,124 @@ R_TEST(mem_linear) {
     MemLinearFree(m);
   }
 
+  { // realloc of the top allocation must not grow beyond the end of its block
+    auto m = MemLinearAlloc(1);
+    Block* b = ((LinearAllocator*)m)->b;
+    void* p1 = memalloc(m, 3000);
+    size_t avail = b->size - b->len;
+    void* p2 = memrealloc(m, p1, 3000 + avail + 64);
+    assertne(p1, p2); // should have moved
+    assert(b->len <= b->size);
+    MemLinearFree(m);
+  }
+
+  { // free of most recent allocation with many blocks
+    auto m = MemLinearAlloc(1);
+    void* p1 = memalloc(m, 8);
+    for (u32 i = 0; i < 10; i++)
+      assertnotnull(memalloc(m, mem_pagesize() * 2));
+    memfree(m, p1); // not at the top; noop
+    void* p2 = memalloc(m, 8);
+    void* p3 = memalloc(m, 8);
+    memfree(m, p3);
+    void* p4 = memalloc(m, 8);
+    assertne(p1, p2);
+    asserteq(p3, p4);
+    MemLinearFree(m);
+  }
+
+  { // memfree and memfree_sized free allocations in LIFO order
+    auto m = MemLinearAlloc(1);
+    void* p1 = memalloc(m, 8);
+    void* p2 = memalloc(m, 24);
+    void* p3 = memalloc(m, 9);
+    memfree(m, p3);
+    memfree(m, p2);
+    void* p4 = memalloc(m, 8);
+    asserteq(p4, p2);
+    memfree_sized(m, p4, 8);
+    memfree_sized(m, p1, 8);
+    void* p5 = memalloc(m, 8);
+    asserteq(p5, p1);
+    MemLinearFree(m);
+  }
+
+  { // realloc of an allocation in an older block
+    auto m = MemLinearAlloc(1);
+    char* p1 = memalloc(m, 16);
+    memcpy(p1, "hello", 5);
+    for (u32 i = 0; i < 4; i++)
+      assertnotnull(memalloc(m, mem_pagesize() * 2));
+    char* p1b = memrealloc(m, p1, 32);
+    assertne(p1, p1b);
+    asserteq(memcmp(p1b, "hello", 5), 0);
+    MemLinearFree(m);
+  }
+
+  { // realloc of an allocation which is not at the top shrinks in place, with many blocks
+    auto m = MemLinearAlloc(1);
+    char* p1 = memalloc(m, 64);
+    memcpy(p1, "hello", 5);
+    for (u32 i = 0; i < 600; i++)
+      assertnotnull(memalloc(m, mem_pagesize() * 2));
+    asserteq(memrealloc(m, p1, 16), p1);
+    char* p1b = memrealloc(m, p1, 128);
+    assertne(p1b, p1);
+    asserteq(memcmp(p1b, "hello", 5), 0);
+    MemLinearFree(m);
+  }
+
+  { // realloc fails for sizes which would overflow, also at the top
+    auto m = MemLinearAlloc(1);
+    void* p1 = memalloc(m, 8);
+    volatile size_t hugesize = SIZE_MAX;
+    assertnull(memrealloc(m, p1, hugesize));
+    assertnull(memrealloc(m, p1, hugesize - 7));
+    MemLinearFree(m);
+  }
+
+  { // memalloc_aligned
+    auto m = MemLinearAlloc(1);
+    UNUSED void* p0 = memalloc(m, 8);
+    u8* p1 = assertnotnull(memalloc_aligned(m, 100, 64));
+    asserteq((uintptr_t)p1 % 64, 0);
+    u8* p2 = assertnotnull(memalloc_aligned(m, 100, mem_pagesize()));
+    asserteq((uintptr_t)p2 % mem_pagesize(), 0);
+    memset(p2, 0xff, 100);
+    memfree_aligned(m, p2, 100);
+    u8* p3 = assertnotnull(memalloc_aligned(m, 100, mem_pagesize()));
+    asserteq(p3, p2);
+    for (u32 i = 0; i < 100; i++)
+      asserteq(p3[i], 0);
+    memfree_aligned(m, p3, 100);
+    memfree_aligned(m, p1, 100);
+    MemLinearFree(m);
+  }
+
+  { // memalloc_batch & memfree_batch, directly and through MemSyncWrapper
+    auto m = MemLinearAlloc(1);
+    Mem sm = MemSyncWrapper(m);
+    Mem mv[] = { m, sm };
+    for (u32 k = 0; k < countof(mv); k++) {
+      UNUSED void* p0 = memalloc(mv[k], 8);
+      u8* ptrs[100];
+      UNUSED size_t n = memalloc_batch(mv[k], 40, countof(ptrs), (void**)ptrs);
+      asserteq(n, countof(ptrs));
+      for (u32 i = 0; i < countof(ptrs); i++) {
+        asserteq(ptrs[i], ptrs[0] + i * (sizeof(AllocHeader) + ALIGN_ALLOC(40)));
+        asserteq(ptrs[i][39], 0);
+        memset(ptrs[i], 0xff, 40);
+      }
+      // the whole batch is rewound when freed
+      memfree_batch(mv[k], 40, countof(ptrs), (void**)ptrs);
+      u8* p1 = memalloc(mv[k], 40);
+      asserteq(p1, ptrs[0]);
+      asserteq(p1[0], 0);
+    }
+    MemSyncWrapperFree(sm);
+    MemLinearFree(m);
+  }
+
   { // MemLinearReset
     auto m = MemLinearAlloc(1);
     size_t reqsize = 9;
@@ -317,4 +755,192 @@ R_TEST(mem_linear) {
 
     MemLinearFree(m);
   }
+
+  { // MemLinearMark & MemLinearRewind
+    auto m = MemLinearAlloc(1);
+    LinearAllocator* a = (LinearAllocator*)m;
+    void* p1 = memalloc(m, 8);
+    auto mark = MemLinearMark(m);
+    u8* p2 = memalloc(m, 16);
+    memset(p2, 0xff, 16);
+    // cause new blocks to be mapped
+    void* p3 = memalloc(m, mem_pagesize() * 2);
+    void* p4 = memalloc(m, mem_pagesize() * 2);
+    assertnotnull(p3);
+    assertnotnull(p4);
+    Block* b3 = find_block(a, p3);
+    assertne(b3, find_block(a, p1));
+
+    MemLinearRewind(m, mark);
+    asserteq(a->b, find_block(a, p1));
+    assertnotnull(a->spare); // blocks should have been kept
+
+    // allocations after the rewind should reuse memory, which must be zeroed
+    u8* p2b = memalloc(m, 16);
+    asserteq(p2b, p2);
+    for (u32 i = 0; i < 16; i++)
+      asserteq(p2b[i], 0);
+    void* p3b = memalloc(m, mem_pagesize() * 2);
+    Block* b3b = find_block(a, p3b);
+    assert(b3b == b3 || b3b == find_block(a, p4)); // should have reused a spare block
+
+    // rewinding to an older marker after a rewind is fine
+    auto mark0 = MemLinearMark(m);
+    MemLinearRewind(m, mark0);
+    MemLinearRewind(m, mark);
+    void* p2c = memalloc(m, 16);
+    asserteq(p2c, p2);
+
+    MemLinearReset(m);
+    assertnull(a->spare);
+    MemLinearFree(m);
+  }
+
+  { // MemLinearScope
+    auto m = MemLinearAlloc(1);
+    void* p1 = memalloc(m, 8);
+    UNUSED void* p2 = NULL;
+    MemLinearScope(m) {
+      p2 = memalloc(m, 8);
+      MemLinearScope(m) {
+        UNUSED void* p3 = memalloc(m, mem_pagesize() * 3);
+        assertnotnull(p3);
+      }
+      void* p5 = memalloc(m, 8);
+      asserteq(p5, p2 + sizeof(AllocHeader) + ALIGN_ALLOC(8));
+    }
+    void* p4 = memalloc(m, 8);
+    asserteq(p4, p2);
+    assertne(p4, p1);
+    MemLinearFree(m);
+  }
+
+  { // MemLinearReset retains blocks
+    auto m = MemLinearAlloc(1);
+    size_t z = mem_pagesize() * 2;
+    u8* ptrs[4];
+    for (u32 i = 0; i < countof(ptrs); i++) {
+      ptrs[i] = memalloc(m, z);
+      memset(ptrs[i], 0xff, z);
+    }
+    MemLinearStats st;
+    MemLinearGetStats(m, &st);
+    asserteq(st.nmap, countof(ptrs));
+
+    MemLinearReset(m);
+    MemLinearGetStats(m, &st);
+    asserteq(st.nunmap, 0);
+    assert(st.retained > 0);
+    asserteq(st.retained, st.highwater);
+
+    // same workload again should reuse the blocks, and see zeroed memory
+    for (u32 i = 0; i < countof(ptrs); i++) {
+      u8* p = memalloc(m, z);
+      for (size_t j = 0; j < z; j++)
+        asserteq(p[j], 0);
+    }
+    MemLinearGetStats(m, &st);
+    asserteq(st.nmap, countof(ptrs));
+    asserteq(st.nreuse, countof(ptrs));
+
+    // with nothing allocated, the high-water mark decays and blocks are eventually unmapped
+    for (u32 i = 0; i < 200; i++)
+      MemLinearReset(m);
+    MemLinearGetStats(m, &st);
+    asserteq(st.retained, 0);
+    asserteq(st.nunmap, countof(ptrs));
+    assert(st.nrelease > 0); // pages of unused blocks should have been released on the way
+
+    MemLinearFree(m);
+  }
+
+  { // memory freed at the top is zeroed when handed out again
+    auto m = MemLinearAlloc(1);
+    u8* p1 = memalloc(m, 64);
+    memset(p1, 0xff, 64);
+    memfree(m, p1);
+    u8* p2 = memalloc(m, 64);
+    asserteq(p1, p2);
+    for (u32 i = 0; i < 64; i++)
+      asserteq(p2[i], 0);
+    MemLinearFree(m);
+  }
+
+  { // memory handed out by memalloc_uninit is zeroed when later reused by memalloc
+    auto m = MemLinearAlloc(1);
+    u8* p1 = memalloc(m, 64);
+    memfree(m, p1);
+    u8* p2 = memalloc_uninit(m, 64);
+    asserteq(p2, p1);
+    memset(p2, 0xff, 64);
+    memfree(m, p2);
+    u8* p3 = memalloc(m, 64);
+    asserteq(p3, p1);
+    asserteq(p3[0], 0);
+    MemLinearFree(m);
+  }
+
+  { // large allocations get their own mapping and grow without moving their contents
+    auto m = MemLinearAlloc(1);
+    LinearAllocator* a = (LinearAllocator*)m;
+    u8* p1 = memalloc(m, 64);
+    memset(p1, 0xab, 64);
+    auto mark = MemLinearMark(m);
+
+    // a small allocation which grows large becomes a large allocation
+    u8* p2 = assertnotnull(memrealloc(m, p1, MLA_LARGE_MINSIZE));
+    assertnotnull(a->large);
+    asserteq(p2, &a->large->data[0]);
+    asserteq(p2[63], 0xab);
+    p2[MLA_LARGE_MINSIZE - 1] = 1;
+    u8* p3 = assertnotnull(memrealloc(m, p2, MLA_LARGE_MINSIZE * 8));
+    asserteq(p3, &a->large->data[0]);
+    asserteq(p3[63], 0xab);
+    asserteq(p3[MLA_LARGE_MINSIZE - 1], 1);
+    asserteq(p3[MLA_LARGE_MINSIZE * 8 - 1], 0);
+
+    // memfree unmaps large allocations, at any position
+    u8* p4 = assertnotnull(memalloc(m, MLA_LARGE_MINSIZE * 2));
+    asserteq(&a->large->next->data[0], p3);
+    memfree(m, p3);
+    asserteq(&a->large->data[0], p4);
+    assertnull(a->large->next);
+
+    // small allocations are unaffected
+    u8* p5 = assertnotnull(memalloc(m, 64));
+    asserteq(p5, p1 + 64 + sizeof(AllocHeader));
+
+    // a large allocation which shrinks stays large, and is freed by memfree_sized
+    u8* p6 = assertnotnull(memalloc(m, MLA_LARGE_MINSIZE * 4));
+    u8* p7 = assertnotnull(memrealloc(m, p6, 64));
+    asserteq(p7, &a->large->data[0]);
+    memfree_sized(m, p7, 64);
+    asserteq(&a->large->data[0], p4);
+
+    // rewinding frees large allocations made after the mark
+    MemLinearRewind(m, mark);
+    assertnull(a->large);
+    assertnotnull(memalloc(m, MLA_LARGE_MINSIZE));
+    MemLinearReset(m);
+    assertnull(a->large);
+    assertnotnull(memalloc(m, MLA_LARGE_MINSIZE));
+    MemLinearFree(m);
+  }
+
+  { // MemLinearAlloc2 with huge pages
+    MemPageFlags flagsv[] = { MemPageHugeHint, MemPageHugeTLB };
+    for (u32 i = 0; i < countof(flagsv); i++) {
+      auto m = assertnotnull(MemLinearAlloc2(1, flagsv[i]));
+      Block* b = ((LinearAllocator*)m)->b;
+      asserteq((uintptr_t)b % mem_hugepagesize(), 0);
+      asserteq((b->size + sizeof(Block)) % mem_hugepagesize(), 0);
+      // grow past the first block, with allocations small enough to be placed in blocks
+      for (size_t n = 0; n < mem_hugepagesize() * 2; n += MLA_LARGE_MINSIZE - 8) {
+        u8* p = assertnotnull(memalloc(m, MLA_LARGE_MINSIZE - 8));
+        p[MLA_LARGE_MINSIZE - 9] = 1;
+      }
+      MemLinearReset(m);
+      MemLinearFree(m);
+    }
+  }
 }
@@ -0,0 +1,474 @@
+#include "rbase.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+//
+// MemLinearFile is a linear allocator whose memory is a shared mapping of a file.
+//
+// The file starts with a header which records the address the file was first mapped at.
+// Later processes map the file at the same address, so pointers stored in the file stay
+// valid and a data structure built in one process can be used right away by another.
+// Address space for maxsize bytes is reserved up front and the file is grown with ftruncate
+// as allocations need more space.
+//
+// Memory beyond the in-use part of the file is always zero: the file is extended with zeros
+// and free clears the memory it rewinds. This also keeps the file free of stale data.
+//
+// The allocator itself (function pointers and such) lives in process memory since it's not
+// valid across processes.
+//
+// Snapshots replace the shared mapping with a private mapping of the file at the same
+// address, so that the file keeps the state at the time of the snapshot while changes are
+// made to copy-on-write pages. The allocator state is in the file header, so it's part of the
+// snapshot. Discarding the changes maps the file again; keeping them writes the pages which
+// were copied to the file first. MemLinearFileAnon allocators are backed by a memfd instead
+// of a file in the file system.
+//
+
+#define ALIGN_ALLOC(size) align2((size), sizeof(void*))
+
+// LFILE_MAGIC identifies a file as a MemLinearFile ("RLAF")
+#define LFILE_MAGIC   0x46414c52
+#define LFILE_VERSION 1
+
+// LFILE_GROWSIZE is the minimum number of bytes the file is grown by
+#define LFILE_GROWSIZE (64 * 1024)
+
+ASSUME_NONNULL_BEGIN
+
+// LFileHeader is the layout of the start of the file
+typedef struct LFileHeader {
+  u32 magic;
+  u32 version;
+  u64 base; // address of the mapping
+  u64 len;  // bytes in use, including the header
+  u64 root; // offset of the root object, or 0 if none
+} LFileHeader;
+
+typedef struct LFileAlloc {
+  MemAllocator  ma;
+  LFileHeader*  h;        // start of the mapping
+  size_t        mapsize;  // size of the mapping
+  size_t        filesize; // current size of the file
+  u8* nullable  top;      // most recent allocation, or NULL if unknown
+  int           fd;
+  bool          snapshot; // mapped privately, as a snapshot is active
+} LFileAlloc;
+
+static bool lfile_grow(LFileAlloc* a, size_t minsize) {
+  if (minsize > a->mapsize) {
+    errno = ENOMEM;
+    return false;
+  }
+  size_t filesize = align2(MAX(minsize, a->filesize * 2), LFILE_GROWSIZE);
+  filesize = MIN(filesize, a->mapsize);
+  if (ftruncate(a->fd, (off_t)filesize) != 0)
+    return false;
+  a->filesize = filesize;
+  return true;
+}
+
+static void* nullable lfile_bump(LFileAlloc* a, size_t size, size_t align) {
+  size_t allocsize = ALIGN_ALLOC(MAX(size, 1));
+  size_t offs = align2(a->h->len, align);
+  if (R_UNLIKELY(allocsize > a->mapsize || offs + allocsize > a->filesize)) {
+    if (allocsize > a->mapsize || !lfile_grow(a, offs + allocsize))
+      return NULL;
+  }
+  a->h->len = offs + allocsize;
+  a->top = (u8*)a->h + offs;
+  return a->top;
+}
+
+static void* nullable lfile_alloc(Mem m, size_t size) {
+  return lfile_bump((LFileAlloc*)m, size, sizeof(void*));
+}
+
+static void* nullable lfile_alloc_aligned(Mem m, size_t size, size_t align) {
+  return lfile_bump((LFileAlloc*)m, size, MAX(align, sizeof(void*)));
+}
+
+// lfile_rewind frees memory from ptr to the end of the in-use part of the file
+static void lfile_rewind(LFileAlloc* a, u8* ptr) {
+  size_t offs = (size_t)(ptr - (u8*)a->h);
+  memset(ptr, 0, a->h->len - offs);
+  a->h->len = offs;
+  a->top = NULL;
+}
+
+static void lfile_free(Mem m, void* ptr) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  if (ptr == a->top)
+    lfile_rewind(a, ptr);
+}
+
+static void lfile_free_sized(Mem m, void* ptr, size_t size) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  if ((u8*)ptr + ALIGN_ALLOC(MAX(size, 1)) == (u8*)a->h + a->h->len)
+    lfile_rewind(a, ptr);
+}
+
+static void* nullable lfile_realloc(Mem m, void* ptr, size_t newsize) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  newsize = ALIGN_ALLOC(MAX(newsize, 1));
+  size_t offs = (size_t)((u8*)ptr - (u8*)a->h);
+  // the allocation can't extend past the in-use part of the file
+  size_t size = a->h->len - offs;
+  if (ptr == a->top) {
+    if (newsize <= size) {
+      memset((u8*)ptr + newsize, 0, size - newsize);
+      a->h->len = offs + newsize;
+      return ptr;
+    }
+    if (offs + newsize <= a->filesize || lfile_grow(a, offs + newsize)) {
+      a->h->len = offs + newsize;
+      return ptr;
+    }
+    return NULL;
+  }
+  void* ptr2 = lfile_alloc(m, newsize);
+  if (ptr2)
+    memcpy(ptr2, ptr, MIN(size, newsize));
+  return ptr2;
+}
+
+// lfile_map maps size bytes of fd at base (or anywhere if base is NULL)
+static void* nullable lfile_map(int fd, size_t size, void* nullable base) {
+  int flags = MAP_SHARED;
+  #ifdef MAP_FIXED_NOREPLACE
+    if (base)
+      flags |= MAP_FIXED_NOREPLACE;
+  #endif
+  void* p = mmap(base, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  if (base && p != base) {
+    // MAP_FIXED_NOREPLACE is not supported and the address is in use
+    munmap(p, size);
+    errno = EEXIST;
+    return NULL;
+  }
+  return p;
+}
+
+// lfile_open creates an allocator for the file fd, which is closed on error
+static Mem nullable lfile_open(int fd, size_t maxsize) {
+  LFileAlloc* a = NULL;
+  struct stat st;
+  LFileHeader h = {0};
+  // only one process may write to the file at a time
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0)
+    goto error;
+  if (st.st_size > 0) {
+    if ((size_t)st.st_size < sizeof(h) ||
+        pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        h.magic != LFILE_MAGIC || h.version != LFILE_VERSION ||
+        h.len > (u64)st.st_size || h.base == 0)
+    {
+      errno = EINVAL;
+      goto error;
+    }
+  }
+  a = memalloc(MemLibC(), sizeof(LFileAlloc));
+  if (!a)
+    goto error;
+  a->fd = fd;
+  a->snapshot = false;
+  a->top = NULL;
+  a->filesize = (size_t)st.st_size;
+  a->mapsize = align2(MAX(maxsize, a->filesize), mem_pagesize());
+  a->h = lfile_map(fd, a->mapsize, (void*)(uintptr_t)h.base);
+  if (!a->h)
+    goto error;
+  if (h.magic == 0) {
+    // new file
+    if (!lfile_grow(a, sizeof(LFileHeader))) {
+      munmap(a->h, a->mapsize);
+      goto error;
+    }
+    a->h->magic = LFILE_MAGIC;
+    a->h->version = LFILE_VERSION;
+    a->h->base = (u64)(uintptr_t)a->h;
+    a->h->len = ALIGN_ALLOC(sizeof(LFileHeader));
+    a->h->root = 0;
+  }
+  a->ma.alloc         = lfile_alloc;
+  a->ma.realloc       = lfile_realloc;
+  a->ma.free          = lfile_free;
+  a->ma.alloc_aligned = lfile_alloc_aligned;
+  a->ma.free_sized    = lfile_free_sized;
+  a->ma.alloc_uninit  = lfile_alloc;
+  return &a->ma;
+
+error: {
+    int err = errno;
+    if (a)
+      memfree(MemLibC(), a);
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+}
+
+Mem nullable MemLinearFileOpen(const char* path, size_t maxsize) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return NULL;
+  return lfile_open(fd, maxsize);
+}
+
+Mem nullable MemLinearFileAnon(size_t maxsize) {
+  #if defined(__linux__) && defined(MFD_CLOEXEC)
+    int fd = memfd_create("MemLinearFileAnon", MFD_CLOEXEC);
+    if (fd == -1)
+      return NULL;
+    return lfile_open(fd, maxsize);
+  #else
+    errno = ENOSYS;
+    return NULL;
+  #endif
+}
+
+void* nullable MemLinearFileRoot(Mem m) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  return a->h->root ? (u8*)a->h + a->h->root : NULL;
+}
+
+void MemLinearFileSetRoot(Mem m, void* nullable root) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  a->h->root = root ? (u64)((u8*)root - (u8*)a->h) : 0;
+}
+
+bool MemLinearFileSync(Mem m) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  return msync(a->h, a->h->len, MS_SYNC) == 0;
+}
+
+// lfile_remap replaces the mapping of the file with a shared or private one
+static bool lfile_remap(LFileAlloc* a, bool private) {
+  int flags = (private ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED;
+  void* p = mmap(a->h, a->mapsize, PROT_READ | PROT_WRITE, flags, a->fd, 0);
+  if (p == MAP_FAILED)
+    return false;
+  a->snapshot = private;
+  a->top = NULL;
+  return true;
+}
+
+bool MemLinearSnapshot(Mem m) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  if (a->snapshot) {
+    errno = EBUSY;
+    return false;
+  }
+  return lfile_remap(a, true);
+}
+
+bool MemLinearSnapshotDiscard(Mem m) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  if (!a->snapshot) {
+    errno = EINVAL;
+    return false;
+  }
+  // the private pages are unmapped, and the file still holds the state of the snapshot
+  return lfile_remap(a, false);
+}
+
+// lfile_writeback writes len bytes starting at offs of the mapping to the file
+static bool lfile_writeback(LFileAlloc* a, size_t offs, size_t len) {
+  while (len > 0) {
+    ssize_t n = pwrite(a->fd, (u8*)a->h + offs, len, (off_t)offs);
+    if (n < 0)
+      return false;
+    offs += (size_t)n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+// lfile_writeback_dirty writes pages which were written to since the snapshot to the file.
+// Those are the pages of the private mapping which are not file pages. They are found with
+// /proc/self/pagemap when available; otherwise all pages of the file are written.
+static bool lfile_writeback_dirty(LFileAlloc* a) {
+  const size_t pagesize = mem_pagesize();
+  size_t npages = a->filesize / pagesize;
+  #ifdef __linux__
+    int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+      const u64 pm_present = 1llu << 63, pm_swapped = 1llu << 62, pm_file = 1llu << 61;
+      u64 entries[512];
+      size_t runstart = 0, runlen = 0; // run of dirty pages
+      off_t pmoffs = (off_t)(((uintptr_t)a->h / pagesize) * sizeof(u64));
+      bool ok = true;
+      for (size_t i = 0; i < npages && ok; ) {
+        size_t n = MIN(npages - i, countof(entries));
+        ssize_t nread = pread(fd, entries, n * sizeof(u64), pmoffs + (off_t)(i * sizeof(u64)));
+        if (nread != (ssize_t)(n * sizeof(u64))) {
+          // can't tell which pages are dirty; write them all
+          close(fd);
+          return lfile_writeback(a, 0, npages * pagesize);
+        }
+        for (size_t j = 0; j < n && ok; j++, i++) {
+          u64 e = entries[j];
+          // private copies are anonymous pages, which may have been swapped out
+          if (((e & pm_present) && !(e & pm_file)) || (e & pm_swapped)) {
+            if (runlen == 0)
+              runstart = i;
+            runlen++;
+          } else if (runlen > 0) {
+            ok = lfile_writeback(a, runstart * pagesize, runlen * pagesize);
+            runlen = 0;
+          }
+        }
+      }
+      close(fd);
+      if (ok && runlen > 0)
+        ok = lfile_writeback(a, runstart * pagesize, runlen * pagesize);
+      return ok;
+    }
+  #endif
+  return lfile_writeback(a, 0, npages * pagesize);
+}
+
+bool MemLinearSnapshotKeep(Mem m) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  if (!a->snapshot) {
+    errno = EINVAL;
+    return false;
+  }
+  return lfile_writeback_dirty(a) && lfile_remap(a, false);
+}
+
+void MemLinearFileClose(Mem m) {
+  LFileAlloc* a = (LFileAlloc*)m;
+  munmap(a->h, a->mapsize);
+  close(a->fd); // also releases the lock
+  memfree(MemLibC(), a);
+}
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+typedef struct LFileTestNode LFileTestNode;
+struct LFileTestNode {
+  LFileTestNode* nullable next;
+  u32                     value;
+  char                    name[12];
+};
+
+R_TEST(mem_linearfile) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/rbase-test-%d.mla", (int)getpid());
+  unlink(path);
+
+  // build a list and make it the root object
+  Mem m = assertnotnull(MemLinearFileOpen(path, 64 * 1024 * 1024));
+  asserteq(MemLinearFileRoot(m), NULL);
+  LFileTestNode* list = NULL;
+  for (u32 i = 0; i < 1000; i++) {
+    LFileTestNode* n = assertnotnull(memalloc(m, sizeof(LFileTestNode)));
+    n->value = i;
+    snprintf(n->name, sizeof(n->name), "node%u", i);
+    n->next = list;
+    list = n;
+  }
+  // a large allocation makes the file grow
+  u8* buf = assertnotnull(memalloc(m, 1024 * 1024));
+  buf[1024 * 1024 - 1] = 7;
+  MemLinearFileSetRoot(m, list);
+
+  // the file is locked while open
+  assertnull(MemLinearFileOpen(path, 64 * 1024 * 1024));
+
+  UNUSED bool ok = MemLinearFileSync(m);
+  assert(ok);
+  MemLinearFileClose(m);
+
+  // reload it and walk the list through the pointers stored in the file
+  m = assertnotnull(MemLinearFileOpen(path, 64 * 1024 * 1024));
+  LFileTestNode* n = MemLinearFileRoot(m);
+  asserteq(n, list);
+  for (u32 i = 1000; i > 0; i--) {
+    assertnotnull(n);
+    asserteq(n->value, i - 1);
+    char name[12];
+    snprintf(name, sizeof(name), "node%u", i - 1);
+    assert(strcmp(n->name, name) == 0);
+    n = n->next;
+  }
+  assertnull(n);
+  asserteq(buf[1024 * 1024 - 1], 7);
+
+  // allocations continue after the persisted data
+  u8* p = assertnotnull(memalloc(m, 16));
+  assert(p > buf);
+  memfree(m, p);
+  MemLinearFileClose(m);
+
+  // files which are not MemLinearFile files are rejected
+  FILE* fp = assertnotnull(fopen(path, "w"));
+  fputs("not an arena, just some text", fp);
+  fclose(fp);
+  assertnull(MemLinearFileOpen(path, 64 * 1024 * 1024));
+  asserteq(errno, EINVAL);
+
+  unlink(path);
+}
+
+R_TEST(mem_linear_snapshot) {
+  Mem m = MemLinearFileAnon(64 * 1024 * 1024);
+  if (!m) {
+    asserteq(errno, ENOSYS); // no memfd on this system
+    return;
+  }
+  u32* v = assertnotnull(memalloc(m, 100 * sizeof(u32)));
+  for (u32 i = 0; i < 100; i++)
+    v[i] = i;
+  MemLinearFileSetRoot(m, v);
+
+  // changes made after a snapshot can be discarded, including allocations
+  UNUSED bool ok = MemLinearSnapshot(m);
+  assert(ok);
+  ok = MemLinearSnapshot(m);
+  assert(!ok); // one at a time
+  asserteq(errno, EBUSY);
+  v[0] = 1000;
+  u8* p = assertnotnull(memalloc(m, 1024 * 1024));
+  p[0] = 1;
+  MemLinearFileSetRoot(m, p);
+  ok = MemLinearSnapshotDiscard(m);
+  assert(ok);
+  asserteq(v[0], 0);
+  asserteq(MemLinearFileRoot(m), v);
+  asserteq(p[0], 0); // the memory of the allocation is free and zero again
+  u8* p2 = assertnotnull(memalloc(m, 16));
+  asserteq(p2, p);
+
+  // changes can be kept
+  ok = MemLinearSnapshot(m);
+  assert(ok);
+  v[0] = 2000;
+  v[99] = 2099;
+  ok = MemLinearSnapshotKeep(m);
+  assert(ok);
+  asserteq(v[0], 2000);
+  asserteq(v[99], 2099);
+  asserteq(v[50], 50);
+
+  // kept changes are part of the next snapshot
+  ok = MemLinearSnapshot(m);
+  assert(ok);
+  v[0] = 3000;
+  ok = MemLinearSnapshotDiscard(m);
+  assert(ok);
+  asserteq(v[0], 2000);
+  ok = MemLinearSnapshotDiscard(m);
+  assert(!ok); // no snapshot
+
+  MemLinearFileClose(m);
+}
+
+#endif /* R_TESTING_ENABLED */
+ASSUME_NONNULL_END
@@ -0,0 +1,230 @@
+#include "rbase.h"
+#include "pool/pool.h"
+//
+// MemObjPool hands out objects of a single size, carved out of slabs of pages.
+//
+// Freed objects are recycled through a Pool, a lock-free free list, which makes alloc and
+// free of recycled objects a single DCAS each. Objects which have never been used are
+// carved off the current slab under a spin lock, which is also when a new slab is mapped.
+// Since fresh pages are zeroed, only recycled objects need clearing.
+//
+// Slabs are not returned to the OS until the allocator is freed. The Pool depends on this:
+// PoolTake may read the link of an object which another thread just took and is writing
+// to, which is harmless as long as the memory stays mapped.
+//
+
+// OBJPOOL_SLABSIZE is the minimum size of a slab in bytes
+#define OBJPOOL_SLABSIZE (64 * 1024)
+
+// OBJPOOL_MINSLABOBJS is the minimum number of objects per slab
+#define OBJPOOL_MINSLABOBJS 16
+
+// OBJPOOL_ALIGN is the alignment of objects (same as malloc)
+#define OBJPOOL_ALIGN 16
+
+// LINE_CACHE_SIZE is the size of a cache line of the target CPU
+#define LINE_CACHE_SIZE 64
+#define ATTR_ALIGNED_LINE_CACHE __attribute__((aligned(LINE_CACHE_SIZE)))
+
+ASSUME_NONNULL_BEGIN
+
+typedef struct ObjSlab {
+  struct ObjSlab* nullable next;
+  size_t                   npages;
+} ObjSlab;
+
+typedef struct ObjPool {
+  ObjSlab      slab; // first slab, which the allocator is placed in
+  MemAllocator ma;
+  size_t       objsize;
+  size_t       slabnpages;
+  SpinMutex    mu;   // protects the fields below
+  u8*          bump; // next never-used object in the current slab
+  u8*          end;  // end of objects in the current slab
+  Pool         free ATTR_ALIGNED_LINE_CACHE; // recycled objects
+} ObjPool;
+
+#define MA_TO_OBJPOOL(m) ( (ObjPool*)(((u8*)(m)) - offsetof(ObjPool, ma)) )
+
+// objpool_setslab makes the memory after headersize bytes of slab the current slab
+static void objpool_setslab(ObjPool* p, ObjSlab* slab, size_t headersize) {
+  u8* start = (u8*)slab + align2(headersize, OBJPOOL_ALIGN);
+  size_t nobjs = (size_t)(((u8*)slab + slab->npages * mem_pagesize()) - start) / p->objsize;
+  p->bump = start;
+  p->end = start + nobjs * p->objsize;
+}
+
+static void* nullable objpool_carve(ObjPool* p) {
+  SpinMutexLock(&p->mu);
+  if (p->bump == p->end) {
+    ObjSlab* slab = mem_pagealloc(p->slabnpages, MemPageDefault);
+    if (!slab) {
+      SpinMutexUnlock(&p->mu);
+      return NULL;
+    }
+    slab->npages = p->slabnpages;
+    slab->next = p->slab.next;
+    p->slab.next = slab;
+    objpool_setslab(p, slab, sizeof(ObjSlab));
+  }
+  void* obj = p->bump;
+  p->bump += p->objsize;
+  SpinMutexUnlock(&p->mu);
+  return obj;
+}
+
+static void* nullable objpool_alloc(Mem m, size_t size) {
+  ObjPool* p = MA_TO_OBJPOOL(m);
+  if (R_UNLIKELY(size > p->objsize))
+    return NULL;
+  void* obj = PoolTake(&p->free);
+  if (obj) {
+    memset(obj, 0, size);
+    return obj;
+  }
+  return objpool_carve(p);
+}
+
+static void* nullable objpool_alloc_uninit(Mem m, size_t size) {
+  ObjPool* p = MA_TO_OBJPOOL(m);
+  if (R_UNLIKELY(size > p->objsize))
+    return NULL;
+  void* obj = PoolTake(&p->free);
+  return obj ? obj : objpool_carve(p);
+}
+
+static void* nullable objpool_realloc(Mem m, void* ptr, size_t newsize) {
+  // all objects have the same size
+  ObjPool* p = MA_TO_OBJPOOL(m);
+  return newsize <= p->objsize ? ptr : NULL;
+}
+
+static void objpool_free(Mem m, void* ptr) {
+  ObjPool* p = MA_TO_OBJPOOL(m);
+  PoolAdd(&p->free, (PoolEntry*)ptr);
+}
+
+Mem nullable MemObjPool(size_t objsize) {
+  const size_t pagesize = mem_pagesize();
+  objsize = align2(MAX(objsize, sizeof(PoolEntry)), OBJPOOL_ALIGN);
+  size_t slabsize = MAX(OBJPOOL_SLABSIZE, sizeof(ObjPool) + objsize * OBJPOOL_MINSLABOBJS);
+  size_t slabnpages = align2(slabsize, pagesize) / pagesize;
+
+  // place the allocator at the start of the first slab
+  ObjPool* p = mem_pagealloc(slabnpages, MemPageDefault);
+  if (!p)
+    return NULL;
+  p->slab.next = NULL;
+  p->slab.npages = slabnpages;
+  p->ma.alloc   = objpool_alloc;
+  p->ma.realloc = objpool_realloc;
+  p->ma.free    = objpool_free;
+  p->ma.alloc_uninit = objpool_alloc_uninit;
+  p->objsize = objsize;
+  p->slabnpages = slabnpages;
+  SpinMutexInit(&p->mu);
+  objpool_setslab(p, &p->slab, sizeof(ObjPool));
+  return &p->ma;
+}
+
+void MemObjPoolFree(Mem m) {
+  ObjPool* p = MA_TO_OBJPOOL(m);
+  ObjSlab* slab = p->slab.next;
+  while (slab) {
+    ObjSlab* next = slab->next;
+    mem_pagefree(slab, slab->npages);
+    slab = next;
+  }
+  mem_pagefree(p, p->slab.npages);
+}
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+R_TEST(mem_objpool) {
+  Mem m = assertnotnull(MemObjPool(40));
+  ObjPool* p = MA_TO_OBJPOOL(m);
+  asserteq(p->objsize, 48);
+
+  // objects larger than objsize can not be allocated
+  assertnull(memalloc(m, 49));
+
+  u8* a = assertnotnull(memalloc(m, 40));
+  u8* b = assertnotnull(memalloc(m, 40));
+  asserteq(b, a + 48);
+  asserteq((uintptr_t)a % OBJPOOL_ALIGN, 0);
+  memset(a, 0xff, 40);
+
+  // freed objects are recycled and cleared
+  memfree(m, a);
+  u8* c = assertnotnull(memalloc(m, 40));
+  asserteq(c, a);
+  for (u32 i = 0; i < 40; i++)
+    asserteq(c[i], 0);
+
+  // objects can't grow
+  asserteq(memrealloc(m, c, 48), c);
+  assertnull(memrealloc(m, c, 49));
+
+  // allocate enough objects to need more slabs
+  u32 n = (OBJPOOL_SLABSIZE / 48) * 3;
+  void** ptrs = memalloc(MemLibC(), n * sizeof(void*));
+  for (u32 i = 0; i < n; i++)
+    ptrs[i] = assertnotnull(memalloc(m, 40));
+  assertnotnull(p->slab.next);
+  for (u32 i = 0; i < n; i++)
+    memfree(m, ptrs[i]);
+  memfree(MemLibC(), ptrs);
+
+  MemObjPoolFree(m);
+}
+
+typedef struct ObjPoolTestThread {
+  thrd_t t;
+  u32    id;
+  Mem    mem;
+  bool   ok;
+} ObjPoolTestThread;
+
+static int objpool_test_thread(void* arg) {
+  ObjPoolTestThread* t = arg;
+  u32* objs[64];
+  t->ok = true;
+  for (u32 round = 0; round < 500; round++) {
+    for (u32 i = 0; i < countof(objs); i++) {
+      objs[i] = memalloc(t->mem, 32);
+      if (!objs[i] || objs[i][1] != 0) {
+        t->ok = false;
+        return 0;
+      }
+      objs[i][1] = t->id;
+    }
+    thrd_yield();
+    // if another thread was handed the same object, it would have overwritten the id
+    for (u32 i = 0; i < countof(objs); i++) {
+      if (objs[i][1] != t->id)
+        t->ok = false;
+      memfree(t->mem, objs[i]);
+    }
+  }
+  return 0;
+}
+
+R_TEST(mem_objpool_mt) {
+  Mem m = assertnotnull(MemObjPool(32));
+  ObjPoolTestThread threads[8];
+  for (u32 i = 0; i < countof(threads); i++) {
+    threads[i].id = i + 1;
+    threads[i].mem = m;
+    UNUSED auto status = thrd_create(&threads[i].t, objpool_test_thread, &threads[i]);
+    asserteq(status, thrd_success);
+  }
+  for (u32 i = 0; i < countof(threads); i++) {
+    thrd_join(threads[i].t, NULL);
+    assert(threads[i].ok);
+  }
+  MemObjPoolFree(m);
+}
+
+#endif /* R_TESTING_ENABLED */
+ASSUME_NONNULL_END
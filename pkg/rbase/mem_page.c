@@ -67,8 +67,15 @@
   #ifndef MAP_ANON
     #define MAP_ANON MAP_ANONYMOUS
   #endif
+  #ifdef __linux__
+    #include <stdio.h> // for reading hpage_pmd_size
+  #endif
 #endif
 
+// HUGEPAGESIZE_FALLBACK is the huge page size assumed when the OS doesn't tell us.
+// This is the size of a "large page" on x86_64 and of a level-2 block on arm64 with 4k pages.
+#define HUGEPAGESIZE_FALLBACK ((size_t)2 * 1024 * 1024)
+
 
 size_t mem_pagesize() {
   static size_t v = 0;
@@ -80,7 +87,265 @@ size_t mem_pagesize() {
 }
 
 
-void* nullable mem_pagealloc(size_t npages, MemPageFlags flags) {
+size_t mem_hugepagesize() {
+  static size_t v = 0;
+  static r_sync_once_flag onceflag = {0};
+  r_sync_once(&onceflag, {
+    #if defined(__linux__)
+      FILE* f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+      if (f) {
+        if (fscanf(f, "%zu", &v) != 1)
+          v = 0;
+        fclose(f);
+      }
+    #endif
+    // must be a power-of-two multiple of the page size
+    if (v < mem_pagesize() || (v & (v - 1)) != 0)
+      v = HUGEPAGESIZE_FALLBACK;
+  });
+  return v;
+}
+
+
+// ------------------------------------------------------------------------------------
+// page cache
+//
+// Runs of pages freed with mem_pagefree are kept in a process-wide cache for reuse by
+// mem_pagealloc, avoiding the cost of munmap and mmap (and the page faults of touching
+// new pages) for allocators which come and go, like short-lived linear allocators.
+//
+// Runs are bucketed by log2 of their number of pages and only reused for requests of the
+// same number of pages. Cached runs are madvised with MADV_FREE so that the OS can take
+// the memory back under pressure. This also means that their contents are undefined and
+// mem_pagealloc clears reused runs, unless the caller says that it doesn't need that by
+// calling mem_pagealloc_uninit.
+//
+// Runs with guard pages or explicit huge pages (MemPageHugeTLB) are never cached; they are
+// recorded in uncached_runs when mapped and mem_pagefree unmaps them. Requests with those
+// flags always map new memory. Requests with MemPageHugeHint are served from the cache with
+// the alignment they need and madvised again.
+
+// PAGECACHE_NBUCKETS limits cached runs to less than 1<<PAGECACHE_NBUCKETS pages
+#define PAGECACHE_NBUCKETS 14
+
+// PAGECACHE_BUCKETCAP is the max number of runs in a bucket
+#define PAGECACHE_BUCKETCAP 64
+
+// PAGECACHE_MAXBYTES limits the total size of cached runs
+#define PAGECACHE_MAXBYTES ((size_t)64 * 1024 * 1024)
+
+typedef struct PageRun {
+  void*  ptr;
+  size_t npages;
+} PageRun;
+
+typedef struct PageCacheBucket {
+  SpinMutex mu;
+  u32       len;
+  PageRun   runs[PAGECACHE_BUCKETCAP];
+} __attribute__((aligned(64))) PageCacheBucket;
+
+static PageCacheBucket pagecache[PAGECACHE_NBUCKETS];
+static struct {
+  atomic_size bytes;
+  atomic_u64  nhit, nmiss, nput, nfull;
+} pagecache_stats;
+
+inline static u32 pagecache_bucket(size_t npages) {
+  return npages == 0 ? PAGECACHE_NBUCKETS : (u32)(63 - __builtin_clzll((u64)npages));
+}
+
+// pagecache_take removes and returns a cached run of npages aligned to alignment
+static void* nullable pagecache_take(size_t npages, size_t alignment, MemPageFlags flags) {
+  u32 bucket = pagecache_bucket(npages);
+  if (bucket >= PAGECACHE_NBUCKETS ||
+      (flags & (MemPageGuardHigh | MemPageGuardLow | MemPageHugeTLB)))
+  {
+    return NULL;
+  }
+  PageCacheBucket* b = &pagecache[bucket];
+  void* ptr = NULL;
+  SpinMutexLock(&b->mu);
+  // most recently cached runs are at the end and most likely to still be resident
+  for (u32 i = b->len; i > 0; i--) {
+    PageRun* r = &b->runs[i - 1];
+    if (r->npages == npages && ((uintptr_t)r->ptr & (alignment - 1)) == 0) {
+      ptr = r->ptr;
+      *r = b->runs[--b->len];
+      break;
+    }
+  }
+  SpinMutexUnlock(&b->mu);
+  if (ptr) {
+    AtomicSub(&pagecache_stats.bytes, npages * mem_pagesize());
+    AtomicAdd(&pagecache_stats.nhit, 1);
+  } else {
+    AtomicAdd(&pagecache_stats.nmiss, 1);
+  }
+  return ptr;
+}
+
+// pagecache_put adds a run to the cache. Returns false if the cache is full.
+static bool pagecache_put(void* ptr, size_t npages) {
+  u32 bucket = pagecache_bucket(npages);
+  size_t size = npages * mem_pagesize();
+  if (bucket >= PAGECACHE_NBUCKETS ||
+      AtomicLoad(&pagecache_stats.bytes) + size > PAGECACHE_MAXBYTES)
+  {
+    AtomicAdd(&pagecache_stats.nfull, 1);
+    return false;
+  }
+  // Release the pages before the run is visible to other threads, which may start using
+  // it right away. Failure is harmless; the pages just stay resident.
+  mem_pagerelease(ptr, npages);
+  PageCacheBucket* b = &pagecache[bucket];
+  bool ok = false;
+  SpinMutexLock(&b->mu);
+  if (b->len < PAGECACHE_BUCKETCAP &&
+      AtomicAdd(&pagecache_stats.bytes, size) + size <= PAGECACHE_MAXBYTES)
+  {
+    b->runs[b->len++] = (PageRun){ ptr, npages };
+    ok = true;
+  } else if (b->len < PAGECACHE_BUCKETCAP) {
+    AtomicSub(&pagecache_stats.bytes, size);
+  }
+  SpinMutexUnlock(&b->mu);
+  AtomicAdd(ok ? &pagecache_stats.nput : &pagecache_stats.nfull, 1);
+  return ok;
+}
+
+size_t mem_pagecache_drain() {
+  size_t nbytes = 0;
+  for (u32 bucket = 0; bucket < PAGECACHE_NBUCKETS; bucket++) {
+    PageCacheBucket* b = &pagecache[bucket];
+    SpinMutexLock(&b->mu);
+    for (u32 i = 0; i < b->len; i++) {
+      PageRun* r = &b->runs[i];
+      size_t size = r->npages * mem_pagesize();
+      AtomicSub(&pagecache_stats.bytes, size);
+      if (mem_pagefree_uncached(r->ptr, r->npages))
+        nbytes += size;
+    }
+    b->len = 0;
+    SpinMutexUnlock(&b->mu);
+  }
+  return nbytes;
+}
+
+void mem_pagecache_stats(MemPageCacheStats* st) {
+  st->nhit  = AtomicLoad(&pagecache_stats.nhit);
+  st->nmiss = AtomicLoad(&pagecache_stats.nmiss);
+  st->nput  = AtomicLoad(&pagecache_stats.nput);
+  st->nfull = AtomicLoad(&pagecache_stats.nfull);
+  st->bytes = AtomicLoad(&pagecache_stats.bytes);
+}
+
+// ------------------------------------------------------------------------------------
+// uncached runs
+//
+// Addresses of runs which must not be cached (see "page cache" above), in a hash set with
+// linear probing. The set is empty in most processes, so mem_pagefree checks len first.
+
+static struct {
+  SpinMutex   mu;
+  atomic_size len;
+  size_t      cap; // capacity of v; a power of two, or 0 when v is NULL
+  uintptr_t*  v;   // 0 marks an empty slot
+} uncached_runs;
+
+inline static size_t uncached_slot(uintptr_t addr, size_t cap) {
+  return (size_t)(((u64)addr * 0x9E3779B97F4A7C15ull) >> 32) & (cap - 1);
+}
+
+static bool pages_unmap(void* ptr, size_t npages) {
+  #ifdef HAS_MMAP
+    return munmap(ptr, npages * mem_pagesize()) == 0;
+  #else
+    #error "TODO: no mmap"
+  #endif
+}
+
+// uncached_add records that the run at ptr must not be cached.
+// Returns false if the set needs to grow and memory for it could not be mapped.
+static bool uncached_add(void* ptr) {
+  const size_t pagesize = mem_pagesize();
+  bool ok = true;
+  SpinMutexLock(&uncached_runs.mu);
+  size_t len = AtomicLoad(&uncached_runs.len);
+  if ((len + 1) * 4 > uncached_runs.cap * 3) {
+    // grow to keep the load factor below 3/4
+    size_t cap = MAX(uncached_runs.cap * 2, pagesize / sizeof(uintptr_t));
+    size_t npages = cap * sizeof(uintptr_t) / pagesize;
+    void* mp = mmap(0, npages * pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (mp == MAP_FAILED) {
+      ok = false;
+      goto end;
+    }
+    uintptr_t* v = mp;
+    for (size_t i = 0; i < uncached_runs.cap; i++) {
+      uintptr_t addr = uncached_runs.v[i];
+      if (addr == 0)
+        continue;
+      size_t j = uncached_slot(addr, cap);
+      while (v[j])
+        j = (j + 1) & (cap - 1);
+      v[j] = addr;
+    }
+    if (uncached_runs.v)
+      pages_unmap(uncached_runs.v, uncached_runs.cap * sizeof(uintptr_t) / pagesize);
+    uncached_runs.v = v;
+    uncached_runs.cap = cap;
+  }
+  size_t i = uncached_slot((uintptr_t)ptr, uncached_runs.cap);
+  while (uncached_runs.v[i])
+    i = (i + 1) & (uncached_runs.cap - 1);
+  uncached_runs.v[i] = (uintptr_t)ptr;
+  AtomicStore(&uncached_runs.len, len + 1);
+end:
+  SpinMutexUnlock(&uncached_runs.mu);
+  return ok;
+}
+
+// uncached_remove removes ptr from the set. Returns false if it wasn't in the set.
+static bool uncached_remove(void* ptr) {
+  if (R_LIKELY(AtomicLoad(&uncached_runs.len) == 0))
+    return false;
+  bool found = false;
+  SpinMutexLock(&uncached_runs.mu);
+  size_t mask = uncached_runs.cap - 1;
+  size_t i = uncached_runs.cap ? uncached_slot((uintptr_t)ptr, uncached_runs.cap) : 0;
+  while (uncached_runs.cap && uncached_runs.v[i]) {
+    if (uncached_runs.v[i] == (uintptr_t)ptr) {
+      found = true;
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  if (found) {
+    // shift following entries of the probe sequence back into the hole
+    size_t j = i;
+    while (1) {
+      j = (j + 1) & mask;
+      uintptr_t addr = uncached_runs.v[j];
+      if (addr == 0)
+        break;
+      size_t k = uncached_slot(addr, uncached_runs.cap);
+      // move addr if its home slot k is not cyclically within (i, j]
+      if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+        uncached_runs.v[i] = addr;
+        i = j;
+      }
+    }
+    uncached_runs.v[i] = 0;
+    AtomicStore(&uncached_runs.len, AtomicLoad(&uncached_runs.len) - 1);
+  }
+  SpinMutexUnlock(&uncached_runs.mu);
+  return found;
+}
+
+// ------------------------------------------------------------------------------------
+
+static void* nullable mem_pagealloc1(size_t npages, size_t alignment, MemPageFlags flags) {
   // read system page size (mem_pagesize returns a cached value; no syscall)
   const size_t pagesize = mem_pagesize();
   size_t allocsize = npages * pagesize;
@@ -112,10 +377,64 @@ void* nullable mem_pagealloc(size_t npages, MemPageFlags flags) {
       int fd = -1;
     #endif
 
-    ptr = mmap(0, allocsize, mmapprot, mmapflags, fd, 0);
+    const size_t hugepagesize = mem_hugepagesize();
+    const bool guarded = (flags & (MemPageGuardHigh | MemPageGuardLow)) != 0;
+
+    #ifdef MAP_HUGETLB
+      // Explicit huge pages come from a pool which the system administrator must reserve
+      // (e.g. vm.nr_hugepages) so this often fails, in which case we fall back to regular
+      // pages. The mapping (and munmap) must be in whole huge pages, and the guard pages
+      // can't be used since mprotect works on whole huge pages as well.
+      if ((flags & MemPageHugeTLB) && !guarded && allocsize % hugepagesize == 0) {
+        int hugeflags = mmapflags | MAP_HUGETLB;
+        #ifdef MAP_NORESERVE
+          // With MAP_NORESERVE, mmap succeeds even when there are no free huge pages and
+          // we'd get SIGBUS when touching the memory. Without it, mmap fails instead.
+          hugeflags &= ~MAP_NORESERVE;
+        #endif
+        ptr = mmap(0, allocsize, mmapprot, hugeflags, fd, 0);
+        if (ptr != MAP_FAILED) {
+          // huge pages are naturally aligned to their size
+          if (((uintptr_t)ptr & (alignment - 1)) == 0 && uncached_add(ptr))
+            return ptr;
+          munmap(ptr, allocsize);
+        }
+        ptr = NULL;
+      }
+    #endif
+
+    // Transparent huge pages are only used for huge-page aligned ranges of a mapping
+    if ((flags & (MemPageHugeTLB | MemPageHugeHint)) && allocsize >= hugepagesize)
+      alignment = MAX(alignment, hugepagesize);
+
+    // When an alignment larger than the page size is requested, map enough extra memory
+    // to guarantee that an aligned address exists in the mapping, then unmap the unaligned
+    // head and tail.
+    size_t mapsize = allocsize + (alignment - pagesize);
+
+    ptr = mmap(0, mapsize, mmapprot, mmapflags, fd, 0);
     if (R_UNLIKELY(ptr == MAP_FAILED))
       return NULL;
 
+    if (mapsize != allocsize) {
+      uintptr_t addr = align2((uintptr_t)ptr, (uintptr_t)alignment);
+      size_t headsize = (size_t)(addr - (uintptr_t)ptr);
+      size_t tailsize = (mapsize - allocsize) - headsize;
+      if (headsize > 0)
+        munmap(ptr, headsize);
+      if (tailsize > 0)
+        munmap((void*)(addr + allocsize), tailsize);
+      ptr = (void*)addr;
+    }
+
+    #ifdef MADV_HUGEPAGE
+      if ((flags & (MemPageHugeTLB | MemPageHugeHint)) && allocsize >= hugepagesize) {
+        // Ask the kernel to back this range with transparent huge pages.
+        // Failure is harmless (e.g. THP disabled) and only means we get regular pages.
+        madvise(ptr, allocsize, MADV_HUGEPAGE);
+      }
+    #endif
+
     // Pretty much all OSes return zeroed anonymous memory pages.
     // Do a little sample in debug mode just to be sure.
     #if defined(DEBUG) && !defined(NDEBUG)
@@ -133,7 +452,7 @@ void* nullable mem_pagealloc(size_t npages, MemPageFlags flags) {
           protPagePtr = &((u8*)ptr)[allocsize - pagesize];
         }
         int status = mprotect(protPagePtr, pagesize, PROT_NONE);
-        if (R_UNLIKELY(status != 0)) {
+        if (R_UNLIKELY(status != 0 || !uncached_add(ptr))) {
           // If mproctect fails, fail hard
           munmap(ptr, allocsize);
           return NULL;
@@ -145,11 +464,229 @@ void* nullable mem_pagealloc(size_t npages, MemPageFlags flags) {
   return ptr;
 }
 
+// mem_pagealloc2 takes a run from the page cache or maps new pages.
+// Sets *zeroed to false if the memory may hold data.
+static void* nullable mem_pagealloc2(
+  size_t npages, size_t alignment, MemPageFlags flags, bool* zeroed)
+{
+  // transparent huge pages are only used for huge-page aligned ranges (see mem_pagealloc1)
+  size_t allocsize = npages * mem_pagesize();
+  bool hugehint = (flags & MemPageHugeHint) && allocsize >= mem_hugepagesize();
+  void* ptr = pagecache_take(
+    npages, hugehint ? MAX(alignment, mem_hugepagesize()) : alignment, flags);
+  if (ptr) {
+    #ifdef MADV_HUGEPAGE
+      if (hugehint)
+        madvise(ptr, allocsize, MADV_HUGEPAGE);
+    #endif
+    *zeroed = false;
+    return ptr;
+  }
+  *zeroed = true;
+  return mem_pagealloc1(npages, alignment, flags);
+}
+
+void* nullable mem_pagealloc(size_t npages, MemPageFlags flags) {
+  bool zeroed;
+  void* ptr = mem_pagealloc2(npages, mem_pagesize(), flags, &zeroed);
+  if (ptr && !zeroed)
+    memset(ptr, 0, npages * mem_pagesize());
+  return ptr;
+}
+
+void* nullable mem_pagealloc_uninit(size_t npages, MemPageFlags flags, bool* zeroed) {
+  return mem_pagealloc2(npages, mem_pagesize(), flags, zeroed);
+}
+
+void* nullable mem_pagealloc_aligned(size_t npages, size_t alignment, MemPageFlags flags) {
+  assertf((alignment & (alignment - 1)) == 0, "alignment %zu is not a power of two", alignment);
+  bool zeroed;
+  void* ptr = mem_pagealloc2(npages, MAX(alignment, mem_pagesize()), flags, &zeroed);
+  if (ptr && !zeroed)
+    memset(ptr, 0, npages * mem_pagesize());
+  return ptr;
+}
+
 bool mem_pagefree(void* ptr, size_t npages) {
+  if (!uncached_remove(ptr) && pagecache_put(ptr, npages))
+    return true;
+  return pages_unmap(ptr, npages);
+}
+
+bool mem_pagefree_uncached(void* ptr, size_t npages) {
+  uncached_remove(ptr);
+  return pages_unmap(ptr, npages);
+}
+
+void* nullable mem_pageremap(void* ptr, size_t npages, size_t newnpages) {
+  const size_t pagesize = mem_pagesize();
+  #if defined(__linux__) && defined(MREMAP_MAYMOVE)
+    // the kernel moves page table entries rather than copying memory
+    void* ptr2 = mremap(ptr, npages * pagesize, newnpages * pagesize, MREMAP_MAYMOVE);
+    return ptr2 == MAP_FAILED ? NULL : ptr2;
+  #else
+    if (newnpages <= npages) {
+      if (newnpages < npages &&
+          !mem_pagefree_uncached((u8*)ptr + newnpages * pagesize, npages - newnpages))
+      {
+        return NULL;
+      }
+      return ptr;
+    }
+    bool zeroed;
+    void* ptr2 = mem_pagealloc_uninit(newnpages, MemPageDefault, &zeroed);
+    if (ptr2) {
+      memcpy(ptr2, ptr, npages * pagesize);
+      if (!zeroed)
+        memset((u8*)ptr2 + npages * pagesize, 0, (newnpages - npages) * pagesize);
+      mem_pagefree(ptr, npages);
+    }
+    return ptr2;
+  #endif
+}
+
+bool mem_pagerelease(void* ptr, size_t npages) {
   size_t size = mem_pagesize() * npages;
   #ifdef HAS_MMAP
-    return munmap(ptr, size) == 0;
+    #if defined(MADV_FREE)
+      // MADV_FREE lets the OS reclaim the pages whenever it needs to, which is cheaper than
+      // MADV_DONTNEED when the pages are reused soon after. Not all kernels support it.
+      if (madvise(ptr, size, MADV_FREE) == 0)
+        return true;
+    #endif
+    return madvise(ptr, size, MADV_DONTNEED) == 0;
   #else
     #error "TODO: no mmap"
   #endif
 }
+
+
+MemVMRegion mem_vmreserve(size_t size) {
+  MemVMRegion r = {0};
+  size = align2(size, mem_pagesize());
+  #ifdef HAS_MMAP
+    int flags = MAP_PRIVATE | MAP_ANON;
+    #ifdef MAP_NORESERVE
+      flags |= MAP_NORESERVE;
+    #endif
+    void* ptr = mmap(0, size, PROT_NONE, flags, -1, 0);
+    if (R_UNLIKELY(ptr == MAP_FAILED))
+      return r;
+    r.base = ptr;
+    r.size = size;
+  #else
+    #error "TODO: no mmap"
+  #endif
+  return r;
+}
+
+#define assert_vmrange(r, offset, size) \
+  assertf(((offset) | (size)) % mem_pagesize() == 0 && (offset) + (size) <= (r).size, \
+    "invalid range %zu-%zu of region %p (size %zu)", \
+    (size_t)(offset), (size_t)((offset) + (size)), (r).base, (r).size)
+
+bool mem_vmcommit(MemVMRegion r, size_t offset, size_t size) {
+  assert_vmrange(r, offset, size);
+  #ifdef HAS_MMAP
+    return mprotect((u8*)r.base + offset, size, PROT_READ | PROT_WRITE) == 0;
+  #endif
+}
+
+bool mem_vmdecommit(MemVMRegion r, size_t offset, size_t size) {
+  assert_vmrange(r, offset, size);
+  #ifdef HAS_MMAP
+    // Replace the pages with a fresh reservation. Unlike madvise, this portably discards
+    // the pages' contents, so they read as zero if committed again.
+    void* ptr = (u8*)r.base + offset;
+    int flags = MAP_PRIVATE | MAP_ANON | MAP_FIXED;
+    #ifdef MAP_NORESERVE
+      flags |= MAP_NORESERVE;
+    #endif
+    return mmap(ptr, size, PROT_NONE, flags, -1, 0) != MAP_FAILED;
+  #endif
+}
+
+bool mem_vmrelease(MemVMRegion r) {
+  #ifdef HAS_MMAP
+    return munmap(r.base, r.size) == 0;
+  #endif
+}
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+R_TEST(mem_pagecache) {
+  const size_t pagesize = mem_pagesize();
+  mem_pagecache_drain();
+  MemPageCacheStats st1, st2;
+  mem_pagecache_stats(&st1);
+  asserteq(st1.bytes, 0);
+
+  // freed pages are reused and cleared
+  u8* p = assertnotnull(mem_pagealloc(3, MemPageDefault));
+  memset(p, 0xff, 3 * pagesize);
+  mem_pagefree(p, 3);
+  mem_pagecache_stats(&st2);
+  asserteq(st2.nput, st1.nput + 1);
+  asserteq(st2.bytes, 3 * pagesize);
+  u8* p2 = assertnotnull(mem_pagealloc(3, MemPageDefault));
+  asserteq(p2, p);
+  for (size_t i = 0; i < 3 * pagesize; i++)
+    asserteq(p2[i], 0);
+
+  // runs are only reused for the same number of pages
+  mem_pagefree(p2, 3);
+  u8* p3 = assertnotnull(mem_pagealloc(2, MemPageDefault));
+  assert(p3 != p);
+  mem_pagefree_uncached(p3, 2);
+
+  // uninit allocations report that the memory may hold data
+  bool zeroed = true;
+  p2 = assertnotnull(mem_pagealloc_uninit(3, MemPageDefault, &zeroed));
+  asserteq(p2, p);
+  asserteq(zeroed, false);
+
+  // requests with guard pages map new memory, and such runs are never cached
+  u8* p4 = assertnotnull(mem_pagealloc(3, MemPageGuardHigh));
+  u8* p5 = assertnotnull(mem_pagealloc(3, MemPageGuardLow));
+  asserteq(AtomicLoad(&uncached_runs.len), 2);
+  MemPageCacheStats st3;
+  mem_pagecache_stats(&st3);
+  mem_pagefree(p4, 3);
+  mem_pagefree(p5, 3);
+  mem_pagecache_stats(&st2);
+  asserteq(st2.nput, st3.nput);
+  asserteq(AtomicLoad(&uncached_runs.len), 0);
+
+  // many guarded runs, freed in a different order than they were allocated
+  void* guarded[1000];
+  for (u32 i = 0; i < countof(guarded); i++)
+    guarded[i] = assertnotnull(mem_pagealloc(2, MemPageGuardHigh));
+  asserteq(AtomicLoad(&uncached_runs.len), countof(guarded));
+  for (u32 i = 0; i < countof(guarded); i += 2)
+    mem_pagefree(guarded[i], 2);
+  for (u32 i = 1; i < countof(guarded); i += 2)
+    mem_pagefree(guarded[i], 2);
+  asserteq(AtomicLoad(&uncached_runs.len), 0);
+  mem_pagecache_stats(&st2);
+  asserteq(st2.nput, st3.nput);
+
+  // huge page hint requests are served from the cache, with huge page alignment
+  size_t hugenpages = mem_hugepagesize() / pagesize;
+  u8* p6 = assertnotnull(mem_pagealloc(hugenpages, MemPageHugeHint));
+  asserteq((uintptr_t)p6 % mem_hugepagesize(), 0);
+  mem_pagefree(p6, hugenpages);
+  u8* p7 = assertnotnull(mem_pagealloc(hugenpages, MemPageHugeHint));
+  asserteq(p7, p6);
+  mem_pagefree(p7, hugenpages);
+
+  mem_pagefree(p2, 3);
+  mem_pagecache_stats(&st2);
+  asserteq(st2.nhit, st1.nhit + 3);
+  asserteq(st2.nmiss, st1.nmiss + 3);
+  mem_pagecache_drain();
+  mem_pagecache_stats(&st2);
+  asserteq(st2.bytes, 0);
+}
+
+#endif /* R_TESTING_ENABLED */
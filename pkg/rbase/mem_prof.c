@@ -0,0 +1,512 @@
+#include "rbase.h"
+//
+// MemProfWrapper is a sampling heap profiler.
+//
+// Each thread counts down the number of bytes until its next sample. The distance between
+// samples is drawn from an exponential distribution with the sampling interval as the mean,
+// which makes sampling a Poisson process: every byte allocated has the same probability of
+// being sampled, independent of allocation sizes and patterns. An allocation is sampled if
+// the countdown runs out while allocating its bytes.
+//
+// For a sampled allocation, the stack is captured and the allocation is added to the counters
+// of its call site. Call sites are kept in a hash table keyed by their stack.
+// All allocations are prefixed by a header which records the call site of sampled allocations,
+// so that free can remove them from the "in use" counters.
+//
+// Reports contain the raw sample counts. The heap profile tells pprof the sampling interval
+// so it can estimate the actual numbers, while the folded-stack report is scaled when written.
+//
+
+#ifdef HAVE_LIBBACKTRACE
+  #include "backtrace.h"
+#endif
+
+// PROF_HAVE_EXECINFO is defined when libc provides backtrace(), which is used to capture
+// stacks when libbacktrace is not available
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__) || \
+    defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+  #define PROF_HAVE_EXECINFO
+  #include <execinfo.h>
+#endif
+
+#define PROF_HEADERSIZE 16   // sizeof(ProfHeader), rounded up to keep data 16-byte aligned
+#define PROF_MAXDEPTH   32   // max number of stack frames recorded
+#define PROF_SKIPFRAMES 2    // frames of the profiler itself (prof_sample and alloc/realloc)
+#define PROF_NBUCKETS   1024 // size of the call site hash table. Must be a power of two.
+
+ASSUME_NONNULL_BEGIN
+
+typedef struct ProfHeader {
+  u32    site; // call site index + 1, or 0 if not sampled
+  size_t size; // size requested by the caller
+} ProfHeader;
+
+static_assert(sizeof(ProfHeader) <= PROF_HEADERSIZE, "");
+
+#define PTR_TO_PHDR(ptr) ( (ProfHeader*)(((u8*)(ptr)) - PROF_HEADERSIZE) )
+
+typedef struct ProfSite {
+  u32       next;  // next site in the same hash bucket (index + 1, or 0)
+  u32       hash;
+  u32       depth; // number of pcs
+  uintptr_t pcs[PROF_MAXDEPTH];
+  u64       alloc_count, alloc_bytes; // all sampled allocations
+  u64       inuse_count, inuse_bytes; // sampled allocations not yet freed
+} ProfSite;
+
+typedef struct MProfWrapper {
+  MemAllocator ma;
+  Mem          m;
+  size_t       interval; // mean number of bytes between samples
+  mtx_t        mu;       // protects the fields below
+  ProfSite*    sites;
+  u32          nsites, sitescap;
+  u32          buckets[PROF_NBUCKETS]; // site index + 1, or 0
+} MProfWrapper;
+
+// per-thread sampling state
+static thread_local struct {
+  i64 until; // bytes left until the next sample
+  u64 rnd;   // random number generator state; 0 until initialized
+} prof_tls;
+
+// ------------------------------------------------------------------------------------
+// sampling
+
+// prof_ln approximates the natural logarithm of x in (0,1] (libm is not linked)
+static double prof_ln(double x) {
+  // x = m * 2^e where m is in [1,2)
+  union { double f; u64 u; } v = { .f = x };
+  i64 e = (i64)((v.u >> 52) & 0x7ff) - 1023;
+  v.u = (v.u & 0x000fffffffffffffull) | 0x3ff0000000000000ull;
+  // ln(m) = 2 atanh((m-1)/(m+1)), where |z| <= 1/3 so that a few terms are enough
+  double z = (v.f - 1.0) / (v.f + 1.0);
+  double z2 = z * z;
+  double lnm = 2.0 * z * (1.0 + z2 * (1.0/3.0 + z2 * (1.0/5.0 + z2 * (1.0/7.0 + z2 / 9.0))));
+  return (double)e * 0.6931471805599453 + lnm;
+}
+
+// prof_exp approximates e^x for x <= 0
+static double prof_exp(double x) {
+  if (x < -700.0)
+    return 0.0;
+  // x = k ln2 + r where |r| <= ln2/2; e^x = 2^k e^r
+  i64 k = (i64)(x * 1.4426950408889634 - 0.5);
+  double r = x - (double)k * 0.6931471805599453;
+  double er = 1.0 + r * (1.0 + r * (1.0/2 + r * (1.0/6 + r * (1.0/24 + r * (1.0/120
+            + r * (1.0/720 + r / 5040))))));
+  union { double f; u64 u; } v = { .u = (u64)(k + 1023) << 52 };
+  return er * v.f;
+}
+
+// prof_nextsample returns the number of bytes until the next sample
+static i64 prof_nextsample(size_t interval) {
+  if (R_UNLIKELY(prof_tls.rnd == 0))
+    prof_tls.rnd = ((u64)(uintptr_t)&prof_tls ^ nanotime()) | 1;
+  // xorshift64*
+  u64 x = prof_tls.rnd;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  prof_tls.rnd = x;
+  x *= 0x2545f4914f6cdd1dull;
+  // uniform in (0,1]
+  double u = (double)((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+  return (i64)(-prof_ln(u) * (double)interval) + 1;
+}
+
+// prof_shouldsample counts size bytes and returns true if the allocation is to be sampled
+inline static bool prof_shouldsample(MProfWrapper* w, size_t size) {
+  prof_tls.until -= (i64)size;
+  if (R_LIKELY(prof_tls.until > 0))
+    return false;
+  bool init = prof_tls.rnd == 0;
+  prof_tls.until = prof_nextsample(w->interval);
+  return !init;
+}
+
+#ifdef HAVE_LIBBACKTRACE
+static struct backtrace_state* nullable prof_btstate = NULL;
+static r_sync_once_flag prof_btstate_once = {0};
+
+static void prof_bt_error(void* data, const char* msg, int errnum) {
+  #ifdef DEBUG
+  errlog("[mem_prof] backtrace error #%d %s", errnum, msg);
+  #endif
+}
+
+static struct backtrace_state* nullable prof_backtrace_state() {
+  r_sync_once(&prof_btstate_once, {
+    prof_btstate = backtrace_create_state(os_exepath(), /*threaded*/1, prof_bt_error, NULL);
+  });
+  return prof_btstate;
+}
+
+typedef struct ProfStack {
+  uintptr_t pcs[PROF_MAXDEPTH];
+  u32       depth;
+} ProfStack;
+
+static int prof_bt_simple(void* data, uintptr_t pc) {
+  ProfStack* st = (ProfStack*)data;
+  if (st->depth == PROF_MAXDEPTH || pc == (uintptr_t)-1) // -1 marks the end of the stack
+    return 1;
+  st->pcs[st->depth++] = pc;
+  return 0;
+}
+#endif /* HAVE_LIBBACKTRACE */
+
+// prof_capture stores the pcs of the caller's stack in pcs and returns the number of pcs.
+// skip is the number of frames to leave out, starting with the caller.
+// Returns 0 if stacks can't be captured on this platform.
+NO_INLINE static u32 prof_capture(uintptr_t pcs[PROF_MAXDEPTH], int skip) {
+  skip++; // this function
+  #ifdef HAVE_LIBBACKTRACE
+    struct backtrace_state* state = prof_backtrace_state();
+    if (state) {
+      ProfStack st = { .depth = 0 };
+      backtrace_simple(state, skip, prof_bt_simple, prof_bt_error, &st);
+      memcpy(pcs, st.pcs, st.depth * sizeof(uintptr_t));
+      return st.depth;
+    }
+  #endif
+  #ifdef PROF_HAVE_EXECINFO
+    void* buf[PROF_MAXDEPTH + 8];
+    int n = backtrace(buf, countof(buf));
+    u32 depth = 0;
+    for (int i = skip; i < n && depth < PROF_MAXDEPTH; i++)
+      pcs[depth++] = (uintptr_t)buf[i];
+    return depth;
+  #else
+    return 0;
+  #endif
+}
+
+static u32 prof_hash(const uintptr_t* pcs, u32 depth) {
+  // FNV-1a over the pcs
+  u64 h = 0xcbf29ce484222325ull;
+  for (u32 i = 0; i < depth; i++) {
+    h ^= (u64)pcs[i];
+    h *= 0x100000001b3ull;
+  }
+  return (u32)(h ^ (h >> 32));
+}
+
+// prof_site returns the index of the site with the stack pcs, adding one if needed.
+// Returns 0 if memory for a new site could not be allocated. w->mu must be locked.
+static u32 prof_site(MProfWrapper* w, const uintptr_t* pcs, u32 depth) {
+  u32 hash = prof_hash(pcs, depth);
+  u32* bucket = &w->buckets[hash & (PROF_NBUCKETS - 1)];
+  for (u32 i = *bucket; i != 0; i = w->sites[i - 1].next) {
+    ProfSite* s = &w->sites[i - 1];
+    if (s->hash == hash && s->depth == depth && memcmp(s->pcs, pcs, depth * sizeof(*pcs)) == 0)
+      return i;
+  }
+  if (w->nsites == w->sitescap) {
+    u32 cap = MAX(w->sitescap * 2, 64u);
+    ProfSite* sites = memrealloc(w->m, w->sites, cap * sizeof(ProfSite));
+    if (!sites)
+      return 0;
+    w->sites = sites;
+    w->sitescap = cap;
+  }
+  ProfSite* s = &w->sites[w->nsites++];
+  memset(s, 0, sizeof(*s));
+  s->hash = hash;
+  s->depth = depth;
+  memcpy(s->pcs, pcs, depth * sizeof(*pcs));
+  s->next = *bucket;
+  *bucket = w->nsites;
+  return w->nsites;
+}
+
+// prof_sample records an allocation of size at the caller's call site and returns the
+// site index + 1 for ProfHeader.site
+NO_INLINE static u32 prof_sample(MProfWrapper* w, size_t size) {
+  uintptr_t pcs[PROF_MAXDEPTH];
+  u32 depth = prof_capture(pcs, PROF_SKIPFRAMES);
+  mtx_lock(&w->mu);
+  u32 site = prof_site(w, pcs, depth);
+  if (site) {
+    ProfSite* s = &w->sites[site - 1];
+    s->alloc_count++;
+    s->alloc_bytes += size;
+    s->inuse_count++;
+    s->inuse_bytes += size;
+  }
+  mtx_unlock(&w->mu);
+  return site;
+}
+
+static void prof_unsample(MProfWrapper* w, ProfHeader* h) {
+  mtx_lock(&w->mu);
+  ProfSite* s = &w->sites[h->site - 1];
+  s->inuse_count--;
+  s->inuse_bytes -= h->size;
+  mtx_unlock(&w->mu);
+}
+
+// ------------------------------------------------------------------------------------
+// allocator
+
+// prof_onalloc samples a new allocation h of the inner allocator.
+// Always inlined so that it doesn't add to the frames skipped by prof_sample.
+ALWAYS_INLINE static void* nullable prof_onalloc(
+  MProfWrapper* w, ProfHeader* nullable h, size_t size)
+{
+  if (!h)
+    return NULL;
+  h->size = size;
+  h->site = R_UNLIKELY(prof_shouldsample(w, size)) ? prof_sample(w, size) : 0;
+  return (u8*)h + PROF_HEADERSIZE;
+}
+
+static void* nullable _mem_profw_alloc(Mem m, size_t size) {
+  MProfWrapper* w = (MProfWrapper*)m;
+  return prof_onalloc(w, memalloc(w->m, PROF_HEADERSIZE + size), size);
+}
+
+static void* nullable _mem_profw_alloc_uninit(Mem m, size_t size) {
+  MProfWrapper* w = (MProfWrapper*)m;
+  return prof_onalloc(w, memalloc_uninit(w->m, PROF_HEADERSIZE + size), size);
+}
+
+static void* nullable _mem_profw_realloc(Mem m, void* ptr, size_t newsize) {
+  MProfWrapper* w = (MProfWrapper*)m;
+  ProfHeader* h = PTR_TO_PHDR(ptr);
+  if (h->site) {
+    // account for the reallocation as a new allocation at the caller of realloc
+    prof_unsample(w, h);
+    h->site = 0;
+  }
+  h = w->m->realloc(w->m, h, PROF_HEADERSIZE + newsize);
+  if (!h)
+    return NULL;
+  h->size = newsize;
+  h->site = R_UNLIKELY(prof_shouldsample(w, newsize)) ? prof_sample(w, newsize) : 0;
+  return (u8*)h + PROF_HEADERSIZE;
+}
+
+static void _mem_profw_free(Mem m, void* ptr) {
+  MProfWrapper* w = (MProfWrapper*)m;
+  ProfHeader* h = PTR_TO_PHDR(ptr);
+  if (R_UNLIKELY(h->site))
+    prof_unsample(w, h);
+  w->m->free(w->m, h);
+}
+
+Mem nullable MemProfWrapper(Mem inner, size_t interval) {
+  auto w = memalloct(inner, MProfWrapper);
+  if (!w)
+    return NULL;
+  w->ma.alloc   = _mem_profw_alloc;
+  w->ma.realloc = _mem_profw_realloc;
+  w->ma.free    = _mem_profw_free;
+  w->ma.alloc_uninit = _mem_profw_alloc_uninit;
+  w->m = inner;
+  w->interval = interval > 0 ? interval : MEM_PROF_DEFAULT_INTERVAL;
+  mtx_init(&w->mu, mtx_plain);
+  return (Mem)w;
+}
+
+Mem MemProfWrapperFree(Mem m) {
+  MProfWrapper* w = (MProfWrapper*)m;
+  Mem inner = w->m;
+  mtx_destroy(&w->mu);
+  if (w->sites)
+    memfree(inner, w->sites);
+  memfree(inner, w);
+  return inner;
+}
+
+// ------------------------------------------------------------------------------------
+// reports
+
+void MemProfWriteHeapProfile(Mem m, FILE* fp) {
+  // Legacy "heap_v2" text format of gperftools, understood by pprof.
+  // Counts are raw samples; pprof scales them using the interval in the header.
+  MProfWrapper* w = (MProfWrapper*)m;
+  mtx_lock(&w->mu);
+  u64 inuse_count = 0, inuse_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+  for (u32 i = 0; i < w->nsites; i++) {
+    ProfSite* s = &w->sites[i];
+    inuse_count += s->inuse_count;
+    inuse_bytes += s->inuse_bytes;
+    alloc_count += s->alloc_count;
+    alloc_bytes += s->alloc_bytes;
+  }
+  fprintf(fp, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+    inuse_count, inuse_bytes, alloc_count, alloc_bytes, w->interval);
+  for (u32 i = 0; i < w->nsites; i++) {
+    ProfSite* s = &w->sites[i];
+    fprintf(fp, "%llu: %llu [%llu: %llu] @",
+      s->inuse_count, s->inuse_bytes, s->alloc_count, s->alloc_bytes);
+    for (u32 j = 0; j < s->depth; j++)
+      fprintf(fp, " 0x%zx", (size_t)s->pcs[j]);
+    fputc('\n', fp);
+  }
+  mtx_unlock(&w->mu);
+
+  // pprof needs the memory map to symbolize pcs of shared libraries and PIE executables
+  #ifdef __linux__
+    FILE* mapsfp = fopen("/proc/self/maps", "r");
+    if (mapsfp) {
+      fputs("\nMAPPED_LIBRARIES:\n", fp);
+      char buf[4096];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), mapsfp)) > 0)
+        fwrite(buf, 1, n, fp);
+      fclose(mapsfp);
+    }
+  #endif
+}
+
+// prof_scale estimates the number of bytes allocated at a site from its samples.
+// An allocation of size z is sampled with probability 1-exp(-z/interval).
+static u64 prof_scale(const ProfSite* s, size_t interval) {
+  if (s->alloc_count == 0)
+    return 0;
+  double avgsize = (double)s->alloc_bytes / (double)s->alloc_count;
+  double p = 1.0 - prof_exp(-avgsize / (double)interval);
+  return p > 0.0 ? (u64)((double)s->alloc_bytes / p) : s->alloc_bytes;
+}
+
+typedef struct ProfSymCtx {
+  FILE* fp;
+  u32   nframes; // frames written so far for the current stack
+} ProfSymCtx;
+
+static void prof_fwrite_frame(ProfSymCtx* ctx, const char* name) {
+  if (ctx->nframes++ > 0)
+    fputc(';', ctx->fp);
+  // ';' and ' ' have special meaning in the folded format
+  for (const char* p = name; *p; p++)
+    fputc((*p == ';' || *p == ' ') ? '_' : *p, ctx->fp);
+}
+
+#ifdef HAVE_LIBBACKTRACE
+typedef struct ProfPCInfo {
+  const char* names[8]; // function names, innermost inlined function first
+  u32         n;
+} ProfPCInfo;
+
+static int prof_bt_pcinfo(void* data, uintptr_t pc, const char* file, int line, const char* fn) {
+  ProfPCInfo* info = (ProfPCInfo*)data;
+  if (fn && info->n < countof(info->names))
+    info->names[info->n++] = fn;
+  return 0;
+}
+
+static void prof_bt_syminfo(
+  void* data, uintptr_t pc, const char* symname, uintptr_t symval, uintptr_t symsize)
+{
+  ProfPCInfo* info = (ProfPCInfo*)data;
+  if (symname && info->n == 0)
+    info->names[info->n++] = symname;
+}
+#endif
+
+static void prof_fwrite_pc(ProfSymCtx* ctx, uintptr_t pc) {
+  #ifdef HAVE_LIBBACKTRACE
+    struct backtrace_state* state = prof_backtrace_state();
+    if (state) {
+      ProfPCInfo info = { .n = 0 };
+      // pc is a return address; look up the call instruction
+      backtrace_pcinfo(state, pc - 1, prof_bt_pcinfo, prof_bt_error, &info);
+      if (info.n == 0)
+        backtrace_syminfo(state, pc - 1, prof_bt_syminfo, prof_bt_error, &info);
+      if (info.n > 0) {
+        // outermost function first
+        for (u32 i = info.n; i > 0; i--)
+          prof_fwrite_frame(ctx, info.names[i - 1]);
+        return;
+      }
+    }
+  #endif
+  char buf[24];
+  snprintf(buf, sizeof(buf), "0x%zx", (size_t)pc);
+  prof_fwrite_frame(ctx, buf);
+}
+
+void MemProfWriteFolded(Mem m, FILE* fp) {
+  // Folded stacks, as consumed by e.g. flamegraph.pl: one line per call site with the frames
+  // separated by ';', root first, followed by the estimated number of bytes allocated.
+  MProfWrapper* w = (MProfWrapper*)m;
+  mtx_lock(&w->mu);
+  ProfSymCtx ctx = { .fp = fp };
+  for (u32 i = 0; i < w->nsites; i++) {
+    ProfSite* s = &w->sites[i];
+    ctx.nframes = 0;
+    for (u32 j = s->depth; j > 0; j--)
+      prof_fwrite_pc(&ctx, s->pcs[j - 1]);
+    fprintf(fp, " %llu\n", prof_scale(s, w->interval));
+  }
+  mtx_unlock(&w->mu);
+}
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+R_TEST(mem_prof_ln) {
+  double xs[] = { 1.0, 0.5, 0.1, 0.001, 1e-12 };
+  double ys[] = { 0.0, -0.6931471805599453, -2.302585092994046, -6.907755278982137,
+                  -27.631021115928547 };
+  for (u32 i = 0; i < countof(xs); i++) {
+    double d = prof_ln(xs[i]) - ys[i];
+    assertf(d < 1e-4 && d > -1e-4, "prof_ln(%g) = %g, expected %g", xs[i], prof_ln(xs[i]), ys[i]);
+  }
+}
+
+static void* nullable prof_test_alloc_a(Mem m) { return memalloc(m, 100); }
+static void* nullable prof_test_alloc_b(Mem m) { return memalloc(m, 1000); }
+
+R_TEST(mem_prof) {
+  Mem m = assertnotnull(MemProfWrapper(MemLibC(), 4096));
+  MProfWrapper* w = (MProfWrapper*)m;
+
+  // allocate 1000 * 100 + 1000 * 1000 bytes, which should yield about 270 samples
+  void* ptrs[2000];
+  for (u32 i = 0; i < countof(ptrs); i += 2) {
+    ptrs[i] = assertnotnull(prof_test_alloc_a(m));
+    ptrs[i + 1] = assertnotnull(prof_test_alloc_b(m));
+  }
+  u64 nsamples = 0, inuse = 0;
+  for (u32 i = 0; i < w->nsites; i++) {
+    nsamples += w->sites[i].alloc_count;
+    inuse += w->sites[i].inuse_count;
+  }
+  assert(nsamples > 100 && nsamples < 500);
+  asserteq(inuse, nsamples);
+  #if defined(HAVE_LIBBACKTRACE) || defined(PROF_HAVE_EXECINFO)
+    assert(w->nsites >= 2); // at least one site for each of the two functions
+  #endif
+
+  // the scaled estimate should be within reasonable distance of the actual number of bytes
+  u64 estimate = 0;
+  for (u32 i = 0; i < w->nsites; i++)
+    estimate += prof_scale(&w->sites[i], w->interval);
+  u64 actual = 1000 * 100 + 1000 * 1000;
+  assertf(estimate > actual / 2 && estimate < actual * 2,
+    "estimate %llu, actual %llu", estimate, actual);
+
+  for (u32 i = 0; i < countof(ptrs); i++)
+    memfree(m, ptrs[i]);
+  inuse = 0;
+  for (u32 i = 0; i < w->nsites; i++)
+    inuse += w->sites[i].inuse_count;
+  asserteq(inuse, 0);
+
+  // reports can be written
+  FILE* fp = tmpfile();
+  if (fp) {
+    MemProfWriteHeapProfile(m, fp);
+    MemProfWriteFolded(m, fp);
+    assert(ftell(fp) > 0);
+    fclose(fp);
+  }
+
+  MemProfWrapperFree(m);
+}
+
+#endif /* R_TESTING_ENABLED */
+ASSUME_NONNULL_END
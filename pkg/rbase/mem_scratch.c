@@ -0,0 +1,136 @@
+#include "rbase.h"
+//
+// Scratch arenas are thread-local linear allocators for temporary memory.
+//
+// Every thread has MEM_SCRATCH_NARENAS arenas, created on first use and freed when the
+// thread exits. MemScratchBegin marks the current state of an arena and MemScratchEnd
+// rewinds the arena to that mark, so scopes nest and everything allocated in a scope is
+// freed at once. When the outermost scope of an arena ends, the arena is reset, which
+// returns memory beyond its recent high-water mark to the OS.
+//
+// More than one arena is needed for functions which use scratch memory while building
+// their result in scratch memory of their caller. Such a function passes the caller's
+// arena to MemScratchBegin as a conflict and gets another arena.
+//
+
+// SCRATCH_NPAGES_INIT is the initial size in pages of a scratch arena
+#define SCRATCH_NPAGES_INIT 16
+
+ASSUME_NONNULL_BEGIN
+
+typedef struct ScratchThread {
+  Mem nullable mem[MEM_SCRATCH_NARENAS];
+  u32          depth[MEM_SCRATCH_NARENAS]; // number of live scopes per arena
+  bool         init;
+} ScratchThread;
+
+static tss_t            scratch_tss;
+static r_sync_once_flag scratch_tss_once;
+static thread_local ScratchThread _scratch_thread;
+
+
+static void scratch_thread_release(void* arg) {
+  ScratchThread* st = arg;
+  for (u32 i = 0; i < MEM_SCRATCH_NARENAS; i++) {
+    if (st->mem[i])
+      MemLinearFree(st->mem[i]);
+  }
+  memset(st, 0, sizeof(*st));
+}
+
+inline static ScratchThread* scratch_thread() {
+  ScratchThread* st = &_scratch_thread;
+  if (R_UNLIKELY(!st->init)) {
+    r_sync_once(&scratch_tss_once, {
+      if (tss_create(&scratch_tss, scratch_thread_release) != thrd_success)
+        panic("tss_create");
+    });
+    tss_set(scratch_tss, st); // so that scratch_thread_release is called at thread exit
+    st->init = true;
+  }
+  return st;
+}
+
+MemScratch MemScratchBegin(Mem nullable conflict) {
+  ScratchThread* st = scratch_thread();
+  u32 i = 0;
+  while (st->mem[i] == conflict && conflict != NULL) {
+    if (++i == MEM_SCRATCH_NARENAS)
+      panic("MemScratchBegin: all scratch arenas conflict");
+  }
+  if (R_UNLIKELY(!st->mem[i])) {
+    st->mem[i] = MemLinearAlloc(SCRATCH_NPAGES_INIT);
+    if (!st->mem[i])
+      panic("MemScratchBegin: out of memory");
+  }
+  st->depth[i]++;
+  return (MemScratch){ .mem = st->mem[i], .mark = MemLinearMark(st->mem[i]) };
+}
+
+void MemScratchEnd(MemScratch s) {
+  ScratchThread* st = scratch_thread();
+  for (u32 i = 0; i < MEM_SCRATCH_NARENAS; i++) {
+    if (st->mem[i] != s.mem)
+      continue;
+    assertf(st->depth[i] > 0, "MemScratchEnd without MemScratchBegin");
+    if (--st->depth[i] == 0) {
+      MemLinearReset(s.mem);
+    } else {
+      MemLinearRewind(s.mem, s.mark);
+    }
+    return;
+  }
+  panic("MemScratchEnd: %p is not a scratch arena of this thread", s.mem);
+}
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+R_TEST(mem_scratch) {
+  MemScratch s1 = MemScratchBegin(NULL);
+  u8* p1 = assertnotnull(memalloc(s1.mem, 100));
+  memset(p1, 0xff, 100);
+
+  // nested scopes use the same arena and rewind to where they started
+  MemScratch s2 = MemScratchBegin(NULL);
+  asserteq(s2.mem, s1.mem);
+  u8* p2 = assertnotnull(memalloc(s2.mem, 100));
+  assert(p2 > p1);
+  MemScratchEnd(s2);
+  u8* p3 = assertnotnull(memalloc(s1.mem, 100));
+  asserteq(p3, p2);
+  asserteq(p1[99], 0xff); // allocations of the outer scope are untouched
+
+  // a conflicting arena is avoided
+  MemScratch s3 = MemScratchBegin(s1.mem);
+  assert(s3.mem != s1.mem);
+  u8* p4 = assertnotnull(memalloc(s3.mem, 100));
+  memset(p4, 0xee, 100);
+
+  // a scope nested in s3 which conflicts with s3 gets the first arena again
+  MemScratch s4 = MemScratchBegin(s3.mem);
+  asserteq(s4.mem, s1.mem);
+  u8* p5 = assertnotnull(memalloc(s4.mem, 100));
+  assert(p5 > p3);
+  MemScratchEnd(s4);
+  asserteq(p4[99], 0xee);
+  MemScratchEnd(s3);
+
+  MemScratchEnd(s1);
+
+  // the scope macro ends the scope when leaving the block
+  Mem nullable m = NULL;
+  MemScratchScope(s, NULL) {
+    m = s.mem;
+    assertnotnull(memalloc(s.mem, 100));
+  }
+  asserteq(m, s1.mem);
+  MemScratchScope(s, NULL) {
+    // the arena was reset when its outermost scope ended
+    UNUSED void* p = memalloc(s.mem, 100);
+    asserteq(p, p1);
+  }
+}
+
+#endif /* R_TESTING_ENABLED */
+ASSUME_NONNULL_END
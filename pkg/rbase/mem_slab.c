@@ -0,0 +1,449 @@
+#include "rbase.h"
+//
+// MemSlab is a size-class allocator.
+//
+// Small allocations (<= MEM_SLAB_MAXSIZE) are rounded up to one of SLAB_NCLASSES size
+// classes and served from slabs: SLAB_SIZE-aligned chunks of memory dedicated to a single
+// size class. Since slabs are aligned, the slab (and thus the size class) of any pointer is
+// found by masking off the low bits of the address; no per-allocation header is needed.
+//
+// Each thread has a cache with a free list per size class. alloc and free only touch the
+// calling thread's cache, except when a cache runs empty (refill) or grows too large
+// (flush), in which case a batch of objects is moved from or to the size class's shared
+// "depot" under a spin lock.
+//
+// Large allocations get a SLAB_SIZE-aligned page mapping of their own with a slab header
+// at the start, so that free can tell the two kinds apart by looking at the header.
+//
+
+// SLAB_SIZE is the size of a slab in bytes. Must be a power of two.
+#define SLAB_SIZE (64 * 1024)
+
+// SLAB_REGION_NSLABS is the number of slabs to map from the OS in one go
+#define SLAB_REGION_NSLABS 32
+
+// SLAB_CACHE_BYTES limits how much memory a thread cache holds per size class
+#define SLAB_CACHE_BYTES (64 * 1024)
+
+#define SLAB_NCLASSES   32
+#define SLAB_LARGE      0xffffffff // SlabHeader.sizeclass of large allocations
+#define SLAB_HEADERSIZE 64         // sizeof(SlabHeader), rounded up to a cache line
+
+static_assert(MEM_SLAB_MAXSIZE <= SLAB_SIZE / 4, "");
+
+ASSUME_NONNULL_BEGIN
+
+typedef struct SlabHeader {
+  u32    sizeclass; // index into slab_classsize or SLAB_LARGE
+  size_t npages;    // number of pages mapped (only used for large allocations)
+} SlabHeader;
+
+static_assert(sizeof(SlabHeader) <= SLAB_HEADERSIZE, "");
+
+typedef struct SlabObj {
+  struct SlabObj* nullable next;
+} SlabObj;
+
+// SlabBin is a thread-local free list for one size class
+typedef struct SlabBin {
+  SlabObj* nullable free;  // free objects
+  u32               nfree; // number of objects in free list
+  u8* nullable      bump;  // next never-used object in the current slab
+  u8* nullable      end;   // end of the current slab
+} SlabBin;
+
+typedef struct SlabThreadCache {
+  bool    init;
+  SlabBin bins[SLAB_NCLASSES];
+} SlabThreadCache;
+
+// SlabDepot holds free objects shared by all threads for one size class
+typedef struct SlabDepot {
+  SpinMutex         mu;
+  SlabObj* nullable free;
+  u32               nfree;
+} __attribute__((aligned(64))) SlabDepot;
+
+static const u32 slab_classsize[SLAB_NCLASSES] = {
+    16,   32,   48,   64,   80,   96,  112,  128,
+   160,  192,  224,  256,  320,  384,  448,  512,
+   640,  768,  896, 1024, 1280, 1536, 1792, 2048,
+  2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+};
+
+static SlabDepot slab_depots[SLAB_NCLASSES];
+
+// region which new slabs are carved out of
+static struct {
+  SpinMutex    mu;
+  u8* nullable next;
+  u8* nullable end;
+} slab_region;
+
+static tss_t            slab_tss;
+static r_sync_once_flag slab_tss_once;
+static thread_local SlabThreadCache _slab_tcache;
+
+
+// slab_sizeclass returns the size class for an allocation of size bytes.
+// size must be <= MEM_SLAB_MAXSIZE.
+inline static u32 slab_sizeclass(size_t size) {
+  assert_debug(size <= MEM_SLAB_MAXSIZE);
+  if (size <= 128)
+    return size == 0 ? 0 : (u32)((size - 1) >> 4);
+  // four classes per power of two, e.g. 129-256 => 160, 192, 224, 256
+  u32 lg = 63 - (u32)__builtin_clzll((u64)(size - 1));
+  return 8 + ((lg - 7) * 4) + (u32)(((size - 1) >> (lg - 2)) & 3);
+}
+
+inline static SlabHeader* slab_header(void* ptr) {
+  return (SlabHeader*)((uintptr_t)ptr & ~((uintptr_t)SLAB_SIZE - 1));
+}
+
+// slab_bin_limit returns the max number of free objects a thread cache may hold
+inline static u32 slab_bin_limit(u32 sizeclass) {
+  u32 n = SLAB_CACHE_BYTES / slab_classsize[sizeclass];
+  return MIN(MAX(n, 8u), 512u);
+}
+
+
+// slab_new allocates a new slab for sizeclass and returns its header
+static SlabHeader* nullable slab_new(u32 sizeclass) {
+  SpinMutexLock(&slab_region.mu);
+  if (slab_region.next == slab_region.end) {
+    size_t npages = (SLAB_REGION_NSLABS * SLAB_SIZE) / mem_pagesize();
+    u8* p = mem_pagealloc_aligned(npages, SLAB_SIZE, MemPageDefault);
+    if (!p) {
+      SpinMutexUnlock(&slab_region.mu);
+      return NULL;
+    }
+    slab_region.next = p;
+    slab_region.end = p + (SLAB_REGION_NSLABS * SLAB_SIZE);
+  }
+  SlabHeader* h = (SlabHeader*)slab_region.next;
+  slab_region.next += SLAB_SIZE;
+  SpinMutexUnlock(&slab_region.mu);
+  h->sizeclass = sizeclass;
+  return h;
+}
+
+
+// slab_bin_flush moves n objects from bin to the depot of sizeclass
+static void slab_bin_flush(SlabBin* bin, u32 sizeclass, u32 n) {
+  assert_debug(n > 0 && n <= bin->nfree);
+  SlabObj* head = bin->free;
+  SlabObj* tail = head;
+  for (u32 i = 1; i < n; i++)
+    tail = tail->next;
+  bin->free = tail->next;
+  bin->nfree -= n;
+
+  SlabDepot* d = &slab_depots[sizeclass];
+  SpinMutexLock(&d->mu);
+  tail->next = d->free;
+  d->free = head;
+  d->nfree += n;
+  SpinMutexUnlock(&d->mu);
+}
+
+
+// slab_bin_refill fills an empty bin with objects, either from the depot or a new slab.
+// Returns false if memory is exhausted.
+static bool slab_bin_refill(SlabBin* bin, u32 sizeclass) {
+  SlabDepot* d = &slab_depots[sizeclass];
+  u32 n = slab_bin_limit(sizeclass) / 2;
+
+  SpinMutexLock(&d->mu);
+  if (d->nfree > 0) {
+    // take up to n objects from the depot
+    n = MIN(n, d->nfree);
+    SlabObj* head = d->free;
+    SlabObj* tail = head;
+    for (u32 i = 1; i < n; i++)
+      tail = tail->next;
+    d->free = tail->next;
+    d->nfree -= n;
+    SpinMutexUnlock(&d->mu);
+    tail->next = NULL;
+    bin->free = head;
+    bin->nfree = n;
+    return true;
+  }
+  SpinMutexUnlock(&d->mu);
+
+  // depot is empty; start bump-allocating objects from a new slab
+  SlabHeader* h = slab_new(sizeclass);
+  if (!h)
+    return false;
+  bin->bump = (u8*)h + SLAB_HEADERSIZE;
+  bin->end = bin->bump + (
+    ((SLAB_SIZE - SLAB_HEADERSIZE) / slab_classsize[sizeclass]) * slab_classsize[sizeclass]);
+  return true;
+}
+
+
+// slab_tcache_release is called when a thread exits
+static void slab_tcache_release(void* arg) {
+  SlabThreadCache* tc = arg;
+  for (u32 c = 0; c < SLAB_NCLASSES; c++) {
+    SlabBin* bin = &tc->bins[c];
+    // return never-used objects of the current slab to the free list
+    u32 size = slab_classsize[c];
+    for (; bin->bump && bin->bump < bin->end; bin->bump += size) {
+      SlabObj* obj = (SlabObj*)bin->bump;
+      obj->next = bin->free;
+      bin->free = obj;
+      bin->nfree++;
+    }
+    if (bin->nfree > 0)
+      slab_bin_flush(bin, c, bin->nfree);
+  }
+  memset(tc, 0, sizeof(*tc));
+}
+
+
+inline static SlabThreadCache* slab_tcache() {
+  SlabThreadCache* tc = &_slab_tcache;
+  if (R_UNLIKELY(!tc->init)) {
+    r_sync_once(&slab_tss_once, {
+      if (tss_create(&slab_tss, slab_tcache_release) != thrd_success)
+        panic("tss_create");
+    });
+    tss_set(slab_tss, tc); // so that slab_tcache_release is called at thread exit
+    tc->init = true;
+  }
+  return tc;
+}
+
+
+static void* nullable slab_alloc_large(size_t size) {
+  size_t pagesize = mem_pagesize();
+  if (R_UNLIKELY(size > SIZE_MAX - SLAB_HEADERSIZE - pagesize))
+    return NULL;
+  size_t npages = align2(SLAB_HEADERSIZE + size, pagesize) / pagesize;
+  SlabHeader* h = mem_pagealloc_aligned(npages, SLAB_SIZE, MemPageDefault);
+  if (!h)
+    return NULL;
+  h->sizeclass = SLAB_LARGE;
+  h->npages = npages;
+  return (u8*)h + SLAB_HEADERSIZE;
+}
+
+
+// slab_usable_size returns the number of bytes usable at ptr
+inline static size_t slab_usable_size(SlabHeader* h) {
+  if (h->sizeclass == SLAB_LARGE)
+    return (h->npages * mem_pagesize()) - SLAB_HEADERSIZE;
+  return slab_classsize[h->sizeclass];
+}
+
+
+// slab_alloc1 allocates size bytes. Recycled objects are zeroed if zero is true.
+// Large allocations and never-used objects are fresh from the OS and already zero.
+inline static void* nullable slab_alloc1(size_t size, bool zero) {
+  if (R_UNLIKELY(size > MEM_SLAB_MAXSIZE))
+    return slab_alloc_large(size);
+
+  u32 sizeclass = slab_sizeclass(size);
+  SlabBin* bin = &slab_tcache()->bins[sizeclass];
+
+  if (R_LIKELY(bin->free != NULL)) {
+    SlabObj* obj = bin->free;
+    bin->free = obj->next;
+    bin->nfree--;
+    if (zero)
+      memset(obj, 0, size);
+    return obj;
+  }
+
+  if (bin->bump == bin->end && !slab_bin_refill(bin, sizeclass))
+    return NULL;
+
+  if (bin->free) {
+    // refilled from the depot
+    SlabObj* obj = bin->free;
+    bin->free = obj->next;
+    bin->nfree--;
+    if (zero)
+      memset(obj, 0, size);
+    return obj;
+  }
+
+  // never-used memory from a slab is already zeroed by the OS
+  void* p = bin->bump;
+  bin->bump += slab_classsize[sizeclass];
+  return p;
+}
+
+static void* nullable slab_alloc(Mem _, size_t size) {
+  return slab_alloc1(size, true);
+}
+
+static void* nullable slab_alloc_uninit(Mem _, size_t size) {
+  return slab_alloc1(size, false);
+}
+
+
+static void slab_free(Mem _, void* ptr) {
+  SlabHeader* h = slab_header(ptr);
+  if (R_UNLIKELY(h->sizeclass == SLAB_LARGE)) {
+    if (!mem_pagefree(h, h->npages))
+      panic("mem_pagefree failed (errno %d)", errno);
+    return;
+  }
+  assert_debug(h->sizeclass < SLAB_NCLASSES);
+  SlabBin* bin = &slab_tcache()->bins[h->sizeclass];
+  SlabObj* obj = ptr;
+  obj->next = bin->free;
+  bin->free = obj;
+  if (R_UNLIKELY(++bin->nfree > slab_bin_limit(h->sizeclass)))
+    slab_bin_flush(bin, h->sizeclass, bin->nfree / 2);
+}
+
+
+static void* nullable slab_realloc(Mem m, void* ptr, size_t newsize) {
+  SlabHeader* h = slab_header(ptr);
+  size_t oldsize = slab_usable_size(h);
+  if (newsize <= oldsize) {
+    // fits in the current allocation. Move small allocations to a smaller size class
+    // only when shrinking to less than half.
+    if (h->sizeclass == SLAB_LARGE || newsize >= oldsize / 2)
+      return ptr;
+  }
+  void* ptr2 = slab_alloc1(newsize, false);
+  if (ptr2) {
+    memcpy(ptr2, ptr, MIN(oldsize, newsize));
+    slab_free(m, ptr);
+  }
+  return ptr2;
+}
+
+
+static const MemAllocator _mem_slab = {
+  .alloc        = slab_alloc,
+  .realloc      = slab_realloc,
+  .free         = slab_free,
+  .alloc_uninit = slab_alloc_uninit,
+};
+
+Mem MemSlab() {
+  return &_mem_slab;
+}
+
+
+// ——————————————————————————————————————————————————————————————————————————————
+#if R_TESTING_ENABLED
+
+R_TEST(mem_slab_sizeclass) {
+  // every size maps to the smallest class that fits it
+  for (size_t size = 0; size <= MEM_SLAB_MAXSIZE; size++) {
+    u32 c = slab_sizeclass(size);
+    assertf(c < SLAB_NCLASSES, "size %zu", size);
+    assertf(slab_classsize[c] >= size, "size %zu", size);
+    assertf(c == 0 || slab_classsize[c - 1] < size, "size %zu", size);
+  }
+  asserteq(slab_sizeclass(MEM_SLAB_MAXSIZE), SLAB_NCLASSES - 1);
+}
+
+R_TEST(mem_slab) {
+  Mem m = MemSlab();
+
+  { // free objects are recycled by the same thread
+    void* p1 = memalloc(m, 24);
+    memfree(m, p1);
+    void* p2 = memalloc(m, 32); // same size class as 24
+    asserteq(p1, p2);
+    memfree(m, p2);
+  }
+
+  { // recycled memory is zeroed
+    u8* p1 = memalloc(m, 100);
+    memset(p1, 0xff, 100);
+    memfree(m, p1);
+    u8* p2 = memalloc(m, 100);
+    asserteq(p1, p2);
+    for (u32 i = 0; i < 100; i++)
+      asserteq(p2[i], 0);
+    memfree(m, p2);
+  }
+
+  { // realloc moves between size classes and preserves contents
+    char* p1 = memalloc(m, 20);
+    memcpy(p1, "hello", 6);
+    char* p2 = memrealloc(m, p1, 30); // same size class (32)
+    asserteq(p1, p2);
+    char* p3 = memrealloc(m, p2, 1000);
+    assertne(p2, p3);
+    assertcstreq(p3, "hello");
+    char* p4 = memrealloc(m, p3, MEM_SLAB_MAXSIZE * 4); // small -> large
+    assertcstreq(p4, "hello");
+    memfree(m, p4);
+  }
+
+  { // large allocations
+    size_t size = MEM_SLAB_MAXSIZE + 1;
+    u8* p = memalloc(m, size);
+    assertnotnull(p);
+    asserteq(slab_header(p)->sizeclass, SLAB_LARGE);
+    p[0] = 1;
+    p[size - 1] = 2;
+    memfree(m, p);
+    // sizes which overflow the page count fail.
+    // volatile keeps the compiler from warning about the size (-Walloc-size-larger-than)
+    volatile size_t hugesize = SIZE_MAX - 8;
+    assertnull(memalloc(m, hugesize));
+  }
+
+  { // exhaust a few slabs
+    void* ptrs[SLAB_SIZE / 16 * 3];
+    for (u32 i = 0; i < countof(ptrs); i++)
+      ptrs[i] = assertnotnull(memalloc(m, 16));
+    for (u32 i = 0; i < countof(ptrs); i++)
+      memfree(m, ptrs[i]);
+  }
+}
+
+
+typedef struct SlabTestThread {
+  thrd_t t;
+  u32    id;
+} SlabTestThread;
+
+static int slab_test_thread(void* arg) {
+  SlabTestThread* t = arg;
+  Mem m = MemSlab();
+  u8* ptrs[64] = {0};
+  size_t sizes[64] = {0};
+  u32 rnd = t->id + 1;
+  for (u32 i = 0; i < 20000; i++) {
+    u32 slot = i % countof(ptrs);
+    if (ptrs[slot]) {
+      // verify that nobody else wrote to our memory
+      for (size_t j = 0; j < sizes[slot]; j++)
+        assertf(ptrs[slot][j] == (u8)t->id, "memory shared between threads");
+      memfree(m, ptrs[slot]);
+    }
+    rnd = rnd * 1103515245 + 12345;
+    sizes[slot] = 1 + (rnd >> 8) % 600;
+    ptrs[slot] = assertnotnull(memalloc(m, sizes[slot]));
+    memset(ptrs[slot], (int)t->id, sizes[slot]);
+  }
+  for (u32 slot = 0; slot < countof(ptrs); slot++)
+    memfree(m, ptrs[slot]);
+  return 0;
+}
+
+R_TEST(mem_slab_mt) {
+  SlabTestThread threads[8];
+  for (u32 i = 0; i < countof(threads); i++) {
+    threads[i].id = i + 1;
+    asserteq(thrd_create(&threads[i].t, slab_test_thread, &threads[i]), thrd_success);
+  }
+  for (u32 i = 0; i < countof(threads); i++) {
+    int retval;
+    thrd_join(threads[i].t, &retval);
+  }
+}
+
+#endif /* R_TESTING_ENABLED */
+ASSUME_NONNULL_END
@@ -0,0 +1,244 @@
+#include "rbase.h"
+//
+// MemStatsWrapper counts allocations in shards of counters, each on its own cache line.
+// A thread always updates the same shard, picked round-robin the first time the thread
+// uses any stats wrapper, so threads rarely contend for a cache line.
+//
+// The number of live bytes is kept per shard and moved to the wrapper's shared counter in
+// batches of STATS_FLUSH_BYTES, which is also when the peak is updated. Thus the peak is
+// only as precise as STATS_FLUSH_BYTES per thread.
+//
+// Every allocation is prefixed by a header which records its size, since free isn't told
+// the size of the memory it frees.
+//
+
+#define STATS_NSHARDS     16
+#define STATS_FLUSH_BYTES (16 * 1024)
+#define STATS_HEADERSIZE  16 // sizeof(StatsHeader), rounded up to keep data 16-byte aligned
+
+// LINE_CACHE_SIZE is the size of a cache line of the target CPU
+#define LINE_CACHE_SIZE 64
+#define ATTR_ALIGNED_LINE_CACHE __attribute__((aligned(LINE_CACHE_SIZE)))
+
+ASSUME_NONNULL_BEGIN
+
+typedef struct StatsHeader {
+  size_t size; // size requested by the caller
+} StatsHeader;
+
+static_assert(sizeof(StatsHeader) <= STATS_HEADERSIZE, "");
+
+#define PTR_TO_SHDR(ptr) ( (StatsHeader*)(((u8*)(ptr)) - STATS_HEADERSIZE) )
+
+typedef struct StatsShard {
+  atomic_u64 nfree;
+  atomic_u64 nrealloc;
+  atomic_u64 nmove;
+  atomic_u64 bytes_alloc;
+  atomic_i64 pending; // live bytes not yet added to MStatsWrapper.live
+  atomic_u64 sizehist[MEM_STATS_NSIZECLASSES]; // also the number of allocations
+} ATTR_ALIGNED_LINE_CACHE StatsShard;
+
+typedef struct MStatsWrapper {
+  MemAllocator ma;
+  Mem          m;
+  atomic_i64   live ATTR_ALIGNED_LINE_CACHE;
+  atomic_i64   peak;
+  StatsShard   shards[STATS_NSHARDS];
+} MStatsWrapper;
+
+static atomic_u32 stats_nextshard = 0;
+static thread_local u32 stats_shardidx = 0; // shard index + 1 (0 means not yet assigned)
+
+inline static StatsShard* stats_shard(MStatsWrapper* w) {
+  if (R_UNLIKELY(stats_shardidx == 0))
+    stats_shardidx = 1 + (AtomicAdd(&stats_nextshard, 1) % STATS_NSHARDS);
+  return &w->shards[stats_shardidx - 1];
+}
+
+inline static u32 stats_sizeclass(size_t size) {
+  if (size <= 16)
+    return 0;
+  u32 c = (u32)(64 - __builtin_clzll((u64)size - 1)) - 4;
+  return MIN(c, MEM_STATS_NSIZECLASSES - 1);
+}
+
+static void stats_addlive(MStatsWrapper* w, StatsShard* sh, i64 delta) {
+  i64 pending = AtomicAdd(&sh->pending, delta) + delta;
+  if (R_LIKELY(pending < STATS_FLUSH_BYTES && pending > -STATS_FLUSH_BYTES))
+    return;
+  // move pending bytes to the shared counter
+  AtomicSub(&sh->pending, pending);
+  i64 live = AtomicAdd(&w->live, pending) + pending;
+  i64 peak = AtomicLoad(&w->peak);
+  while (live > peak && !AtomicCAS(&w->peak, &peak, live)) {
+  }
+}
+
+static void stats_countalloc(MStatsWrapper* w, StatsShard* sh, size_t size) {
+  AtomicAdd(&sh->bytes_alloc, (u64)size);
+  AtomicAdd(&sh->sizehist[stats_sizeclass(size)], 1);
+  stats_addlive(w, sh, (i64)size);
+}
+
+// stats_onalloc accounts for a new allocation h of the inner allocator
+inline static void* nullable stats_onalloc(
+  MStatsWrapper* w, StatsHeader* nullable h, size_t size)
+{
+  if (!h)
+    return NULL;
+  h->size = size;
+  stats_countalloc(w, stats_shard(w), size);
+  return (u8*)h + STATS_HEADERSIZE;
+}
+
+static void* nullable _mem_statsw_alloc(Mem m, size_t size) {
+  MStatsWrapper* w = (MStatsWrapper*)m;
+  return stats_onalloc(w, memalloc(w->m, STATS_HEADERSIZE + size), size);
+}
+
+static void* nullable _mem_statsw_alloc_uninit(Mem m, size_t size) {
+  MStatsWrapper* w = (MStatsWrapper*)m;
+  return stats_onalloc(w, memalloc_uninit(w->m, STATS_HEADERSIZE + size), size);
+}
+
+static void* nullable _mem_statsw_realloc(Mem m, void* ptr, size_t newsize) {
+  MStatsWrapper* w = (MStatsWrapper*)m;
+  StatsHeader* h = PTR_TO_SHDR(ptr);
+  size_t oldsize = h->size;
+  StatsHeader* h2 = w->m->realloc(w->m, h, STATS_HEADERSIZE + newsize);
+  if (!h2)
+    return NULL;
+  h2->size = newsize;
+  StatsShard* sh = stats_shard(w);
+  AtomicAdd(&sh->nrealloc, 1);
+  if (h2 != h)
+    AtomicAdd(&sh->nmove, 1);
+  if (newsize > oldsize)
+    AtomicAdd(&sh->bytes_alloc, (u64)(newsize - oldsize));
+  stats_addlive(w, sh, (i64)newsize - (i64)oldsize);
+  return (u8*)h2 + STATS_HEADERSIZE;
+}
+
+static void _mem_statsw_free(Mem m, void* ptr) {
+  MStatsWrapper* w = (MStatsWrapper*)m;
+  StatsHeader* h = PTR_TO_SHDR(ptr);
+  StatsShard* sh = stats_shard(w);
+  AtomicAdd(&sh->nfree, 1);
+  stats_addlive(w, sh, -(i64)h->size);
+  w->m->free(w->m, h);
+}
+
+Mem MemStatsWrapper(Mem inner) {
+  MStatsWrapper* w = memalloc_aligned(inner, sizeof(MStatsWrapper), LINE_CACHE_SIZE);
+  if (!w)
+    return NULL;
+  w->ma.alloc   = _mem_statsw_alloc;
+  w->ma.realloc = _mem_statsw_realloc;
+  w->ma.free    = _mem_statsw_free;
+  w->ma.alloc_uninit = _mem_statsw_alloc_uninit;
+  w->m = inner;
+  return (Mem)w;
+}
+
+Mem MemStatsWrapperFree(Mem m) {
+  MStatsWrapper* w = (MStatsWrapper*)m;
+  Mem inner = w->m;
+  memfree_aligned(inner, w, sizeof(MStatsWrapper));
+  return inner;
+}
+
+void MemStatsWrapperSnapshot(Mem m, MemStats* st) {
+  MStatsWrapper* w = (MStatsWrapper*)m;
+  memset(st, 0, sizeof(*st));
+  i64 live = AtomicLoad(&w->live);
+  for (u32 i = 0; i < STATS_NSHARDS; i++) {
+    StatsShard* sh = &w->shards[i];
+    st->nfree       += AtomicLoad(&sh->nfree);
+    st->nrealloc    += AtomicLoad(&sh->nrealloc);
+    st->nmove       += AtomicLoad(&sh->nmove);
+    st->bytes_alloc += AtomicLoad(&sh->bytes_alloc);
+    live            += AtomicLoad(&sh->pending);
+    for (u32 c = 0; c < MEM_STATS_NSIZECLASSES; c++) {
+      u64 n = AtomicLoad(&sh->sizehist[c]);
+      st->sizehist[c] += n;
+      st->nalloc += n;
+    }
+  }
+  // counters are read one by one while other threads may be updating them
+  st->nlive = st->nalloc > st->nfree ? st->nalloc - st->nfree : 0;
+  st->bytes_live = live > 0 ? (u64)live : 0;
+  st->bytes_peak = MAX((u64)MAX(AtomicLoad(&w->peak), 0), st->bytes_live);
+}
+
+void MemStatsReport(FILE* fp, const MemStats* st) {
+  fprintf(fp,
+    "allocations: %llu (%llu live, %llu freed)\n"
+    "reallocs:    %llu (%llu moved)\n"
+    "bytes:       %llu allocated, %llu live, %llu peak\n"
+    "sizes:\n",
+    st->nalloc, st->nlive, st->nfree,
+    st->nrealloc, st->nmove,
+    st->bytes_alloc, st->bytes_live, st->bytes_peak);
+  for (u32 c = 0; c < MEM_STATS_NSIZECLASSES; c++) {
+    if (st->sizehist[c] == 0)
+      continue;
+    if (c == MEM_STATS_NSIZECLASSES - 1) {
+      fprintf(fp, "  > %-10llu %llu\n", 16llu << (c - 1), st->sizehist[c]);
+    } else {
+      fprintf(fp, "  <= %-9llu %llu\n", 16llu << c, st->sizehist[c]);
+    }
+  }
+}
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+R_TEST(mem_stats_sizeclass) {
+  asserteq(stats_sizeclass(0), 0);
+  asserteq(stats_sizeclass(16), 0);
+  asserteq(stats_sizeclass(17), 1);
+  asserteq(stats_sizeclass(32), 1);
+  asserteq(stats_sizeclass(33), 2);
+  asserteq(stats_sizeclass((size_t)16 << (MEM_STATS_NSIZECLASSES - 2)),
+           MEM_STATS_NSIZECLASSES - 2);
+  asserteq(stats_sizeclass(((size_t)16 << (MEM_STATS_NSIZECLASSES - 2)) + 1),
+           MEM_STATS_NSIZECLASSES - 1);
+  asserteq(stats_sizeclass((size_t)1 << 40), MEM_STATS_NSIZECLASSES - 1);
+}
+
+R_TEST(mem_stats) {
+  Mem m = assertnotnull(MemStatsWrapper(MemLibC()));
+  asserteq((uintptr_t)m % LINE_CACHE_SIZE, 0);
+  MemStats st;
+
+  void* ptrs[100];
+  for (u32 i = 0; i < countof(ptrs); i++)
+    ptrs[i] = assertnotnull(memalloc(m, 1000));
+  MemStatsWrapperSnapshot(m, &st);
+  asserteq(st.nalloc, countof(ptrs));
+  asserteq(st.nlive, countof(ptrs));
+  asserteq(st.bytes_live, countof(ptrs) * 1000);
+  asserteq(st.bytes_alloc, countof(ptrs) * 1000);
+  asserteq(st.sizehist[stats_sizeclass(1000)], countof(ptrs));
+
+  ptrs[0] = assertnotnull(memrealloc(m, ptrs[0], 2000));
+  MemStatsWrapperSnapshot(m, &st);
+  asserteq(st.nrealloc, 1);
+  asserteq(st.bytes_live, countof(ptrs) * 1000 + 1000);
+
+  for (u32 i = 0; i < countof(ptrs); i++)
+    memfree(m, ptrs[i]);
+  MemStatsWrapperSnapshot(m, &st);
+  asserteq(st.nfree, countof(ptrs));
+  asserteq(st.nlive, 0);
+  asserteq(st.bytes_live, 0);
+  // peak is precise to STATS_FLUSH_BYTES
+  assert(st.bytes_peak + STATS_FLUSH_BYTES >= countof(ptrs) * 1000 + 1000);
+  assert(st.bytes_peak <= countof(ptrs) * 1000 + 1000);
+
+  MemStatsWrapperFree(m);
+}
+
+#endif /* R_TESTING_ENABLED */
+ASSUME_NONNULL_END
@@ -0,0 +1,294 @@
+#include "rbase.h"
+#ifdef __linux__
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+//
+// mem_trim releases memory which allocators hold on to for reuse.
+//
+// Thread-safe allocators register a handler which mem_trim calls. Allocators which are not
+// thread safe, like MemLinearAlloc, can't be trimmed from another thread. Instead they
+// compare mem_trim_epoch to the value they saw last time, at a point where they would
+// otherwise retain memory (e.g. MemLinearReset) and release memory if it changed.
+//
+// The pressure watcher is a thread which polls Linux's pressure stall information (PSI) for
+// the process's cgroup, or for the whole system if that's not available, and calls mem_trim
+// when tasks spend too much time waiting for memory.
+//
+
+// TRIM_MAXHANDLERS is the max number of handlers registered at once
+#define TRIM_MAXHANDLERS 32
+
+// PRESSURE_MININTERVAL is the minimum time between trims by the pressure watcher, in
+// milliseconds. It's the window of the "avg10" PSI metric, so that a trim has a chance to
+// lower pressure before the watcher decides that another trim is needed.
+#define PRESSURE_MININTERVAL 10000
+
+ASSUME_NONNULL_BEGIN
+
+typedef struct TrimHandler {
+  MemTrimHandler f;
+  void* nullable ctx;
+} TrimHandler;
+
+static struct {
+  SpinMutex   mu; // protects handlers and nhandlers
+  u32         nhandlers;
+  TrimHandler handlers[TRIM_MAXHANDLERS];
+  atomic_u32  ncalling; // number of mem_trim calls currently calling handlers
+  atomic_u32  epoch;
+} trim;
+
+// trim_depth is the number of handlers the current thread is calling
+static thread_local u32 trim_depth;
+
+bool mem_trim_register(MemTrimHandler f, void* nullable ctx) {
+  bool ok = false;
+  SpinMutexLock(&trim.mu);
+  if (trim.nhandlers < TRIM_MAXHANDLERS) {
+    trim.handlers[trim.nhandlers++] = (TrimHandler){ f, ctx };
+    ok = true;
+  }
+  SpinMutexUnlock(&trim.mu);
+  return ok;
+}
+
+void mem_trim_unregister(MemTrimHandler f, void* nullable ctx) {
+  SpinMutexLock(&trim.mu);
+  for (u32 i = 0; i < trim.nhandlers; i++) {
+    if (trim.handlers[i].f == f && trim.handlers[i].ctx == ctx) {
+      trim.handlers[i] = trim.handlers[--trim.nhandlers];
+      break;
+    }
+  }
+  SpinMutexUnlock(&trim.mu);
+  // Wait for mem_trim calls which may have copied the handler to finish so that the caller
+  // can free ctx once we return. A handler unregistering itself (or another handler) can't
+  // wait for its own mem_trim call to finish.
+  if (trim_depth == 0) {
+    while (AtomicLoadAcq(&trim.ncalling) > 0)
+      thrd_yield();
+  }
+}
+
+u32 mem_trim_epoch() {
+  return AtomicLoad(&trim.epoch);
+}
+
+size_t mem_trim() {
+  AtomicAdd(&trim.epoch, 1);
+  size_t nbytes = mem_pagecache_drain();
+
+  // Copy the handlers so that they are called without holding the lock. This way
+  // concurrent calls don't spin while handlers run and handlers may call mem_trim_register,
+  // mem_trim_unregister and mem_trim.
+  TrimHandler handlers[TRIM_MAXHANDLERS];
+  SpinMutexLock(&trim.mu);
+  u32 nhandlers = trim.nhandlers;
+  memcpy(handlers, trim.handlers, nhandlers * sizeof(TrimHandler));
+  AtomicAdd(&trim.ncalling, 1);
+  SpinMutexUnlock(&trim.mu);
+
+  trim_depth++;
+  for (u32 i = 0; i < nhandlers; i++)
+    nbytes += handlers[i].f(handlers[i].ctx);
+  trim_depth--;
+  atomic_fetch_sub_explicit(&trim.ncalling, 1, r_memory_order(release));
+  return nbytes;
+}
+
+// ------------------------------------------------------------------------------------
+// pressure watcher
+
+// pressure_parse returns the "some avg10" value of PSI text, which is the percentage of
+// time in the last 10 seconds that at least one task was stalled waiting for memory.
+// Returns -1 if text is not valid PSI data.
+static double pressure_parse(const char* text) {
+  const char* prefix = "some avg10=";
+  const char* p = strstr(text, prefix);
+  if (!p)
+    return -1;
+  p += strlen(prefix);
+  char* end;
+  double v = strtod(p, &end);
+  return end == p ? -1 : v;
+}
+
+#ifdef __linux__
+
+static struct {
+  r_sync_once_flag once;
+  mtx_t            mu; // serializes mem_pressure_watch and mem_pressure_unwatch
+  bool             running;
+  Sema             stop;
+  thrd_t           t;
+  int              fd;
+  double           threshold;
+  u32              interval_ms;
+} pressure;
+
+static void pressure_init_once() {
+  r_sync_once(&pressure.once, {
+    if (mtx_init(&pressure.mu, mtx_plain) != thrd_success)
+      panic("mtx_init");
+  });
+}
+
+// pressure_read returns the current "some avg10" value, or -1 on error
+static double pressure_read(int fd) {
+  char buf[256];
+  ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (n <= 0)
+    return -1;
+  buf[n] = 0;
+  return pressure_parse(buf);
+}
+
+static int pressure_thread(void* arg) {
+  u64 lasttrim = 0;
+  while (!SemaTimedWait(&pressure.stop, (u64)pressure.interval_ms * 1000)) {
+    if (pressure_read(pressure.fd) < pressure.threshold)
+      continue;
+    u64 now = nanotime();
+    if (lasttrim != 0 && now - lasttrim < (u64)PRESSURE_MININTERVAL * 1000000)
+      continue;
+    lasttrim = now;
+    mem_trim();
+  }
+  return 0;
+}
+
+static bool pressure_start(double threshold, u32 interval_ms) {
+  // cgroup v2 of the process (the container), then the whole system
+  const char* paths[] = { "/sys/fs/cgroup/memory.pressure", "/proc/pressure/memory" };
+  int fd = -1;
+  for (u32 i = 0; i < countof(paths) && fd == -1; i++) {
+    fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && pressure_read(fd) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd == -1)
+    return false;
+  pressure.fd = fd;
+  pressure.threshold = threshold;
+  pressure.interval_ms = MAX(interval_ms, 1);
+  if (!SemaInit(&pressure.stop, 0)) {
+    close(fd);
+    return false;
+  }
+  if (thrd_create(&pressure.t, pressure_thread, NULL) != thrd_success) {
+    SemaDispose(&pressure.stop);
+    close(fd);
+    return false;
+  }
+  return true;
+}
+
+bool mem_pressure_watch(double threshold, u32 interval_ms) {
+  pressure_init_once();
+  mtx_lock(&pressure.mu);
+  if (!pressure.running)
+    pressure.running = pressure_start(threshold, interval_ms);
+  bool ok = pressure.running;
+  mtx_unlock(&pressure.mu);
+  return ok;
+}
+
+void mem_pressure_unwatch() {
+  pressure_init_once();
+  mtx_lock(&pressure.mu);
+  if (pressure.running) {
+    SemaSignal(&pressure.stop, 1);
+    thrd_join(pressure.t, NULL);
+    SemaDispose(&pressure.stop);
+    close(pressure.fd);
+    pressure.running = false;
+  }
+  mtx_unlock(&pressure.mu);
+}
+
+#else
+
+bool mem_pressure_watch(double threshold, u32 interval_ms) {
+  return false;
+}
+
+void mem_pressure_unwatch() {}
+
+#endif // __linux__
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+static size_t trim_test_handler(void* nullable ctx) {
+  (*(u32*)ctx)++;
+  return 100;
+}
+
+// trim_test_reentrant_handler unregisters itself and registers trim_test_handler
+static size_t trim_test_reentrant_handler(void* nullable ctx) {
+  mem_trim_unregister(trim_test_reentrant_handler, ctx);
+  UNUSED bool ok = mem_trim_register(trim_test_handler, ctx);
+  assert(ok);
+  return 0;
+}
+
+R_TEST(mem_trim) {
+  u32 ncalls = 0;
+  UNUSED bool ok = mem_trim_register(trim_test_handler, &ncalls);
+  assert(ok);
+  u32 epoch = mem_trim_epoch();
+
+  // mem_trim drains the page cache and calls handlers
+  mem_pagefree(assertnotnull(mem_pagealloc(1, MemPageDefault)), 1);
+  UNUSED size_t nbytes = mem_trim();
+  assert(nbytes >= 100 + mem_pagesize());
+  asserteq(ncalls, 1);
+  asserteq(mem_trim_epoch(), epoch + 1);
+
+  mem_trim_unregister(trim_test_handler, &ncalls);
+  mem_trim();
+  asserteq(ncalls, 1);
+
+  // handlers may register and unregister handlers
+  ok = mem_trim_register(trim_test_reentrant_handler, &ncalls);
+  assert(ok);
+  mem_trim();
+  asserteq(ncalls, 1);
+  mem_trim();
+  asserteq(ncalls, 2);
+  mem_trim_unregister(trim_test_handler, &ncalls);
+
+  // linear allocators release their retained blocks at the next reset after mem_trim
+  Mem m = assertnotnull(MemLinearAlloc(1));
+  MemLinearStats st;
+  for (u32 i = 0; i < 2; i++) {
+    assertnotnull(memalloc(m, mem_pagesize() * 4));
+    MemLinearReset(m);
+  }
+  MemLinearGetStats(m, &st);
+  assert(st.retained > 0);
+  mem_trim();
+  MemLinearReset(m);
+  MemLinearGetStats(m, &st);
+  asserteq(st.retained, 0);
+  MemLinearFree(m);
+}
+
+R_TEST(mem_pressure) {
+  const char* text =
+    "some avg10=1.25 avg60=0.50 avg300=0.10 total=123\n"
+    "full avg10=0.75 avg60=0.25 avg300=0.00 total=45\n";
+  asserteq(pressure_parse(text), 1.25);
+  asserteq(pressure_parse("full avg10=0.75"), -1);
+  asserteq(pressure_parse("some avg10=x"), -1);
+
+  // the watcher may not be available, e.g. in containers without PSI
+  if (mem_pressure_watch(10.0, 1))
+    mem_pressure_unwatch();
+}
+
+#endif /* R_TESTING_ENABLED */
+ASSUME_NONNULL_END
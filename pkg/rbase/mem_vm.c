@@ -0,0 +1,162 @@
+#include "rbase.h"
+//
+// MemVM places every allocation at the start of a reserved region of address space:
+//
+//   region.base                                                region.base + region.size
+//   ┌──────────┬─────────────────────┬──────────────────────────────────────────┐
+//   │ VMHeader │ data                │ reserved (PROT_NONE)                     │
+//   └──────────┴─────────────────────┴──────────────────────────────────────────┘
+//   ├───────── committed ────────────┤
+//
+// Growing an allocation commits more of its region, at least doubling the committed size
+// each time to limit the number of syscalls.
+//
+
+// VM_HEADERSIZE is sizeof(VMHeader), rounded up to keep data aligned to a cache line
+#define VM_HEADERSIZE 64
+
+ASSUME_NONNULL_BEGIN
+
+typedef struct VMHeader {
+  MemVMRegion region;
+  size_t      committed; // bytes committed, starting at region.base
+} VMHeader;
+
+static_assert(sizeof(VMHeader) <= VM_HEADERSIZE, "");
+
+#define PTR_TO_VMHDR(ptr) ( (VMHeader*)(((u8*)(ptr)) - VM_HEADERSIZE) )
+
+static void* nullable vm_alloc(Mem m, size_t size) {
+  MemVM* a = (MemVM*)m;
+  const size_t pagesize = mem_pagesize();
+  if (R_UNLIKELY(size > SIZE_MAX - VM_HEADERSIZE - pagesize))
+    return NULL;
+  size_t commitsize = align2(VM_HEADERSIZE + size, pagesize);
+  MemVMRegion r = mem_vmreserve(MAX(a->reserve, commitsize));
+  if (!r.base)
+    return NULL;
+  if (!mem_vmcommit(r, 0, commitsize)) {
+    mem_vmrelease(r);
+    return NULL;
+  }
+  // fresh pages are zeroed, as memalloc promises
+  VMHeader* h = (VMHeader*)r.base;
+  h->region = r;
+  h->committed = commitsize;
+  return (u8*)h + VM_HEADERSIZE;
+}
+
+static void vm_free(Mem m, void* ptr) {
+  VMHeader* h = PTR_TO_VMHDR(ptr);
+  if (!mem_vmrelease(h->region))
+    panic("mem_vmrelease failed (errno %d)", errno);
+}
+
+static void* nullable vm_realloc(Mem m, void* ptr, size_t newsize) {
+  VMHeader* h = PTR_TO_VMHDR(ptr);
+  if (R_UNLIKELY(newsize > SIZE_MAX - VM_HEADERSIZE - mem_pagesize()))
+    return NULL;
+  size_t need = VM_HEADERSIZE + newsize;
+  if (need <= h->committed)
+    return ptr;
+
+  if (need <= h->region.size) {
+    // grow in place
+    size_t commitsize = MIN(
+      MAX(align2(need, mem_pagesize()), h->committed * 2),
+      h->region.size);
+    if (!mem_vmcommit(h->region, h->committed, commitsize - h->committed))
+      return NULL;
+    h->committed = commitsize;
+    return ptr;
+  }
+
+  // Grown beyond the reserved region; move to a larger region.
+  // Reserve twice the space needed to make this rare.
+  MemVM* a = (MemVM*)m;
+  MemVM a2 = { a->ma, MAX(a->reserve, need <= SIZE_MAX / 2 ? need * 2 : need) };
+  void* ptr2 = vm_alloc(&a2.ma, newsize);
+  if (ptr2) {
+    memcpy(ptr2, ptr, h->committed - VM_HEADERSIZE);
+    vm_free(m, ptr);
+  }
+  return ptr2;
+}
+
+Mem MemVMInit(MemVM* a, size_t reserve) {
+  a->ma = (MemAllocator){
+    .alloc   = vm_alloc,
+    .realloc = vm_realloc,
+    .free    = vm_free,
+  };
+  a->reserve = reserve;
+  return &a->ma;
+}
+
+// ------------------------------------------------------------------------------------
+#if R_TESTING_ENABLED
+
+R_TEST(mem_vmregion) {
+  const size_t pagesize = mem_pagesize();
+  MemVMRegion r = mem_vmreserve((size_t)1024 * 1024 * 1024);
+  assertnotnull(r.base);
+  asserteq(r.size, (size_t)1024 * 1024 * 1024);
+
+  // commit two pages in the middle
+  size_t offs = r.size / 2;
+  assert(mem_vmcommit(r, offs, pagesize * 2));
+  u8* p = (u8*)r.base + offs;
+  asserteq(p[0], 0);
+  memset(p, 0xff, pagesize * 2);
+
+  // decommitted memory reads as zero when committed again
+  assert(mem_vmdecommit(r, offs, pagesize * 2));
+  assert(mem_vmcommit(r, offs, pagesize * 2));
+  asserteq(p[0], 0);
+  asserteq(p[pagesize * 2 - 1], 0);
+
+  assert(mem_vmrelease(r));
+}
+
+R_TEST(mem_vm) {
+  const size_t pagesize = mem_pagesize();
+  MemVM vm;
+  Mem m = MemVMInit(&vm, 64 * pagesize);
+
+  // allocations are zeroed
+  u8* p = assertnotnull(memalloc(m, 100));
+  for (u32 i = 0; i < 100; i++)
+    asserteq(p[i], 0);
+  memset(p, 1, 100);
+
+  // grows in place within the reserved region
+  u8* p2 = assertnotnull(memrealloc(m, p, 32 * pagesize));
+  asserteq(p2, p);
+  p2[32 * pagesize - 1] = 2;
+  asserteq(p2[99], 1);
+  asserteq(p2[100], 0);
+  p2 = assertnotnull(memrealloc(m, p2, 64 * pagesize - VM_HEADERSIZE));
+  asserteq(p2, p);
+
+  // grows beyond the reserved region by moving
+  u8* p3 = assertnotnull(memrealloc(m, p2, 128 * pagesize));
+  assertne(p3, p);
+  asserteq(p3[99], 1);
+  asserteq(p3[32 * pagesize - 1], 2);
+  p3[128 * pagesize - 1] = 3;
+
+  // shrinking is a noop
+  u8* p4 = memrealloc(m, p3, 10);
+  asserteq(p4, p3);
+
+  // sizes which would overflow fail
+  volatile size_t hugesize = SIZE_MAX;
+  assertnull(memrealloc(m, p4, hugesize));
+  assertnull(memrealloc(m, p4, hugesize - VM_HEADERSIZE + 1));
+  assertnull(memalloc(m, hugesize));
+
+  memfree(m, p4);
+}
+
+#endif /* R_TESTING_ENABLED */
+ASSUME_NONNULL_END
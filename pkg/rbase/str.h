@@ -73,11 +73,20 @@ static bool str_hasprefix(Str s, Str prefix);
 bool        str_hasprefixn(Str s, const char* prefix, u32 len);
 static bool str_hasprefixcstr(Str s, const char* prefix);
 
-// how string memory is managed
+// how string memory is managed.
+// Define R_STR_MEM to an expression of type Mem to allocate strings with that allocator,
+// for example a MemVM allocator to let large strings grow in place.
+// Define R_STR_MEMALLOC, R_STR_MEMREALLOC and R_STR_MEMFREE to take over completely.
 #ifndef R_STR_MEMALLOC
-  #define R_STR_MEMALLOC(size)        malloc((size))
-  #define R_STR_MEMREALLOC(ptr, size) realloc((ptr), (size))
-  #define R_STR_MEMFREE(ptr)          free((ptr))
+  #ifdef R_STR_MEM
+    #define R_STR_MEMALLOC(size)        memalloc((R_STR_MEM), (size))
+    #define R_STR_MEMREALLOC(ptr, size) memrealloc((R_STR_MEM), (ptr), (size))
+    #define R_STR_MEMFREE(ptr)          memfree((R_STR_MEM), (ptr))
+  #else
+    #define R_STR_MEMALLOC(size)        malloc((size))
+    #define R_STR_MEMREALLOC(ptr, size) realloc((ptr), (size))
+    #define R_STR_MEMFREE(ptr)          free((ptr))
+  #endif
 #endif
 
 // -----------------------------------------------------------------------------------------------